@@ -0,0 +1,118 @@
+/**
+  \class    OIStrategyBackend
+  \brief    Inference engine of the OI seeding strategy DNN: TensorFlow session, native kernel or ONNX Runtime
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyBackend.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <algorithm>
+
+OIStrategyBackend::Type OIStrategyBackend::typeFromName(const std::string& name) {
+  if (name == "tensorflow")
+    return Type::TensorFlow;
+  if (name == "native")
+    return Type::Native;
+  if (name == "onnx")
+    return Type::ONNX;
+  throw cms::Exception("Configuration") << "OIStrategyBackend: unknown DNN backend " << name;
+}
+
+const char* OIStrategyBackend::name(Type type) {
+  switch (type) {
+    case Type::Native:
+      return "native";
+    case Type::ONNX:
+      return "onnx";
+    default:
+      return "tensorflow";
+  }
+}
+
+//
+// TensorFlow
+//
+OIStrategyTFBackend::OIStrategyTFBackend(const std::string& graphPath,
+                                         const std::string& inputLayer,
+                                         const std::string& outputLayer)
+    : graphDef_(tensorflow::loadGraphDef(graphPath)),
+      session_(tensorflow::createSession(graphDef_)),
+      inputLayer_(inputLayer),
+      outputLayer_(outputLayer) {}
+
+OIStrategyTFBackend::~OIStrategyTFBackend() {
+  tensorflow::closeSession(session_);
+  delete graphDef_;
+}
+
+void OIStrategyTFBackend::evaluate(const std::vector<float>& input,
+                                   unsigned int nRows,
+                                   unsigned int nInputs,
+                                   std::vector<float>& output) const {
+  tensorflow::Tensor inputTensor(tensorflow::DT_FLOAT, {nRows, nInputs});
+  std::copy(input.begin(), input.end(), inputTensor.flat<float>().data());
+  std::vector<tensorflow::Tensor> outputs;
+  tensorflow::run(session_, {{inputLayer_, inputTensor}}, {outputLayer_}, &outputs);
+  const tensorflow::Tensor& outputTensor = outputs[0];
+  output.assign(outputTensor.flat<float>().data(), outputTensor.flat<float>().data() + outputTensor.NumElements());
+}
+
+//
+// Native kernel
+//
+OIStrategyNativeBackend::OIStrategyNativeBackend(const std::string& graphPath,
+                                                 const std::string& inputLayer,
+                                                 const std::string& outputLayer,
+                                                 const std::string& precision)
+    // The graph is only needed to extract the layers
+    : OIStrategyNativeBackend(std::make_unique<OIStrategyMLP>(
+                                  *std::unique_ptr<tensorflow::GraphDef>(tensorflow::loadGraphDef(graphPath)),
+                                  inputLayer,
+                                  outputLayer),
+                              precision) {}
+
+OIStrategyNativeBackend::OIStrategyNativeBackend(std::unique_ptr<OIStrategyMLP> mlp, const std::string& precision)
+    : mlp_(std::move(mlp)) {
+  // The float layers are only needed to quantize them
+  if (precision != "float") {
+    quantizedMlp_ =
+        std::make_unique<OIStrategyQuantizedMLP>(*mlp_, OIStrategyQuantizedMLP::precisionFromName(precision));
+    mlp_.reset();
+  }
+}
+
+void OIStrategyNativeBackend::evaluate(const std::vector<float>& input,
+                                       unsigned int nRows,
+                                       unsigned int nInputs,
+                                       std::vector<float>& output) const {
+  const unsigned int nExpected = mlp_ ? mlp_->nInputs() : quantizedMlp_->nInputs();
+  if (nInputs != nExpected)
+    throw cms::Exception("OIStrategyBackend") << "Native DNN expects " << nExpected << " inputs, got " << nInputs;
+  if (mlp_) {
+    output.resize(nRows * mlp_->nOutputs());
+    mlp_->evaluate(input.data(), nRows, output.data());
+  } else {
+    output.resize(nRows * quantizedMlp_->nOutputs());
+    quantizedMlp_->evaluate(input.data(), nRows, output.data());
+  }
+}
+
+//
+// ONNX Runtime
+//
+OIStrategyOnnxBackend::OIStrategyOnnxBackend(const std::string& onnxPath,
+                                             const std::string& inputLayer,
+                                             const std::string& outputLayer)
+    : session_(std::make_unique<cms::Ort::ONNXRuntime>(onnxPath)),
+      inputNames_({inputLayer}),
+      outputNames_({outputLayer}) {}
+
+void OIStrategyOnnxBackend::evaluate(const std::vector<float>& input,
+                                     unsigned int nRows,
+                                     unsigned int nInputs,
+                                     std::vector<float>& output) const {
+  // The batch dimension of the converted model is dynamic
+  cms::Ort::FloatArrays inputs{input};
+  cms::Ort::FloatArrays outputs = session_->run(inputNames_, inputs, outputNames_, nRows);
+  output = std::move(outputs.front());
+}
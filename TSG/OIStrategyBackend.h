@@ -0,0 +1,99 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyBackend_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyBackend_H
+
+/**
+ \class    OIStrategyBackend
+ \brief    Inference engine of the OI seeding strategy DNN: TensorFlow session, native kernel or ONNX Runtime
+
+ All backends take one row of inputs per L2, in the input order of the model, and return the class
+ outputs row by row. They are evaluated concurrently from all streams, so evaluate() is const and
+ thread-safe.
+ */
+
+#include "PhysicsTools/ONNXRuntime/interface/ONNXRuntime.h"
+#include "PhysicsTools/TensorFlow/interface/TensorFlow.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyMLP.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyQuantizedMLP.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class OIStrategyBackend {
+public:
+  enum class Type { TensorFlow, Native, ONNX };
+
+  virtual ~OIStrategyBackend() {}
+
+  /// Evaluate nRows input rows (nRows x nInputs, row-major) into output (nRows x number of classes)
+  virtual void evaluate(const std::vector<float>& input,
+                        unsigned int nRows,
+                        unsigned int nInputs,
+                        std::vector<float>& output) const = 0;
+
+  virtual Type type() const = 0;
+
+  /// Backend type from its configuration name: "tensorflow", "native" or "onnx"
+  static Type typeFromName(const std::string& name);
+  static const char* name(Type type);
+};
+
+/// Frozen graph run in a TensorFlow session
+class OIStrategyTFBackend : public OIStrategyBackend {
+public:
+  OIStrategyTFBackend(const std::string& graphPath, const std::string& inputLayer, const std::string& outputLayer);
+  ~OIStrategyTFBackend() override;
+
+  void evaluate(const std::vector<float>& input,
+                unsigned int nRows,
+                unsigned int nInputs,
+                std::vector<float>& output) const override;
+  Type type() const override { return Type::TensorFlow; }
+
+private:
+  tensorflow::GraphDef* graphDef_;
+  tensorflow::Session* session_;
+  const std::string inputLayer_;
+  const std::string outputLayer_;
+};
+
+/// Dense layers of the frozen graph evaluated by OIStrategyMLP, or by OIStrategyQuantizedMLP with
+/// precision "fp16" or "int8" instead of "float"
+class OIStrategyNativeBackend : public OIStrategyBackend {
+public:
+  OIStrategyNativeBackend(const std::string& graphPath,
+                          const std::string& inputLayer,
+                          const std::string& outputLayer,
+                          const std::string& precision);
+  /// Layers already extracted, e.g. from a strategy bundle
+  OIStrategyNativeBackend(std::unique_ptr<OIStrategyMLP> mlp, const std::string& precision);
+
+  void evaluate(const std::vector<float>& input,
+                unsigned int nRows,
+                unsigned int nInputs,
+                std::vector<float>& output) const override;
+  Type type() const override { return Type::Native; }
+
+private:
+  std::unique_ptr<OIStrategyMLP> mlp_;
+  std::unique_ptr<OIStrategyQuantizedMLP> quantizedMlp_;
+};
+
+/// ONNX conversion of the frozen graph (see TSG_data/convertStrategyDnnToOnnx.py) run by ONNX Runtime
+class OIStrategyOnnxBackend : public OIStrategyBackend {
+public:
+  OIStrategyOnnxBackend(const std::string& onnxPath, const std::string& inputLayer, const std::string& outputLayer);
+
+  void evaluate(const std::vector<float>& input,
+                unsigned int nRows,
+                unsigned int nInputs,
+                std::vector<float>& output) const override;
+  Type type() const override { return Type::ONNX; }
+
+private:
+  std::unique_ptr<cms::Ort::ONNXRuntime> session_;
+  const std::vector<std::string> inputNames_;
+  const std::vector<std::string> outputNames_;
+};
+
+#endif
@@ -0,0 +1,122 @@
+/**
+  \class    OIStrategyBatcher
+  \brief    Process-wide service evaluating the OI seeding strategy DNN on rows submitted by many events
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyBatcher.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyCache.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <algorithm>
+#include <tuple>
+
+OIStrategyBatcher::OIStrategyBatcher(std::shared_ptr<const OIStrategyModel> model,
+                                     unsigned int maxBatchRows,
+                                     std::chrono::microseconds maxWait)
+    : model_(std::move(model)), maxBatchRows_(maxBatchRows), maxWait_(maxWait), thread_([this]() { run(); }) {}
+
+OIStrategyBatcher::~OIStrategyBatcher() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  wakeUp_.notify_one();
+  // Requests still queued are evaluated before the thread ends
+  thread_.join();
+}
+
+std::shared_ptr<OIStrategyBatcher> OIStrategyBatcher::get(const std::shared_ptr<const OIStrategyModel>& model,
+                                                          unsigned int maxBatchRows,
+                                                          unsigned int maxWaitMicroseconds) {
+  // Entries expire with the last module instance holding them; the model is itself shared by resolved files
+  static OIStrategyCache<std::tuple<const OIStrategyModel*, unsigned int, unsigned int>, OIStrategyBatcher> cache;
+
+  return cache.getOrCreate(std::make_tuple(model.get(), maxBatchRows, maxWaitMicroseconds), [&]() {
+    return std::make_shared<OIStrategyBatcher>(model, maxBatchRows, std::chrono::microseconds(maxWaitMicroseconds));
+  });
+}
+
+void OIStrategyBatcher::submit(std::vector<float>&& input,
+                               unsigned int nRows,
+                               unsigned int nInputs,
+                               Callback callback) {
+  bool wakeUp;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    // Called from a framework task, so within the arena of the framework
+    if (!arena_)
+      arena_ = std::make_unique<tbb::task_arena>(tbb::task_arena::attach());
+    queue_.push_back(Request{std::move(input), nRows, nInputs, std::move(callback), std::chrono::steady_clock::now()});
+    queuedRows_ += nRows;
+    // Otherwise the service thread wakes up by itself at the deadline of the oldest request
+    wakeUp = queuedRows_ >= maxBatchRows_ || queue_.size() == 1;
+  }
+  ++requests_;
+  if (wakeUp)
+    wakeUp_.notify_one();
+}
+
+//
+// Service thread: collect requests into batches until the batch is full or the oldest request is due
+//
+void OIStrategyBatcher::run() {
+  std::vector<Request> batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wakeUp_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+    if (queue_.empty())
+      return;
+    const auto deadline = queue_.front().submitted + maxWait_;
+    wakeUp_.wait_until(lock, deadline, [this]() { return stop_ || queuedRows_ >= maxBatchRows_; });
+
+    // Whole requests, at least one even if larger than a batch
+    unsigned int nRows = 0;
+    while (!queue_.empty() && (batch.empty() || nRows + queue_.front().nRows <= maxBatchRows_)) {
+      nRows += queue_.front().nRows;
+      batch.push_back(std::move(queue_.front()));
+      queue_.pop_front();
+    }
+    queuedRows_ -= nRows;
+
+    // Set before the first request was queued, and not changed since
+    tbb::task_arena& arena = *arena_;
+    lock.unlock();
+    arena.execute([this, &batch]() { evaluate(batch); });
+    batch.clear();
+    lock.lock();
+  }
+}
+
+void OIStrategyBatcher::evaluate(std::vector<Request>& batch) {
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<float> input;
+  unsigned int nRows = 0;
+  for (Request& request : batch) {
+    waitNanoseconds_ += std::chrono::duration_cast<std::chrono::nanoseconds>(start - request.submitted).count();
+    input.insert(input.end(), request.input.begin(), request.input.end());
+    nRows += request.nRows;
+  }
+
+  std::vector<float> output;
+  std::exception_ptr exception;
+  try {
+    if (std::any_of(batch.begin(), batch.end(), [&batch](const Request& r) { return r.nInputs != batch[0].nInputs; }))
+      throw cms::Exception("OIStrategyBatcher") << "Requests with different numbers of DNN inputs";
+    model_->backend().evaluate(input, nRows, batch[0].nInputs, output);
+  } catch (...) {
+    exception = std::current_exception();
+  }
+  ++batches_;
+  rows_ += nRows;
+
+  // Hand each request its rows of the outputs
+  const unsigned int nOutputs = (exception || nRows == 0) ? 0 : output.size() / nRows;
+  unsigned int row = 0;
+  for (Request& request : batch) {
+    std::vector<float> requestOutput;
+    if (!exception)
+      requestOutput.assign(output.begin() + row * nOutputs, output.begin() + (row + request.nRows) * nOutputs);
+    row += request.nRows;
+    request.callback(std::move(requestOutput), exception);
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyBatcher_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyBatcher_H
+
+/**
+ \class    OIStrategyBatcher
+ \brief    Process-wide service evaluating the OI seeding strategy DNN on rows submitted by many events
+
+ Streams submit the input rows of an event from acquire() and return; a service thread evaluates
+ the queued rows in one batch once maxBatchRows rows are queued, or once the oldest request has
+ waited maxWait, and hands each request its outputs through its callback. The callback runs on
+ the service thread, and is expected to release the framework task waiting for the outputs.
+ One service is kept per model and settings, shared by all module instances using them.
+
+ The service thread is not a framework thread: it evaluates each batch, and runs the callbacks,
+ inside the TBB arena of the streams that submit, so that a backend spawning TBB tasks (the
+ TensorFlow session with the TBB thread pool) runs them on the framework threads rather than in
+ an arena of its own.
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyModel.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <tbb/task_arena.h>
+
+class OIStrategyBatcher {
+public:
+  /// Outputs of the submitted rows (nRows x number of classes), or the exception of their evaluation;
+  /// must not throw
+  typedef std::function<void(std::vector<float>&& output, std::exception_ptr exception)> Callback;
+
+  OIStrategyBatcher(std::shared_ptr<const OIStrategyModel> model,
+                    unsigned int maxBatchRows,
+                    std::chrono::microseconds maxWait);
+  ~OIStrategyBatcher();
+
+  OIStrategyBatcher(const OIStrategyBatcher&) = delete;
+  OIStrategyBatcher& operator=(const OIStrategyBatcher&) = delete;
+
+  /// Start the service for a model, or return the one already running with the same settings
+  static std::shared_ptr<OIStrategyBatcher> get(const std::shared_ptr<const OIStrategyModel>& model,
+                                                unsigned int maxBatchRows,
+                                                unsigned int maxWaitMicroseconds);
+
+  /// Queue nRows input rows (nRows x nInputs, row-major)
+  void submit(std::vector<float>&& input, unsigned int nRows, unsigned int nInputs, Callback callback);
+
+  const OIStrategyModel& model() const { return *model_; }
+  unsigned long long requests() const { return requests_; }
+  unsigned long long batches() const { return batches_; }
+  unsigned long long rows() const { return rows_; }
+  /// Summed time of the requests in the queue
+  double waitSeconds() const { return waitNanoseconds_ * 1e-9; }
+
+private:
+  struct Request {
+    std::vector<float> input;
+    unsigned int nRows;
+    unsigned int nInputs;
+    Callback callback;
+    std::chrono::steady_clock::time_point submitted;
+  };
+
+  void run();
+  void evaluate(std::vector<Request>& batch);
+
+  const std::shared_ptr<const OIStrategyModel> model_;
+  const unsigned int maxBatchRows_;
+  const std::chrono::microseconds maxWait_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeUp_;
+  std::deque<Request> queue_;
+  unsigned int queuedRows_ = 0;
+  bool stop_ = false;
+  /// Arena of the framework, attached by the first submit() and kept while the service runs
+  std::unique_ptr<tbb::task_arena> arena_;
+
+  std::atomic<unsigned long long> requests_{0};
+  std::atomic<unsigned long long> batches_{0};
+  std::atomic<unsigned long long> rows_{0};
+  std::atomic<unsigned long long> waitNanoseconds_{0};
+
+  /// Started last, once the queue exists
+  std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,194 @@
+/**
+  \class    OIStrategyBundle
+  \brief    Memory-mapped file holding the strategy DNNs of all regions, ready for the native kernel
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyBundle.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyCache.h"
+#include "FWCore/ParameterSet/interface/FileInPath.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+  constexpr char kMagic[8] = {'O', 'I', 'S', 'B', 'N', 'D', 'L', '2'};
+  constexpr uint64_t kAlignment = 64;
+  constexpr unsigned int kNameLength = 16;
+
+  uint64_t fnv1a(const unsigned char* data, uint64_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint64_t i = 0; i < size; ++i) {
+      hash ^= data[i];
+      hash *= 0x100000001b3ULL;
+    }
+    return hash;
+  }
+
+  // Bounds-checked sequential reads from the mapping
+  class Reader {
+  public:
+    Reader(const unsigned char* data, uint64_t begin, uint64_t end, const std::string& path)
+        : data_(data), pos_(begin), end_(end), path_(path) {}
+
+    uint64_t pos() const { return pos_; }
+
+    const unsigned char* take(uint64_t n) {
+      if (n > end_ - pos_)
+        throw cms::Exception("OIStrategyBundle") << "Truncated strategy bundle " << path_;
+      const unsigned char* p = data_ + pos_;
+      pos_ += n;
+      return p;
+    }
+
+    template <typename T>
+    T read() {
+      T value;
+      std::memcpy(&value, take(sizeof(T)), sizeof(T));
+      return value;
+    }
+
+    std::string string() {
+      const uint32_t length = read<uint32_t>();
+      return std::string(reinterpret_cast<const char*>(take(length)), length);
+    }
+
+    void align() { take((kAlignment - pos_ % kAlignment) % kAlignment); }
+
+  private:
+    const unsigned char* data_;
+    uint64_t pos_;
+    const uint64_t end_;
+    const std::string& path_;
+  };
+}  // namespace
+
+OIStrategyBundle::OIStrategyBundle(const std::string& path) : path_(path), data_(nullptr), size_(0) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw cms::Exception("OIStrategyBundle") << "Cannot open strategy bundle " << path;
+  struct stat status;
+  if (::fstat(fd, &status) != 0 || status.st_size <= 0) {
+    ::close(fd);
+    throw cms::Exception("OIStrategyBundle") << "Cannot read strategy bundle " << path;
+  }
+  size_ = status.st_size;
+  void* mapping = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    throw cms::Exception("OIStrategyBundle") << "Cannot map strategy bundle " << path;
+  data_ = static_cast<const unsigned char*>(mapping);
+
+  try {
+    Reader header(data_, 0, size_, path_);
+    if (std::memcmp(header.take(sizeof(kMagic)), kMagic, sizeof(kMagic)) != 0)
+      throw cms::Exception("OIStrategyBundle") << path << " is not a strategy bundle of this version";
+    const uint32_t nRegions = header.read<uint32_t>();
+    header.read<uint32_t>();
+
+    for (uint32_t r = 0; r < nRegions; ++r) {
+      Region region;
+      const char* name = reinterpret_cast<const char*>(header.take(kNameLength));
+      region.name.assign(name, strnlen(name, kNameLength));
+      region.offset = header.read<uint64_t>();
+      region.size = header.read<uint64_t>();
+      const uint64_t metadataSize = header.read<uint64_t>();
+      region.metadataChecksum = header.read<uint64_t>();
+      region.checksum = header.read<uint64_t>();
+      if (region.offset > size_ || region.size > size_ - region.offset || region.offset % kAlignment != 0 ||
+          metadataSize > region.size)
+        throw cms::Exception("OIStrategyBundle") << "Region " << region.name << " outside of " << path;
+      if (fnv1a(data_ + region.offset, metadataSize) != region.metadataChecksum)
+        throw cms::Exception("OIStrategyBundle")
+            << "Metadata checksum mismatch of region " << region.name << " in " << path;
+
+      // Metadata and layer sizes only: the weights are read on demand
+      Reader reader(data_, region.offset, region.offset + region.size, path_);
+      const uint32_t nInputs = reader.read<uint32_t>();
+      for (uint32_t i = 0; i < nInputs; ++i)
+        region.inputNames.push_back(reader.string());
+      region.inputLayer = reader.string();
+      region.outputLayer = reader.string();
+      const uint32_t nClasses = reader.read<uint32_t>();
+      for (uint32_t c = 0; c < nClasses; ++c) {
+        std::array<int, 3> decision;
+        for (int& n : decision)
+          n = reader.read<int32_t>();
+        region.decoder.push_back(decision);
+      }
+      if (reader.pos() != region.offset + metadataSize)
+        throw cms::Exception("OIStrategyBundle") << "Inconsistent metadata of region " << region.name << " in " << path;
+      region.layersOffset = reader.pos();
+
+      // The layer sizes, skipping the weights: they chain the inputs to one output per class of the decoder
+      uint32_t nOut = region.inputNames.size();
+      const uint32_t nLayers = reader.read<uint32_t>();
+      for (uint32_t l = 0; l < nLayers; ++l) {
+        reader.align();
+        const uint32_t nIn = reader.read<uint32_t>();
+        const uint32_t nOutLayer = reader.read<uint32_t>();
+        const uint32_t nOutPad = reader.read<uint32_t>();
+        if (nIn != nOut || nOutLayer > nOutPad)
+          throw cms::Exception("OIStrategyBundle") << "Inconsistent layer sizes in region " << region.name << " of "
+                                                   << path;
+        reader.read<uint32_t>();
+        reader.align();
+        reader.take((uint64_t(nIn) + 1) * nOutPad * sizeof(float));
+        nOut = nOutLayer;
+      }
+      if (nLayers == 0 || nOut != region.decoder.size())
+        throw cms::Exception("OIStrategyBundle")
+            << "Region " << region.name << " of " << path << " has " << (nLayers == 0 ? 0 : nOut)
+            << " outputs for " << region.decoder.size() << " classes of its decoder";
+      regions_.push_back(std::move(region));
+    }
+  } catch (...) {
+    ::munmap(const_cast<unsigned char*>(data_), size_);
+    throw;
+  }
+}
+
+OIStrategyBundle::~OIStrategyBundle() { ::munmap(const_cast<unsigned char*>(data_), size_); }
+
+std::shared_ptr<const OIStrategyBundle> OIStrategyBundle::get(const std::string& path) {
+  // Entries expire with the last model holding them
+  static OIStrategyCache<std::string, const OIStrategyBundle> cache;
+  const std::string fullPath = edm::FileInPath(path).fullPath();
+  return cache.getOrCreate(fullPath, [&fullPath]() { return std::make_shared<const OIStrategyBundle>(fullPath); });
+}
+
+const OIStrategyBundle::Region& OIStrategyBundle::region(const std::string& name) const {
+  for (const Region& region : regions_)
+    if (region.name == name)
+      return region;
+  throw cms::Exception("OIStrategyBundle") << "No region " << name << " in strategy bundle " << path_;
+}
+
+std::vector<OIStrategyMLP::Layer> OIStrategyBundle::layers(const std::string& name) const {
+  const Region& region = this->region(name);
+  if (fnv1a(data_ + region.layersOffset, region.offset + region.size - region.layersOffset) != region.checksum)
+    throw cms::Exception("OIStrategyBundle") << "Checksum mismatch of the layers of region " << name << " in " << path_;
+
+  Reader reader(data_, region.layersOffset, region.offset + region.size, path_);
+  const uint32_t nLayers = reader.read<uint32_t>();
+  std::vector<OIStrategyMLP::Layer> layers(nLayers);
+  for (OIStrategyMLP::Layer& layer : layers) {
+    reader.align();
+    layer.nIn = reader.read<uint32_t>();
+    layer.nOut = reader.read<uint32_t>();
+    layer.nOutPad = reader.read<uint32_t>();
+    const uint32_t activation = reader.read<uint32_t>();
+    if (activation > uint32_t(OIStrategyMLP::Activation::Sigmoid))
+      throw cms::Exception("OIStrategyBundle") << "Unknown activation in region " << name << " of " << path_;
+    layer.activation = OIStrategyMLP::Activation(activation);
+    reader.align();
+    const uint64_t nWeights = uint64_t(layer.nIn) * layer.nOutPad;
+    layer.weightData = reinterpret_cast<const float*>(reader.take(nWeights * sizeof(float)));
+    layer.biasData = reinterpret_cast<const float*>(reader.take(uint64_t(layer.nOutPad) * sizeof(float)));
+  }
+  return layers;
+}
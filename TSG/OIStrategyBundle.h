@@ -0,0 +1,78 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyBundle_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyBundle_H
+
+/**
+ \class    OIStrategyBundle
+ \brief    Memory-mapped file holding the strategy DNNs of all regions, ready for the native kernel
+
+ Written by TSG_data/makeStrategyBundle.py from the frozen graphs and the metadata files. Layout,
+ little-endian, every array of floats aligned to 64 bytes from the start of the file:
+
+   header   char[8] "OISBNDL2", uint32 nRegions, uint32 reserved
+   regions  nRegions x { char[16] name, uint64 offset, uint64 size,
+                         uint64 metadataSize, uint64 metadataChecksum, uint64 checksum }
+   region   metadata: uint32 nInputs, nInputs x { uint32 length, char[length] name },
+                      uint32 length, char[length] input layer, uint32 length, char[length] output layer,
+                      uint32 nClasses, nClasses x int32[3] decision
+            layers:   uint32 nLayers, nLayers x { padding to 64 bytes, uint32 nIn, nOut, nOutPad, activation,
+                                                  padding to 64 bytes, float[nIn x nOutPad] weights,
+                                                  float[nOutPad] bias }
+
+ The checksums are the 64-bit FNV-1a hashes of the metadata bytes and of the layer bytes of the
+ region. Opening a bundle only maps it, checks and reads the metadata of its regions, and checks
+ that the sizes of their layers map the inputs to the classes of the decoder; the weights of a
+ region are checked and used in place when its layers are first requested, so that the pages of
+ weights never used are never read, and the pages of the others are shared between processes
+ mapping the same file.
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyMLP.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class OIStrategyBundle {
+public:
+  struct Region {
+    std::string name;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    /// Of the metadata, checked when the bundle is opened
+    uint64_t metadataChecksum = 0;
+    /// Of the layers, checked when they are first requested
+    uint64_t checksum = 0;
+    std::vector<std::string> inputNames;
+    std::string inputLayer;
+    std::string outputLayer;
+    /// Number of hit-based doublet, IP hitless and MuS hitless seeds for each output class
+    std::vector<std::array<int, 3> > decoder;
+    /// Offset of the first layer in the file
+    uint64_t layersOffset = 0;
+  };
+
+  explicit OIStrategyBundle(const std::string& path);
+  ~OIStrategyBundle();
+
+  OIStrategyBundle(const OIStrategyBundle&) = delete;
+  OIStrategyBundle& operator=(const OIStrategyBundle&) = delete;
+
+  /// Map the bundle (path relative to the search path, as for edm::FileInPath) or return the instance
+  /// already mapped in this process
+  static std::shared_ptr<const OIStrategyBundle> get(const std::string& path);
+
+  const Region& region(const std::string& name) const;
+
+  /// Dense layers of a region in the mapping, after checking their checksum; keep the bundle alive while using them
+  std::vector<OIStrategyMLP::Layer> layers(const std::string& name) const;
+
+private:
+  const std::string path_;
+  const unsigned char* data_;
+  uint64_t size_;
+  std::vector<Region> regions_;
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyCache_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyCache_H
+
+/**
+ \class    OIStrategyCache
+ \brief    Process-wide instances shared by key between module instances
+
+ Only weak pointers are kept, so that an instance is destroyed with the last module instance
+ holding it; the entries of destroyed instances are erased on the next call. Keys naming files
+ use their resolved path (edm::FileInPath::fullPath()), so that a file has one entry however
+ its path is written.
+ */
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+template <typename Key, typename T>
+class OIStrategyCache {
+public:
+  /// The live instance of key, or the one make() returns, which is kept for the next calls
+  template <typename Make>
+  std::shared_ptr<T> getOrCreate(const Key& key, Make make) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();)
+      it = it->second.expired() ? entries_.erase(it) : std::next(it);
+    std::weak_ptr<T>& entry = entries_[key];
+    std::shared_ptr<T> instance = entry.lock();
+    if (!instance) {
+      instance = make();
+      entry = instance;
+    }
+    return instance;
+  }
+
+private:
+  std::mutex mutex_;
+  std::map<Key, std::weak_ptr<T> > entries_;
+};
+
+#endif
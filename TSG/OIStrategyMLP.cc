@@ -0,0 +1,345 @@
+/**
+  \class    OIStrategyMLP
+  \brief    Native inference of the dense OI seeding strategy networks, without a TensorFlow session
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyMLP.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace {
+  struct ConstTensor {
+    std::vector<float> values;
+  };
+
+  // Strip the control-dependency prefix and the output slot from a node input
+  std::string nodeName(const std::string& input) {
+    std::string name = (!input.empty() && input[0] == '^') ? input.substr(1) : input;
+    auto colon = name.find(':');
+    if (colon != std::string::npos)
+      name.erase(colon);
+    return name;
+  }
+
+  float broadcastAt(const std::vector<float>& v, unsigned int i) { return v.size() == 1 ? v[0] : v[i]; }
+
+  // Resolves which nodes of a frozen graph do not depend on the input, and folds their values
+  class GraphFolder {
+  public:
+    explicit GraphFolder(const tensorflow::GraphDef& graphDef) {
+      for (const auto& node : graphDef.node())
+        nodes_[node.name()] = &node;
+    }
+
+    const tensorflow::NodeDef& node(const std::string& name) const {
+      auto it = nodes_.find(name);
+      if (it == nodes_.end())
+        throw cms::Exception("OIStrategyMLP") << "Node " << name << " not found in graph";
+      return *it->second;
+    }
+
+    std::vector<std::string> dataInputs(const tensorflow::NodeDef& node) const {
+      std::vector<std::string> inputs;
+      for (const auto& input : node.input()) {
+        if (!input.empty() && input[0] != '^')
+          inputs.push_back(nodeName(input));
+      }
+      return inputs;
+    }
+
+    bool isConstant(const std::string& name) {
+      auto it = isConstant_.find(name);
+      if (it != isConstant_.end())
+        return it->second;
+      const tensorflow::NodeDef& n = node(name);
+      bool constant = false;
+      if (n.op() == "Const") {
+        constant = true;
+      } else if (n.op() != "Placeholder") {
+        const auto inputs = dataInputs(n);
+        constant = !inputs.empty() &&
+                   std::all_of(inputs.begin(), inputs.end(), [this](const std::string& in) { return isConstant(in); });
+      }
+      isConstant_[name] = constant;
+      return constant;
+    }
+
+    const ConstTensor& value(const std::string& name) {
+      auto it = values_.find(name);
+      if (it != values_.end())
+        return it->second;
+
+      const tensorflow::NodeDef& n = node(name);
+      const auto inputs = dataInputs(n);
+      ConstTensor result;
+      if (n.op() == "Const") {
+        tensorflow::Tensor tensor;
+        if (!tensor.FromProto(n.attr().at("value").tensor()) || tensor.dtype() != tensorflow::DT_FLOAT)
+          throw cms::Exception("OIStrategyMLP") << "Cannot read float constant " << name;
+        auto flat = tensor.flat<float>();
+        result.values.assign(flat.data(), flat.data() + flat.size());
+      } else if (n.op() == "Identity") {
+        result = value(inputs.at(0));
+      } else if (n.op() == "Rsqrt" || n.op() == "Sqrt") {
+        result = value(inputs.at(0));
+        for (float& x : result.values)
+          x = (n.op() == "Rsqrt") ? 1.f / std::sqrt(x) : std::sqrt(x);
+      } else if (n.op() == "Add" || n.op() == "AddV2" || n.op() == "Sub" || n.op() == "Mul" || n.op() == "RealDiv") {
+        const std::vector<float>& a = value(inputs.at(0)).values;
+        const std::vector<float>& b = value(inputs.at(1)).values;
+        if (a.size() != b.size() && a.size() != 1 && b.size() != 1)
+          throw cms::Exception("OIStrategyMLP") << "Cannot broadcast operands of " << name;
+        result.values.resize(std::max(a.size(), b.size()));
+        for (unsigned int i = 0; i < result.values.size(); ++i) {
+          const float x = broadcastAt(a, i), y = broadcastAt(b, i);
+          if (n.op() == "Sub")
+            result.values[i] = x - y;
+          else if (n.op() == "Mul")
+            result.values[i] = x * y;
+          else if (n.op() == "RealDiv")
+            result.values[i] = x / y;
+          else
+            result.values[i] = x + y;
+        }
+      } else {
+        throw cms::Exception("OIStrategyMLP") << "Unsupported constant operation " << n.op() << " in " << name;
+      }
+      return values_[name] = std::move(result);
+    }
+
+  private:
+    std::map<std::string, const tensorflow::NodeDef*> nodes_;
+    std::map<std::string, bool> isConstant_;
+    std::map<std::string, ConstTensor> values_;
+  };
+
+  // Elementwise x -> scale*x + shift, waiting to be folded into the next dense layer
+  struct PendingAffine {
+    std::vector<float> scale{1.f};
+    std::vector<float> shift{0.f};
+
+    bool isIdentity() const {
+      return std::all_of(scale.begin(), scale.end(), [](float s) { return s == 1.f; }) &&
+             std::all_of(shift.begin(), shift.end(), [](float t) { return t == 0.f; });
+    }
+
+    static void expand(std::vector<float>& v, unsigned int n) {
+      if (v.size() == 1 && n > 1)
+        v.assign(n, v[0]);
+    }
+
+    void multiply(const std::vector<float>& c) {
+      expand(scale, c.size());
+      expand(shift, c.size());
+      for (unsigned int i = 0; i < scale.size(); ++i) {
+        scale[i] *= broadcastAt(c, i);
+        shift[i] *= broadcastAt(c, i);
+      }
+    }
+
+    void add(const std::vector<float>& c, float sign) {
+      expand(shift, c.size());
+      for (unsigned int i = 0; i < shift.size(); ++i)
+        shift[i] += sign * broadcastAt(c, i);
+    }
+  };
+}  // namespace
+
+OIStrategyMLP::OIStrategyMLP(const tensorflow::GraphDef& graphDef,
+                             const std::string& inputLayer,
+                             const std::string& outputLayer) {
+  GraphFolder folder(graphDef);
+
+  // Walk back from the output to the input along the non-constant inputs
+  std::vector<const tensorflow::NodeDef*> path;
+  const std::string inputName = nodeName(inputLayer);
+  std::string name = nodeName(outputLayer);
+  while (name != inputName) {
+    const tensorflow::NodeDef& node = folder.node(name);
+    path.push_back(&node);
+    std::string next;
+    for (const auto& input : folder.dataInputs(node)) {
+      if (folder.isConstant(input))
+        continue;
+      if (!next.empty())
+        throw cms::Exception("OIStrategyMLP") << "Node " << name << " has more than one non-constant input";
+      next = input;
+    }
+    if (next.empty())
+      throw cms::Exception("OIStrategyMLP") << "Output " << outputLayer << " does not depend on " << inputLayer;
+    name = next;
+  }
+  std::reverse(path.begin(), path.end());
+
+  // Turn the path into dense layers, folding elementwise affine operations into them
+  PendingAffine pending;
+  bool activated = true;  // false while the last dense layer still accepts pre-activation operations
+  for (const tensorflow::NodeDef* node : path) {
+    const std::string& op = node->op();
+    const auto inputs = folder.dataInputs(*node);
+
+    if (op == "Identity") {
+      continue;
+    } else if (op == "MatMul") {
+      if ((node->attr().count("transpose_a") && node->attr().at("transpose_a").b()) ||
+          folder.isConstant(inputs.at(0)))
+        throw cms::Exception("OIStrategyMLP") << "Unsupported MatMul layout in " << node->name();
+      const bool transposeB = node->attr().count("transpose_b") && node->attr().at("transpose_b").b();
+
+      tensorflow::Tensor kernel;
+      const tensorflow::NodeDef* kernelNode = &folder.node(inputs.at(1));
+      while (kernelNode->op() == "Identity")
+        kernelNode = &folder.node(folder.dataInputs(*kernelNode).at(0));
+      if (kernelNode->op() != "Const" || !kernel.FromProto(kernelNode->attr().at("value").tensor()) ||
+          kernel.dims() != 2)
+        throw cms::Exception("OIStrategyMLP") << "Cannot read the kernel of " << node->name();
+
+      Layer layer;
+      layer.nIn = kernel.dim_size(transposeB ? 1 : 0);
+      layer.nOut = kernel.dim_size(transposeB ? 0 : 1);
+      layer.nOutPad = (layer.nOut + kPadding - 1) / kPadding * kPadding;
+      if (!layers_.empty() && layers_.back().nOut != layer.nIn)
+        throw cms::Exception("OIStrategyMLP") << "Width mismatch at " << node->name();
+      if (layer.nIn > kMaxWidth || layer.nOutPad > kMaxWidth)
+        throw cms::Exception("OIStrategyMLP") << "Layer " << node->name() << " is wider than " << kMaxWidth;
+
+      PendingAffine::expand(pending.scale, layer.nIn);
+      PendingAffine::expand(pending.shift, layer.nIn);
+      if (pending.scale.size() != layer.nIn || pending.shift.size() != layer.nIn)
+        throw cms::Exception("OIStrategyMLP") << "Width mismatch at " << node->name();
+
+      auto w = kernel.matrix<float>();
+      layer.weights.assign(layer.nIn * layer.nOutPad, 0.f);
+      layer.bias.assign(layer.nOutPad, 0.f);
+      for (unsigned int i = 0; i < layer.nIn; ++i) {
+        for (unsigned int o = 0; o < layer.nOut; ++o) {
+          const float wio = transposeB ? w(o, i) : w(i, o);
+          layer.weights[i * layer.nOutPad + o] = pending.scale[i] * wio;
+          layer.bias[o] += pending.shift[i] * wio;
+        }
+      }
+      layers_.push_back(std::move(layer));
+      pending = PendingAffine();
+      activated = false;
+    } else if (op == "BiasAdd" || op == "Add" || op == "AddV2" || op == "Sub" || op == "Mul") {
+      const bool dataFirst = !folder.isConstant(inputs.at(0));
+      const std::vector<float>& c = folder.value(inputs.at(dataFirst ? 1 : 0)).values;
+      const unsigned int width = layers_.empty() ? c.size() : layers_.back().nOut;
+      if (c.size() != 1 && c.size() != width)
+        throw cms::Exception("OIStrategyMLP") << "Cannot broadcast operands of " << node->name();
+
+      if (!activated) {
+        // Pre-activation: modify the open dense layer directly
+        Layer& layer = layers_.back();
+        if (op == "Mul") {
+          for (unsigned int o = 0; o < layer.nOut; ++o) {
+            for (unsigned int i = 0; i < layer.nIn; ++i)
+              layer.weights[i * layer.nOutPad + o] *= broadcastAt(c, o);
+            layer.bias[o] *= broadcastAt(c, o);
+          }
+        } else {
+          const float sign = (op == "Sub" && dataFirst) ? -1.f : 1.f;
+          if (op == "Sub" && !dataFirst) {
+            // c - x
+            for (float& weight : layer.weights)
+              weight = -weight;
+            for (float& bias : layer.bias)
+              bias = -bias;
+          }
+          for (unsigned int o = 0; o < layer.nOut; ++o)
+            layer.bias[o] += sign * broadcastAt(c, o);
+        }
+      } else {
+        if (op == "Mul") {
+          pending.multiply(c);
+        } else if (op == "Sub" && !dataFirst) {
+          // c - x
+          pending.multiply({-1.f});
+          pending.add(c, 1.f);
+        } else {
+          pending.add(c, op == "Sub" ? -1.f : 1.f);
+        }
+      }
+    } else if (op == "Relu" || op == "Tanh" || op == "Sigmoid") {
+      if (activated)
+        throw cms::Exception("OIStrategyMLP") << "Activation " << node->name() << " does not follow a dense layer";
+      layers_.back().activation =
+          op == "Relu" ? Activation::Relu : (op == "Tanh" ? Activation::Tanh : Activation::Sigmoid);
+      activated = true;
+    } else {
+      throw cms::Exception("OIStrategyMLP") << "Unsupported operation " << op << " in " << node->name();
+    }
+  }
+
+  if (layers_.empty())
+    throw cms::Exception("OIStrategyMLP") << "No dense layer between " << inputLayer << " and " << outputLayer;
+  if (!pending.isIdentity())
+    throw cms::Exception("OIStrategyMLP") << "Elementwise operations after the last activation are not supported";
+
+  for (Layer& layer : layers_) {
+    layer.weightData = layer.weights.data();
+    layer.biasData = layer.bias.data();
+  }
+}
+
+OIStrategyMLP::OIStrategyMLP(std::vector<Layer> layers, std::shared_ptr<const void> storage)
+    : layers_(std::move(layers)), storage_(std::move(storage)) {
+  if (layers_.empty())
+    throw cms::Exception("OIStrategyMLP") << "No dense layer";
+  for (unsigned int i = 0; i < layers_.size(); ++i) {
+    const Layer& layer = layers_[i];
+    if (layer.weightData == nullptr || layer.biasData == nullptr || layer.nOutPad % kPadding != 0 ||
+        layer.nOutPad < layer.nOut || layer.nIn > kMaxWidth || layer.nOutPad > kMaxWidth ||
+        (i > 0 && layers_[i - 1].nOut != layer.nIn))
+      throw cms::Exception("OIStrategyMLP") << "Inconsistent external layer " << i;
+  }
+}
+
+void OIStrategyMLP::evaluate(const float* input, unsigned int nRows, float* output) const {
+  alignas(64) float buffers[2][kMaxWidth];
+
+  const unsigned int nIn = nInputs();
+  const unsigned int nOut = nOutputs();
+  for (unsigned int row = 0; row < nRows; ++row) {
+    float* in = buffers[0];
+    std::copy(input + row * nIn, input + (row + 1) * nIn, in);
+
+    for (const Layer& layer : layers_) {
+      float* __restrict__ out = (in == buffers[0]) ? buffers[1] : buffers[0];
+      const float* __restrict__ bias = layer.biasData;
+      for (unsigned int o = 0; o < layer.nOutPad; ++o)
+        out[o] = bias[o];
+
+      // out += x_i * W_i for each input i: contiguous over the padded outputs
+      for (unsigned int i = 0; i < layer.nIn; ++i) {
+        const float x = in[i];
+        const float* __restrict__ w = layer.weightData + i * layer.nOutPad;
+        for (unsigned int o = 0; o < layer.nOutPad; ++o)
+          out[o] += x * w[o];
+      }
+
+      switch (layer.activation) {
+        case Activation::Relu:
+          for (unsigned int o = 0; o < layer.nOut; ++o)
+            out[o] = std::max(out[o], 0.f);
+          break;
+        case Activation::Tanh:
+          for (unsigned int o = 0; o < layer.nOut; ++o)
+            out[o] = std::tanh(out[o]);
+          break;
+        case Activation::Sigmoid:
+          for (unsigned int o = 0; o < layer.nOut; ++o)
+            out[o] = 1.f / (1.f + std::exp(-out[o]));
+          break;
+        case Activation::Linear:
+          break;
+      }
+      in = out;
+    }
+
+    std::copy(in, in + nOut, output + row * nOut);
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyMLP_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyMLP_H
+
+/**
+ \class    OIStrategyMLP
+ \brief    Native inference of the dense OI seeding strategy networks, without a TensorFlow session
+
+ The dense layers are read once from the frozen graph. Inference-time batch normalization and
+ other elementwise affine operations are folded into the adjacent dense layers, dropout is dropped.
+ Weights are stored input-major with the output dimension padded, so that the inner loop of the
+ matrix-vector product is a contiguous multiply-add which the compiler vectorizes. The layers can
+ also be taken in this layout from a strategy bundle, and evaluated in place in its mapping.
+ */
+
+#include "PhysicsTools/TensorFlow/interface/TensorFlow.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class OIStrategyMLP {
+public:
+  enum class Activation { Linear, Relu, Tanh, Sigmoid };
+
+  struct Layer {
+    unsigned int nIn = 0;
+    unsigned int nOut = 0;
+    /// Padded output width, multiple of kPadding
+    unsigned int nOutPad = 0;
+    /// nIn x nOutPad, input-major
+    std::vector<float> weights;
+    /// nOutPad
+    std::vector<float> bias;
+    /// Weights and bias used by the evaluation: the data of the vectors above, or external memory
+    const float* weightData = nullptr;
+    const float* biasData = nullptr;
+    Activation activation = Activation::Linear;
+  };
+
+  /// Widths are padded to a multiple of this, so that the vectorized loops have no remainder
+  static constexpr unsigned int kPadding = 16;
+  /// Largest layer width supported by the stack buffers used in evaluate()
+  static constexpr unsigned int kMaxWidth = 1024;
+
+  /// Extract the network between inputLayer and outputLayer from a frozen graph
+  OIStrategyMLP(const tensorflow::GraphDef& graphDef, const std::string& inputLayer, const std::string& outputLayer);
+  /// Layers with external weights and bias, kept alive by storage
+  OIStrategyMLP(std::vector<Layer> layers, std::shared_ptr<const void> storage);
+
+  OIStrategyMLP(const OIStrategyMLP&) = delete;
+  OIStrategyMLP& operator=(const OIStrategyMLP&) = delete;
+
+  unsigned int nInputs() const { return layers_.empty() ? 0 : layers_.front().nIn; }
+  unsigned int nOutputs() const { return layers_.empty() ? 0 : layers_.back().nOut; }
+  const std::vector<Layer>& layers() const { return layers_; }
+
+  /// Evaluate nRows input rows (nRows x nInputs(), row-major) into output (nRows x nOutputs())
+  void evaluate(const float* input, unsigned int nRows, float* output) const;
+
+private:
+  std::vector<Layer> layers_;
+  std::shared_ptr<const void> storage_;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/**
+  \class    OIStrategyModel
+  \brief    Strategy DNN of the OI seeding (inference backend and metadata), shared across module instances
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyModel.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyCache.h"
+#include "FWCore/ParameterSet/interface/FileInPath.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <TFile.h>
+#include <TH2D.h>
+
+OIStrategyModel::OIStrategyModel(const std::string& modelPath,
+                                 const std::string& metadataPath,
+                                 const std::string& onnxPath,
+                                 OIStrategyBackend::Type backend,
+                                 const std::string& precision,
+                                 bool withReference) {
+  tensorflow::setLogging("2");
+
+  edm::FileInPath dnnMetadataPath(metadataPath);
+  std::unique_ptr<TFile> metadataFile(TFile::Open(dnnMetadataPath.fullPath().c_str()));
+  if (!metadataFile || metadataFile->IsZombie())
+    throw cms::Exception("OIStrategyModel") << "Cannot open DNN metadata " << dnnMetadataPath.fullPath();
+  TH1D* inpOrderHist = (TH1D*)(metadataFile->Get("input_order"));
+  TH1D* layerNamesHist = (TH1D*)(metadataFile->Get("layer_names"));
+  TH2D* decoderHist = (TH2D*)(metadataFile->Get("scheme"));
+  if (inpOrderHist == nullptr || layerNamesHist == nullptr || decoderHist == nullptr)
+    throw cms::Exception("OIStrategyModel") << "Incomplete DNN metadata in " << dnnMetadataPath.fullPath();
+
+  for (int i = 0; i < inpOrderHist->GetXaxis()->GetNbins(); i++)
+    inputNames_.push_back(inpOrderHist->GetXaxis()->GetBinLabel(i + 1));
+  inputLayer_ = layerNamesHist->GetXaxis()->GetBinLabel(1);
+  outputLayer_ = layerNamesHist->GetXaxis()->GetBinLabel(2);
+  // Columns are nHB, nHLIP, nHLMuS; rows are the output classes
+  for (int iclass = 0; iclass < decoderHist->GetYaxis()->GetNbins(); iclass++)
+    decoder_.push_back({{int(decoderHist->GetBinContent(1, iclass + 1)),
+                         int(decoderHist->GetBinContent(2, iclass + 1)),
+                         int(decoderHist->GetBinContent(3, iclass + 1))}});
+  metadataFile->Close();
+
+  // The ONNX conversion keeps the input and output names of the frozen graph
+  edm::FileInPath dnnPath(modelPath);
+  switch (backend) {
+    case OIStrategyBackend::Type::Native:
+      backend_ = std::make_unique<OIStrategyNativeBackend>(dnnPath.fullPath(), inputLayer_, outputLayer_, precision);
+      break;
+    case OIStrategyBackend::Type::ONNX:
+      backend_ = std::make_unique<OIStrategyOnnxBackend>(
+          edm::FileInPath(onnxPath).fullPath(), inputLayer_, outputLayer_);
+      break;
+    default:
+      backend_ = std::make_unique<OIStrategyTFBackend>(dnnPath.fullPath(), inputLayer_, outputLayer_);
+  }
+  if (withReference && backend != OIStrategyBackend::Type::TensorFlow)
+    reference_ = std::make_unique<OIStrategyTFBackend>(dnnPath.fullPath(), inputLayer_, outputLayer_);
+}
+
+OIStrategyModel::OIStrategyModel(std::shared_ptr<const OIStrategyBundle> bundle,
+                                 const std::string& region,
+                                 const std::string& precision)
+    : bundle_(std::move(bundle)), bundleRegion_(region), precision_(precision) {
+  const OIStrategyBundle::Region& metadata = bundle_->region(region);
+  inputNames_ = metadata.inputNames;
+  inputLayer_ = metadata.inputLayer;
+  outputLayer_ = metadata.outputLayer;
+  decoder_.assign(metadata.decoder.begin(), metadata.decoder.end());
+}
+
+const OIStrategyBackend& OIStrategyModel::backend() const {
+  if (bundle_) {
+    std::call_once(bundleLoaded_, [this]() {
+      // The layers stay in the mapping, kept alive by the MLP
+      backend_ = std::make_unique<OIStrategyNativeBackend>(
+          std::make_unique<OIStrategyMLP>(bundle_->layers(bundleRegion_), bundle_), precision_);
+    });
+  }
+  return *backend_;
+}
+
+std::shared_ptr<const OIStrategyModel> OIStrategyModel::get(const std::string& modelPath,
+                                                            const std::string& metadataPath,
+                                                            const std::string& onnxPath,
+                                                            OIStrategyBackend::Type backend,
+                                                            const std::string& precision,
+                                                            bool withReference) {
+  // Entries expire with the last module instance holding them
+  static OIStrategyCache<std::string, const OIStrategyModel> cache;
+
+  // The ONNX file is only read, and may only exist, with the ONNX backend
+  const std::string onnxKey =
+      backend == OIStrategyBackend::Type::ONNX ? edm::FileInPath(onnxPath).fullPath() : std::string();
+  const std::string key = edm::FileInPath(modelPath).fullPath() + "|" + edm::FileInPath(metadataPath).fullPath() +
+                          "|" + onnxKey + "|" + OIStrategyBackend::name(backend) + "|" + precision +
+                          (withReference ? "|R" : "");
+  return cache.getOrCreate(key, [&]() {
+    return std::make_shared<const OIStrategyModel>(
+        modelPath, metadataPath, onnxPath, backend, precision, withReference);
+  });
+}
+
+std::shared_ptr<const OIStrategyModel> OIStrategyModel::get(const std::string& bundlePath,
+                                                            const std::string& region,
+                                                            const std::string& precision) {
+  static OIStrategyCache<std::string, const OIStrategyModel> cache;
+
+  const std::string key = edm::FileInPath(bundlePath).fullPath() + "|" + region + "|" + precision;
+  return cache.getOrCreate(key, [&]() {
+    return std::make_shared<const OIStrategyModel>(OIStrategyBundle::get(bundlePath), region, precision);
+  });
+}
@@ -0,0 +1,83 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyModel_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyModel_H
+
+/**
+ \class    OIStrategyModel
+ \brief    Strategy DNN of the OI seeding (inference backend and metadata), shared across module instances
+
+ Models are obtained through get(), which keeps one instance per files and backend in a
+ process-wide cache. A model can also be a region of a strategy bundle, evaluated by the native
+ backend, in which case only its metadata is read at construction and its layers on first use.
+ All module instances and streams using the same files share it read-only.
+ The metadata is copied into plain tables at construction and its ROOT file closed, so that
+ evaluation does not touch any ROOT object.
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyBackend.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyBundle.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class OIStrategyModel {
+public:
+  /// onnxPath is only read by the ONNX backend and precision only by the native one;
+  /// withReference adds a TensorFlow session to validate the backend
+  OIStrategyModel(const std::string& modelPath,
+                  const std::string& metadataPath,
+                  const std::string& onnxPath,
+                  OIStrategyBackend::Type backend,
+                  const std::string& precision,
+                  bool withReference);
+  /// Region of a strategy bundle, evaluated by the native backend with the given precision
+  OIStrategyModel(std::shared_ptr<const OIStrategyBundle> bundle,
+                  const std::string& region,
+                  const std::string& precision);
+
+  OIStrategyModel(const OIStrategyModel&) = delete;
+  OIStrategyModel& operator=(const OIStrategyModel&) = delete;
+
+  /// Load the model or return the instance already loaded in this process
+  static std::shared_ptr<const OIStrategyModel> get(const std::string& modelPath,
+                                                    const std::string& metadataPath,
+                                                    const std::string& onnxPath,
+                                                    OIStrategyBackend::Type backend,
+                                                    const std::string& precision,
+                                                    bool withReference);
+  static std::shared_ptr<const OIStrategyModel> get(const std::string& bundlePath,
+                                                    const std::string& region,
+                                                    const std::string& precision);
+
+  /// Number of hit-based doublet, IP hitless and MuS hitless seeds for each output class
+  typedef std::array<int, 3> Decision;
+
+  /// Loads the layers of a bundle region on first use
+  const OIStrategyBackend& backend() const;
+  /// TensorFlow session to compare the backend with, nullptr unless requested
+  const OIStrategyBackend* reference() const { return reference_.get(); }
+  const std::vector<std::string>& inputNames() const { return inputNames_; }
+  const std::string& inputLayer() const { return inputLayer_; }
+  const std::string& outputLayer() const { return outputLayer_; }
+  /// Decision for an output class; no seeds for a class outside the decoding table
+  Decision decode(int iclass) const {
+    return (iclass >= 0 && iclass < int(decoder_.size())) ? decoder_[iclass] : Decision{{0, 0, 0}};
+  }
+
+private:
+  mutable std::unique_ptr<OIStrategyBackend> backend_;
+  /// Bundle region whose layers are loaded into backend_ on first use
+  std::shared_ptr<const OIStrategyBundle> bundle_;
+  std::string bundleRegion_;
+  std::string precision_;
+  mutable std::once_flag bundleLoaded_;
+  std::unique_ptr<OIStrategyBackend> reference_;
+  std::vector<std::string> inputNames_;
+  std::string inputLayer_;
+  std::string outputLayer_;
+  std::vector<Decision> decoder_;
+};
+
+#endif
@@ -0,0 +1,247 @@
+/**
+  \class    OIStrategyQuantizedMLP
+  \brief    Reduced precision (fp16 or int8) inference of the dense OI seeding strategy networks
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyQuantizedMLP.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace {
+  // IEEE binary16 <-> binary32, rounding to nearest even
+  uint16_t floatToHalf(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int32_t exponent = int32_t((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+
+    if (((x >> 23) & 0xff) == 0xff)
+      return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)
+      return sign | 0x7c00;
+    if (exponent <= 0) {
+      // Subnormal or zero
+      if (exponent < -10)
+        return sign;
+      mantissa |= 0x800000;
+      const uint32_t shift = 14 - exponent;
+      uint32_t half = mantissa >> shift;
+      const uint32_t remainder = mantissa & ((1u << shift) - 1);
+      const uint32_t halfway = 1u << (shift - 1);
+      if (remainder > halfway || (remainder == halfway && (half & 1)))
+        ++half;
+      return sign | half;
+    }
+    // A carry out of the mantissa correctly increments the exponent, up to infinity
+    uint32_t half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+      ++half;
+    return sign | half;
+  }
+
+#ifndef __F16C__
+  float halfToFloat(uint16_t h) {
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if (exponent == 0) {
+      if (mantissa == 0) {
+        x = sign;
+      } else {
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400)) {
+          mantissa <<= 1;
+          --exponent;
+        }
+        x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+      }
+    } else if (exponent == 31) {
+      x = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+      x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+  }
+#endif
+
+  void activate(OIStrategyMLP::Activation activation, float* out, unsigned int n) {
+    switch (activation) {
+      case OIStrategyMLP::Activation::Relu:
+        for (unsigned int o = 0; o < n; ++o)
+          out[o] = std::max(out[o], 0.f);
+        break;
+      case OIStrategyMLP::Activation::Tanh:
+        for (unsigned int o = 0; o < n; ++o)
+          out[o] = std::tanh(out[o]);
+        break;
+      case OIStrategyMLP::Activation::Sigmoid:
+        for (unsigned int o = 0; o < n; ++o)
+          out[o] = 1.f / (1.f + std::exp(-out[o]));
+        break;
+      case OIStrategyMLP::Activation::Linear:
+        break;
+    }
+  }
+
+  // Dot product of int16 activations and int8 weights, n a multiple of kPadding
+  int32_t dotInt8(const int16_t* __restrict__ x, const int8_t* __restrict__ w, unsigned int n) {
+#ifdef __AVX2__
+    __m256i acc = _mm256_setzero_si256();
+    for (unsigned int i = 0; i < n; i += 16) {
+      const __m256i xv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+      const __m256i wv = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+      acc = _mm256_dpwssd_epi32(acc, xv, wv);
+#else
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(xv, wv));
+#endif
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    return _mm_cvtsi128_si32(sum);
+#else
+    int32_t acc = 0;
+    for (unsigned int i = 0; i < n; ++i)
+      acc += int32_t(x[i]) * int32_t(w[i]);
+    return acc;
+#endif
+  }
+}  // namespace
+
+OIStrategyQuantizedMLP::Precision OIStrategyQuantizedMLP::precisionFromName(const std::string& name) {
+  if (name == "fp16")
+    return Precision::Half;
+  if (name == "int8")
+    return Precision::Int8;
+  throw cms::Exception("Configuration") << "OIStrategyQuantizedMLP: unknown precision " << name;
+}
+
+OIStrategyQuantizedMLP::OIStrategyQuantizedMLP(const OIStrategyMLP& mlp, Precision precision)
+    : precision_(precision) {
+  static_assert(OIStrategyMLP::kPadding % 16 == 0, "The vectorized loops process 16 weights at a time");
+
+  for (const OIStrategyMLP::Layer& floatLayer : mlp.layers()) {
+    Layer layer;
+    layer.nIn = floatLayer.nIn;
+    layer.nOut = floatLayer.nOut;
+    layer.activation = floatLayer.activation;
+    layer.bias.assign(floatLayer.biasData, floatLayer.biasData + floatLayer.nOut);
+
+    if (precision == Precision::Half) {
+      // Same input-major layout as the float weights
+      layer.nPad = floatLayer.nOutPad;
+      const float* weights = floatLayer.weightData;
+      layer.halfWeights.resize(floatLayer.nIn * floatLayer.nOutPad);
+      std::transform(weights, weights + layer.halfWeights.size(), layer.halfWeights.begin(), floatToHalf);
+    } else if (layers_.empty()) {
+      // The inputs of the first layer are not quantized, nor are its weights
+      layer.nPad = floatLayer.nOutPad;
+      layer.floatWeights.assign(floatLayer.weightData, floatLayer.weightData + floatLayer.nIn * floatLayer.nOutPad);
+    } else {
+      // Output-major, so that each output is a contiguous dot product over the inputs
+      layer.nPad = (layer.nIn + OIStrategyMLP::kPadding - 1) / OIStrategyMLP::kPadding * OIStrategyMLP::kPadding;
+      if (layer.nPad > OIStrategyMLP::kMaxWidth)
+        throw cms::Exception("OIStrategyQuantizedMLP") << "Layer wider than " << OIStrategyMLP::kMaxWidth;
+      layer.int8Weights.assign(layer.nOut * layer.nPad, 0);
+      layer.weightScale.assign(layer.nOut, 0.f);
+      for (unsigned int o = 0; o < layer.nOut; ++o) {
+        float maxAbs = 0.f;
+        for (unsigned int i = 0; i < layer.nIn; ++i)
+          maxAbs = std::max(maxAbs, std::abs(floatLayer.weightData[i * floatLayer.nOutPad + o]));
+        const float scale = maxAbs > 0.f ? maxAbs / 127.f : 1.f;
+        layer.weightScale[o] = scale;
+        for (unsigned int i = 0; i < layer.nIn; ++i)
+          layer.int8Weights[o * layer.nPad + i] =
+              int8_t(std::lround(floatLayer.weightData[i * floatLayer.nOutPad + o] / scale));
+      }
+    }
+    layers_.push_back(std::move(layer));
+  }
+}
+
+void OIStrategyQuantizedMLP::evaluateHalf(const Layer& layer, const float* in, float* __restrict__ out) const {
+  std::copy(layer.bias.begin(), layer.bias.end(), out);
+  std::fill(out + layer.nOut, out + layer.nPad, 0.f);
+  for (unsigned int i = 0; i < layer.nIn; ++i) {
+    const float x = in[i];
+    const uint16_t* __restrict__ w = layer.halfWeights.data() + i * layer.nPad;
+#ifdef __F16C__
+    const __m256 xv = _mm256_set1_ps(x);
+    for (unsigned int o = 0; o < layer.nPad; o += 8) {
+      const __m256 wv = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + o)));
+      _mm256_storeu_ps(out + o, _mm256_add_ps(_mm256_loadu_ps(out + o), _mm256_mul_ps(xv, wv)));
+    }
+#else
+    for (unsigned int o = 0; o < layer.nPad; ++o)
+      out[o] += x * halfToFloat(w[o]);
+#endif
+  }
+  activate(layer.activation, out, layer.nOut);
+}
+
+void OIStrategyQuantizedMLP::evaluateFloat(const Layer& layer, const float* in, float* __restrict__ out) const {
+  std::copy(layer.bias.begin(), layer.bias.end(), out);
+  std::fill(out + layer.nOut, out + layer.nPad, 0.f);
+  for (unsigned int i = 0; i < layer.nIn; ++i) {
+    const float x = in[i];
+    const float* __restrict__ w = layer.floatWeights.data() + i * layer.nPad;
+    for (unsigned int o = 0; o < layer.nPad; ++o)
+      out[o] += x * w[o];
+  }
+  activate(layer.activation, out, layer.nOut);
+}
+
+void OIStrategyQuantizedMLP::evaluateInt8(const Layer& layer, const float* in, float* __restrict__ out) const {
+  alignas(64) int16_t quantized[OIStrategyMLP::kMaxWidth];
+
+  float maxAbs = 0.f;
+  for (unsigned int i = 0; i < layer.nIn; ++i)
+    maxAbs = std::max(maxAbs, std::abs(in[i]));
+  const float scale = maxAbs > 0.f ? maxAbs / 127.f : 1.f;
+  for (unsigned int i = 0; i < layer.nIn; ++i)
+    quantized[i] = int16_t(std::lround(in[i] / scale));
+  std::fill(quantized + layer.nIn, quantized + layer.nPad, 0);
+
+  for (unsigned int o = 0; o < layer.nOut; ++o)
+    out[o] = dotInt8(quantized, layer.int8Weights.data() + o * layer.nPad, layer.nPad) * scale *
+                 layer.weightScale[o] +
+             layer.bias[o];
+  activate(layer.activation, out, layer.nOut);
+}
+
+void OIStrategyQuantizedMLP::evaluate(const float* input, unsigned int nRows, float* output) const {
+  alignas(64) float buffers[2][OIStrategyMLP::kMaxWidth];
+
+  const unsigned int nIn = nInputs();
+  const unsigned int nOut = nOutputs();
+  for (unsigned int row = 0; row < nRows; ++row) {
+    float* in = buffers[0];
+    std::copy(input + row * nIn, input + (row + 1) * nIn, in);
+
+    for (const Layer& layer : layers_) {
+      float* out = (in == buffers[0]) ? buffers[1] : buffers[0];
+      if (precision_ == Precision::Half)
+        evaluateHalf(layer, in, out);
+      else if (!layer.floatWeights.empty())
+        evaluateFloat(layer, in, out);
+      else
+        evaluateInt8(layer, in, out);
+      in = out;
+    }
+
+    std::copy(in, in + nOut, output + row * nOut);
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef RecoMuon_TrackerSeedGenerator_OIStrategyQuantizedMLP_H
+#define RecoMuon_TrackerSeedGenerator_OIStrategyQuantizedMLP_H
+
+/**
+ \class    OIStrategyQuantizedMLP
+ \brief    Reduced precision (fp16 or int8) inference of the dense OI seeding strategy networks
+
+ Built from the float layers of OIStrategyMLP after training, without calibration data:
+ - Half: weights stored as IEEE fp16, activations and accumulation in float.
+ - Int8: weights quantized symmetrically per output, activations quantized symmetrically per row
+   and layer with their largest magnitude, products accumulated in int32 and rescaled to float
+   before the bias and the activation. The first layer stays in float: its raw features range
+   from the pT to the errors of the states, which one scale per row would round to zero.
+ Only the argmax class is used by the seeding. The rounding can still decide between classes whose
+ outputs are closer than it (a few per cent of the L2's in int8, fewer in fp16, for the current
+ models); validate the decisions against TensorFlow (validateDnnBackend) before using a new model
+ quantized.
+
+ The inner loops use F16C and AVX2 (AVX-512 VNNI for int8 if available) when compiled for them,
+ and scalar code otherwise.
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyMLP.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class OIStrategyQuantizedMLP {
+public:
+  enum class Precision { Half, Int8 };
+
+  /// Precision from its configuration name: "fp16" or "int8"
+  static Precision precisionFromName(const std::string& name);
+
+  OIStrategyQuantizedMLP(const OIStrategyMLP& mlp, Precision precision);
+
+  unsigned int nInputs() const { return layers_.empty() ? 0 : layers_.front().nIn; }
+  unsigned int nOutputs() const { return layers_.empty() ? 0 : layers_.back().nOut; }
+  Precision precision() const { return precision_; }
+
+  /// Evaluate nRows input rows (nRows x nInputs(), row-major) into output (nRows x nOutputs())
+  void evaluate(const float* input, unsigned int nRows, float* output) const;
+
+private:
+  struct Layer {
+    unsigned int nIn = 0;
+    unsigned int nOut = 0;
+    /// Half: padded output width (input-major weights); Int8: padded input width (output-major weights)
+    unsigned int nPad = 0;
+    std::vector<uint16_t> halfWeights;
+    std::vector<int8_t> int8Weights;
+    /// Int8: weight scale of each output
+    std::vector<float> weightScale;
+    /// Int8: float weights of the first layer, input-major as for Half
+    std::vector<float> floatWeights;
+    std::vector<float> bias;
+    OIStrategyMLP::Activation activation = OIStrategyMLP::Activation::Linear;
+  };
+
+  void evaluateHalf(const Layer& layer, const float* in, float* out) const;
+  void evaluateFloat(const Layer& layer, const float* in, float* out) const;
+  void evaluateInt8(const Layer& layer, const float* in, float* out) const;
+
+  Precision precision_;
+  std::vector<Layer> layers_;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/**
+  \class    TSGForOIDetIdsFromL2
+  \brief    Strip modules searched by the hit-based seeds of TSGForOIFromL2, for regional unpacking
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIDetIdsFromL2.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+TSGForOIDetIdsFromL2::TSGForOIDetIdsFromL2(const edm::ParameterSet& iConfig)
+    : src_(consumes<reco::TrackCollection>(iConfig.getParameter<edm::InputTag>("src"))),
+      magfieldToken_(esConsumes<MagneticField, IdealMagneticFieldRecord>()),
+      tkGeometryToken_(esConsumes<TrackerGeometry, TrackerDigiGeometryRecord>()),
+      searchTrackerToken_(esConsumes<GeometricSearchTracker, TrackerRecoGeometryRecord>()),
+      estimatorToken_(esConsumes<Chi2MeasurementEstimatorBase, TrackingComponentsRecord>(
+          edm::ESInputTag("", iConfig.getParameter<std::string>("estimator")))),
+      propagatorToken_(esConsumes<Propagator, TrackingComponentsRecord>(
+          edm::ESInputTag("", iConfig.getParameter<std::string>("propagatorName")))),
+      maxEtaForTOB_(iConfig.getParameter<double>("maxEtaForTOB")),
+      minEtaForTEC_(iConfig.getParameter<double>("minEtaForTEC")),
+      errorRescaleFactor_(iConfig.getParameter<double>("errorRescaleFactor")),
+      adjustErrorsDynamically_(iConfig.getParameter<bool>("adjustErrorsDynamically")),
+      dynamicErrorSF_(iConfig),
+      maxLayers_(iConfig.getParameter<uint32_t>("maxLayers")),
+      theCategory_(std::string("Muon|RecoMuon|TSGForOIDetIdsFromL2")) {
+  produces<std::vector<uint32_t> >();
+}
+
+TSGForOIDetIdsFromL2::~TSGForOIDetIdsFromL2() {}
+
+//
+// Collect the modules of the windows of all L2's
+//
+void TSGForOIDetIdsFromL2::produce(edm::StreamID, edm::Event& iEvent, const edm::EventSetup& iSetup) const {
+  const MagneticField* magfield = &iSetup.getData(magfieldToken_);
+  const Chi2MeasurementEstimatorBase& estimator = iSetup.getData(estimatorToken_);
+  std::unique_ptr<Propagator> propagatorAlong =
+      SetPropagationDirection(iSetup.getData(propagatorToken_), alongMomentum);
+
+  const GeometricSearchTracker& searchTracker = iSetup.getData(searchTrackerToken_);
+  const bool isPhase2OT = iSetup.getData(tkGeometryToken_).isThere(GeomDetEnumerators::P2OTEC);
+  const auto& tob = searchTracker.tobLayers();
+  const auto& tecPositive = isPhase2OT ? searchTracker.posTidLayers() : searchTracker.posTecLayers();
+  const auto& tecNegative = isPhase2OT ? searchTracker.negTidLayers() : searchTracker.negTecLayers();
+
+  edm::Handle<reco::TrackCollection> l2TrackCol;
+  iEvent.getByToken(src_, l2TrackCol);
+
+  auto result = std::make_unique<std::vector<uint32_t> >();
+  std::vector<GeometricSearchDet::DetWithState> dets;
+  for (const reco::Track& l2 : *l2TrackCol) {
+    const TrajectoryStateOnSurface tsosAtIP = TSGForOIFromL2::stateAtIP(l2, magfield);
+    const double errorSF =
+        adjustErrorsDynamically_ ? TSGForOIFromL2::calculateSFFromL2(l2, dynamicErrorSF_) : errorRescaleFactor_;
+    // The same regions as the seeding loops of TSGForOIFromL2
+    const double eta = l2.eta();
+    if (std::abs(eta) < maxEtaForTOB_)
+      addDetIds(tob, tsosAtIP, errorSF, *propagatorAlong, estimator, dets, *result);
+    if (eta > minEtaForTEC_)
+      addDetIds(tecPositive, tsosAtIP, errorSF, *propagatorAlong, estimator, dets, *result);
+    if (eta < -minEtaForTEC_)
+      addDetIds(tecNegative, tsosAtIP, errorSF, *propagatorAlong, estimator, dets, *result);
+  }
+
+  std::sort(result->begin(), result->end());
+  result->erase(std::unique(result->begin(), result->end()), result->end());
+  LogTrace(theCategory_) << "TSGForOIDetIdsFromL2::produce: " << result->size() << " modules for "
+                         << l2TrackCol->size() << " L2's";
+  iEvent.put(std::move(result));
+}
+
+//
+// Modules compatible with the rescaled IP state on the outer layers of a region
+//
+template <typename Layer>
+void TSGForOIDetIdsFromL2::addDetIds(const std::vector<Layer const*>& layers,
+                                     const TrajectoryStateOnSurface& tsosAtIP,
+                                     double errorSF,
+                                     const Propagator& propagatorAlong,
+                                     const Chi2MeasurementEstimatorBase& estimator,
+                                     std::vector<GeometricSearchDet::DetWithState>& dets,
+                                     std::vector<uint32_t>& detIds) const {
+  TrajectoryStateOnSurface onLayer(tsosAtIP);
+  if (errorSF != 1.)
+    onLayer.rescaleError(errorSF);
+
+  unsigned int layerCount = 0;
+  for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+    if (maxLayers_ > 0 && layerCount++ == maxLayers_)
+      break;
+    dets.clear();
+    (*it)->compatibleDetsV(onLayer, propagatorAlong, estimator, dets);
+    for (const auto& detWithState : dets) {
+      // Glued stereo modules are unpacked as their mono and stereo components
+      const std::vector<const GeomDet*> components = detWithState.first->components();
+      if (components.empty())
+        detIds.push_back(detWithState.first->geographicalId().rawId());
+      for (const GeomDet* component : components)
+        detIds.push_back(component->geographicalId().rawId());
+    }
+  }
+}
+
+void TSGForOIDetIdsFromL2::fillDescriptions(edm::ConfigurationDescriptions& descriptions) {
+  edm::ParameterSetDescription desc;
+  desc.add<edm::InputTag>("src", edm::InputTag("hltL2Muons", "UpdatedAtVtx"));
+  desc.add<std::string>("estimator", "hltESPChi2MeasurementEstimator100");
+  desc.add<std::string>("propagatorName", "PropagatorWithMaterialParabolicMf");
+  desc.add<double>("maxEtaForTOB", 1.8);
+  desc.add<double>("minEtaForTEC", 0.7);
+  desc.add<double>("errorRescaleFactor", 1.0);
+  desc.add<bool>("adjustErrorsDynamically", false);
+  TSGForOIFromL2::DynamicErrorSF::fillDescription(desc);
+  desc.add<uint32_t>("maxLayers", 0);
+  descriptions.add("TSGForOIDetIdsFromL2", desc);
+}
+
+DEFINE_FWK_MODULE(TSGForOIDetIdsFromL2);
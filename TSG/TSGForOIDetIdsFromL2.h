@@ -0,0 +1,81 @@
+#ifndef RecoMuon_TrackerSeedGenerator_TSGForOIDetIdsFromL2_H
+#define RecoMuon_TrackerSeedGenerator_TSGForOIDetIdsFromL2_H
+
+/**
+ \class    TSGForOIDetIdsFromL2
+ \brief    Strip modules searched by the hit-based seeds of TSGForOIFromL2, for regional unpacking
+
+ Puts into the event the sorted raw ids of the strip modules compatible with the state at the IP of
+ each L2, as TSGForOIFromL2 builds it, on the outer TOB and TEC layers it loops over. Only the
+ geometry is used, not the MeasurementTrackerEvent, so that the clusters of these modules can be
+ unpacked on demand before the seeding. Hitless seeds need no clusters and are not covered.
+ */
+
+#include "DataFormats/TrackReco/interface/Track.h"
+#include "FWCore/Framework/interface/global/EDProducer.h"
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/EventSetup.h"
+#include "FWCore/Framework/interface/MakerMacros.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/Utilities/interface/ESGetToken.h"
+#include "Geometry/Records/interface/TrackerDigiGeometryRecord.h"
+#include "Geometry/TrackerGeometryBuilder/interface/TrackerGeometry.h"
+#include "MagneticField/Engine/interface/MagneticField.h"
+#include "MagneticField/Records/interface/IdealMagneticFieldRecord.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIFromL2.h"
+#include "RecoTracker/Record/interface/TrackerRecoGeometryRecord.h"
+#include "RecoTracker/TkDetLayers/interface/GeometricSearchTracker.h"
+#include "TrackingTools/GeomPropagators/interface/Propagator.h"
+#include "TrackingTools/KalmanUpdators/interface/Chi2MeasurementEstimator.h"
+#include "TrackingTools/Records/interface/TrackingComponentsRecord.h"
+#include "TrackingTools/TrajectoryState/interface/TrajectoryStateOnSurface.h"
+
+#include <cstdint>
+#include <vector>
+
+class TSGForOIDetIdsFromL2 : public edm::global::EDProducer<> {
+public:
+  explicit TSGForOIDetIdsFromL2(const edm::ParameterSet& iConfig);
+  ~TSGForOIDetIdsFromL2() override;
+  static void fillDescriptions(edm::ConfigurationDescriptions& descriptions);
+  void produce(edm::StreamID sid, edm::Event& iEvent, const edm::EventSetup& iSetup) const override;
+
+private:
+  /// Append the ids of the modules compatible with the state on the outermost maxLayers_ layers
+  template <typename Layer>
+  void addDetIds(const std::vector<Layer const*>& layers,
+                 const TrajectoryStateOnSurface& tsosAtIP,
+                 double errorSF,
+                 const Propagator& propagatorAlong,
+                 const Chi2MeasurementEstimatorBase& estimator,
+                 std::vector<GeometricSearchDet::DetWithState>& dets,
+                 std::vector<uint32_t>& detIds) const;
+
+  /// L2 muons updated at vertex, as seeded by TSGForOIFromL2
+  const edm::EDGetTokenT<reco::TrackCollection> src_;
+
+  /// EventSetup products, the same as those of TSGForOIFromL2
+  const edm::ESGetToken<MagneticField, IdealMagneticFieldRecord> magfieldToken_;
+  const edm::ESGetToken<TrackerGeometry, TrackerDigiGeometryRecord> tkGeometryToken_;
+  const edm::ESGetToken<GeometricSearchTracker, TrackerRecoGeometryRecord> searchTrackerToken_;
+  const edm::ESGetToken<Chi2MeasurementEstimatorBase, TrackingComponentsRecord> estimatorToken_;
+  const edm::ESGetToken<Propagator, TrackingComponentsRecord> propagatorToken_;
+
+  /// Eta ranges of the TOB and TEC searches, as in TSGForOIFromL2
+  const double maxEtaForTOB_;
+  const double minEtaForTEC_;
+
+  /// Rescaling of the IP state errors, at least the widest one of the hit-based seeds of TSGForOIFromL2
+  const double errorRescaleFactor_;
+  /// Rescale by the dynamic SF of each L2 instead, as TSGForOIFromL2 with adjustErrorsDynamicallyForHits
+  const bool adjustErrorsDynamically_;
+  const TSGForOIFromL2::DynamicErrorSF dynamicErrorSF_;
+
+  /// Outermost layers covered in each region (0: all of them)
+  const unsigned int maxLayers_;
+
+  const std::string theCategory_;
+};
+
+#endif
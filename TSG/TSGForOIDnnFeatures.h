@@ -0,0 +1,31 @@
+#ifndef RecoMuon_TrackerSeedGenerator_TSGForOIDnnFeatures_H
+#define RecoMuon_TrackerSeedGenerator_TSGForOIDnnFeatures_H
+
+/**
+ \class    TSGForOIDnnFeatures
+ \brief    L2 features available to the strategy DNNs of TSGForOIFromL2
+
+ The models select their inputs among these by name, in the order of their metadata.
+ */
+
+#include <array>
+
+struct TSGForOIDnnFeatures {
+  /// Slots of the feature buffer filled by TSGForOIFromL2::getFeatures
+  enum Feature {
+    kPt, kEta, kPhi, kValidHits,
+    kIPEta, kIPPhi, kIPPt, kIPPtEta, kIPPtPhi, kIPErr0, kIPErr1, kIPErr2, kIPErr3, kIPErr4, kIPValid,
+    kMuSEta, kMuSPhi, kMuSPt, kMuSPtEta, kMuSPtPhi, kMuSErr0, kMuSErr1, kMuSErr2, kMuSErr3, kMuSErr4, kMuSValid,
+    kNFeatures
+  };
+
+  /// Names of the features as used in the DNN metadata, by slot
+  static constexpr std::array<const char*, kNFeatures> names = {
+      {"pt",           "eta",           "phi",            "validHits",
+       "tsos_IP_eta",  "tsos_IP_phi",   "tsos_IP_pt",     "tsos_IP_pt_eta",  "tsos_IP_pt_phi",
+       "err0_IP",      "err1_IP",       "err2_IP",        "err3_IP",         "err4_IP",         "tsos_IP_valid",
+       "tsos_MuS_eta", "tsos_MuS_phi",  "tsos_MuS_pt",    "tsos_MuS_pt_eta", "tsos_MuS_pt_phi",
+       "err0_MuS",     "err1_MuS",      "err2_MuS",       "err3_MuS",        "err4_MuS",        "tsos_MuS_valid"}};
+};
+
+#endif
@@ -7,9 +7,24 @@
 #include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIFromL2.h"
 #include "DataFormats/TrackerCommon/interface/TrackerTopology.h"
 #include "DataFormats/Math/interface/deltaR.h"
-#include "Geometry/TrackerGeometryBuilder/interface/TrackerGeometry.h"
-
+#include "TrackingTools/DetLayers/interface/BarrelDetLayer.h"
+#include "TrackingTools/DetLayers/interface/ForwardDetLayer.h"
+#include "FWCore/ParameterSet/interface/FileInPath.h"
+#include "FWCore/Utilities/interface/Exception.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <numeric>
 #include <memory>
+#include <sstream>
+#include <unordered_map>
+
+#include "tbb/parallel_for.h"
 
 TSGForOIFromL2::TSGForOIFromL2(const edm::ParameterSet& iConfig)
     : src_(consumes<reco::TrackCollection>(iConfig.getParameter<edm::InputTag>("src"))),
@@ -31,22 +46,21 @@ TSGForOIFromL2::TSGForOIFromL2(const edm::ParameterSet& iConfig)
       updator_(new KFUpdator()),
       measurementTrackerTag_(
           consumes<MeasurementTrackerEvent>(iConfig.getParameter<edm::InputTag>("MeasurementTrackerEvent"))),
-      pT1_(iConfig.getParameter<double>("pT1")),
-      pT2_(iConfig.getParameter<double>("pT2")),
-      pT3_(iConfig.getParameter<double>("pT3")),
+      magfieldToken_(esConsumes<MagneticField, IdealMagneticFieldRecord>()),
+      geometryToken_(esConsumes<GlobalTrackingGeometry, GlobalTrackingGeometryRecord>()),
+      tkGeometryToken_(esConsumes<TrackerGeometry, TrackerDigiGeometryRecord>()),
+      searchTrackerToken_(esConsumes<GeometricSearchTracker, TrackerRecoGeometryRecord>()),
+      estimatorToken_(esConsumes<Chi2MeasurementEstimatorBase, TrackingComponentsRecord>(
+          edm::ESInputTag("", iConfig.getParameter<std::string>("estimator")))),
+      propagatorToken_(esConsumes<Propagator, TrackingComponentsRecord>(
+          edm::ESInputTag("", iConfig.getParameter<std::string>("propagatorName")))),
+      SHPOppositeToken_(esConsumes<Propagator, TrackingComponentsRecord>(
+          edm::ESInputTag("", "hltESPSteppingHelixPropagatorOpposite"))),
+      navSchoolToken_(esConsumes<NavigationSchool, NavigationSchoolRecord>(
+          edm::ESInputTag("", "SimpleNavigationSchool"))),
+      dynamicErrorSF_(iConfig),
       eta1_(iConfig.getParameter<double>("eta1")),
-      eta2_(iConfig.getParameter<double>("eta2")),
-      eta3_(iConfig.getParameter<double>("eta3")),
-      eta4_(iConfig.getParameter<double>("eta4")),
-      eta5_(iConfig.getParameter<double>("eta5")),
-      eta6_(iConfig.getParameter<double>("eta6")),
       eta7_(iConfig.getParameter<double>("eta7")),
-      SF1_(iConfig.getParameter<double>("SF1")),
-      SF2_(iConfig.getParameter<double>("SF2")),
-      SF3_(iConfig.getParameter<double>("SF3")),
-      SF4_(iConfig.getParameter<double>("SF4")),
-      SF5_(iConfig.getParameter<double>("SF5")),
-      SF6_(iConfig.getParameter<double>("SF6")),
       tsosDiff1_(iConfig.getParameter<double>("tsosDiff1")),
       tsosDiff2_(iConfig.getParameter<double>("tsosDiff2")),
       propagatorName_(iConfig.getParameter<std::string>("propagatorName")),
@@ -58,463 +72,968 @@ TSGForOIFromL2::TSGForOIFromL2(const edm::ParameterSet& iConfig)
       maxHitDoubletSeeds_(iConfig.getParameter<uint32_t>("maxHitDoubletSeeds")),
       getStrategyFromDNN_(iConfig.getParameter<bool>("getStrategyFromDNN")),
       etaSplitForDnn_(iConfig.getParameter<double>("etaSplitForDnn")),
+      dnnBackend_(OIStrategyBackend::typeFromName(iConfig.getParameter<std::string>("dnnBackend"))),
+      dnnPrecision_(iConfig.getParameter<std::string>("dnnPrecision")),
+      validateDnnBackend_(iConfig.getParameter<bool>("validateDnnBackend")),
+      dnnBatches_(0),
+      dnnRows_(0),
+      dnnMismatches_(0),
+      dnnNanoseconds_{{0, 0}},
+      dnnBatchSize_(iConfig.getParameter<uint32_t>("dnnBatchSize")),
+      dnnBatchMaxWait_(iConfig.getParameter<uint32_t>("dnnBatchMaxWait")),
+      parallelizeL2s_(iConfig.getParameter<bool>("parallelizeL2s")),
+      shareCompatibleDetSearch_(iConfig.getParameter<bool>("shareCompatibleDetSearch")),
+      validateSharedDetSearch_(iConfig.getParameter<bool>("validateSharedDetSearch")),
+      sharedDetSearchCounts_{{0, 0}},
+      hitMultipletDepth_(iConfig.getParameter<uint32_t>("hitMultipletDepth")),
+      hitMultipletBeamWidth_(iConfig.getParameter<uint32_t>("hitMultipletBeamWidth")),
+      hitMultipletBranching_(iConfig.getParameter<uint32_t>("hitMultipletBranching")),
+      helixPrescreen_(iConfig.getParameter<bool>("helixPrescreen")),
+      helixPrescreenTolerance_(iConfig.getParameter<double>("helixPrescreenTolerance")),
+      validateHelixPrescreen_(iConfig.getParameter<bool>("validateHelixPrescreen")),
+      helixPrescreenCounts_{{0, 0, 0}},
+      hitIndexLayers_(iConfig.getParameter<uint32_t>("hitIndexLayers")),
+      hitIndexNSigma_(iConfig.getParameter<double>("hitIndexNSigma")),
+      maxSeedsPerEvent_(iConfig.getParameter<uint32_t>("maxSeedsPerEvent")),
+      minSeedsPerL2_(iConfig.getParameter<uint32_t>("minSeedsPerL2")),
+      seedRanking_(SeedRanking::Chi2),
+      seedDuplicateChi2_(iConfig.getParameter<double>("seedDuplicateChi2")),
+      seedDuplicateCellSize_(iConfig.getParameter<double>("seedDuplicateCellSize")),
+      mergeL2Chi2_(iConfig.getParameter<double>("mergeL2Chi2")),
+      ioMatchDeltaR_(iConfig.getParameter<double>("ioMatchDeltaR")),
+      ioMatchRelDeltaPt_(iConfig.getParameter<double>("ioMatchRelDeltaPt")),
+      ioMatchedL2Seeding_(L2Seeding::None),
+      ioCheckedL2s_(0),
+      ioMatchedL2s_(0),
+      produceTiming_(iConfig.getParameter<bool>("produceTiming")),
       dnnModelPath_barrel_(iConfig.getParameter<std::string>("dnnModelPath_barrel")),
       dnnMetadataPath_barrel_(iConfig.getParameter<std::string>("dnnMetadataPath_barrel")),
       dnnModelPath_endcap_(iConfig.getParameter<std::string>("dnnModelPath_endcap")),
-      dnnMetadataPath_endcap_(iConfig.getParameter<std::string>("dnnMetadataPath_endcap"))
+      dnnMetadataPath_endcap_(iConfig.getParameter<std::string>("dnnMetadataPath_endcap")),
+      dnnOnnxModelPath_barrel_(iConfig.getParameter<std::string>("dnnOnnxModelPath_barrel")),
+      dnnOnnxModelPath_endcap_(iConfig.getParameter<std::string>("dnnOnnxModelPath_endcap")),
+      dnnBundlePath_(iConfig.getParameter<std::string>("dnnBundlePath")),
+      dnnUsesMuSFeatures_(false),
+      approximateMuSFeatures_(iConfig.getParameter<bool>("approximateMuSFeatures")),
+      trackerBoundMapMinEntries_(iConfig.getParameter<uint32_t>("trackerBoundMapMinEntries")),
+      trackerBoundMapCounts_{{0, 0}}
 {
+  if (hitMultipletDepth_ == 0 || hitMultipletBeamWidth_ == 0 || hitMultipletBranching_ == 0)
+    throw cms::Exception("Configuration")
+        << "TSGForOIFromL2: hitMultipletDepth, hitMultipletBeamWidth and hitMultipletBranching must be positive";
+
+  const std::string seedRanking = iConfig.getParameter<std::string>("seedRanking");
+  if (seedRanking == "chi2")
+    seedRanking_ = SeedRanking::Chi2;
+  else if (seedRanking == "l2Pt")
+    seedRanking_ = SeedRanking::L2Pt;
+  else if (seedRanking == "dnnConfidence" && getStrategyFromDNN_)
+    seedRanking_ = SeedRanking::DnnConfidence;
+  else
+    throw cms::Exception("Configuration") << "TSGForOIFromL2: unknown seedRanking " << seedRanking
+                                          << " (dnnConfidence needs getStrategyFromDNN)";
+
+  // Inside-out L3 muons to cascade after, if any
+  const edm::InputTag ioL3Tracks = iConfig.getParameter<edm::InputTag>("ioL3Tracks");
+  const edm::InputTag ioL3MuonTrackLinks = iConfig.getParameter<edm::InputTag>("ioL3MuonTrackLinks");
+  if (!ioL3Tracks.label().empty())
+    ioL3TracksToken_ = consumes<reco::TrackCollection>(ioL3Tracks);
+  if (!ioL3MuonTrackLinks.label().empty())
+    ioL3MuonTrackLinksToken_ = consumes<reco::MuonTrackLinksCollection>(ioL3MuonTrackLinks);
+  const std::string ioMatchedL2Seeding = iConfig.getParameter<std::string>("ioMatchedL2Seeding");
+  if (ioMatchedL2Seeding == "none")
+    ioMatchedL2Seeding_ = L2Seeding::None;
+  else if (ioMatchedL2Seeding == "hitless")
+    ioMatchedL2Seeding_ = L2Seeding::Hitless;
+  else
+    throw cms::Exception("Configuration") << "TSGForOIFromL2: unknown ioMatchedL2Seeding " << ioMatchedL2Seeding;
+
   if (getStrategyFromDNN_){
-      tensorflow::setLogging("2");
-
-      edm::FileInPath dnnPath_barrel(dnnModelPath_barrel_);
-      graphDef_barrel_ = tensorflow::loadGraphDef(dnnPath_barrel.fullPath());
-      tf_session_barrel_ = tensorflow::createSession(graphDef_barrel_);
-      edm::FileInPath dnnMetadataPath_barrel_full(dnnMetadataPath_barrel_);
-      metadataFile_barrel_ = TFile::Open(dnnMetadataPath_barrel_full.fullPath().c_str());
-      inpOrderHist_barrel_ = (TH1D*)(metadataFile_barrel_->Get("input_order"));
-      layerNamesHist_barrel_ = (TH1D*)(metadataFile_barrel_->Get("layer_names"));
-      decoderHist_barrel_ = (TH2D*)(metadataFile_barrel_->Get("scheme"));
-
-      edm::FileInPath dnnPath_endcap(dnnModelPath_endcap_);
-      graphDef_endcap_ = tensorflow::loadGraphDef(dnnPath_endcap.fullPath());
-      tf_session_endcap_ = tensorflow::createSession(graphDef_endcap_);
-      edm::FileInPath dnnMetadataPath_endcap_full(dnnMetadataPath_endcap_);
-      metadataFile_endcap_ = TFile::Open(dnnMetadataPath_endcap_full.fullPath().c_str());
-      inpOrderHist_endcap_ = (TH1D*)(metadataFile_endcap_->Get("input_order"));
-      layerNamesHist_endcap_ = (TH1D*)(metadataFile_endcap_->Get("layer_names"));
-      decoderHist_endcap_ = (TH2D*)(metadataFile_endcap_->Get("scheme"));
+      if (dnnPrecision_ != "float" && dnnBackend_ != OIStrategyBackend::Type::Native)
+          throw cms::Exception("Configuration") << "TSGForOIFromL2: dnnPrecision " << dnnPrecision_
+                                                << " needs the native dnnBackend";
+
+      // The TensorFlow reference is only loaded to validate another backend
+      if (!dnnBundlePath_.empty()) {
+          // The weights of each region are only read when its first L2 is evaluated
+          if (dnnBackend_ != OIStrategyBackend::Type::Native || validateDnnBackend_)
+              throw cms::Exception("Configuration")
+                  << "TSGForOIFromL2: dnnBundlePath needs the native dnnBackend, without validateDnnBackend";
+          dnnModel_barrel_ = OIStrategyModel::get(dnnBundlePath_, "barrel", dnnPrecision_);
+          dnnModel_endcap_ = OIStrategyModel::get(dnnBundlePath_, "endcap", dnnPrecision_);
+      } else {
+          dnnModel_barrel_ = OIStrategyModel::get(dnnModelPath_barrel_, dnnMetadataPath_barrel_,
+                                                  dnnOnnxModelPath_barrel_, dnnBackend_, dnnPrecision_,
+                                                  validateDnnBackend_);
+          dnnModel_endcap_ = OIStrategyModel::get(dnnModelPath_endcap_, dnnMetadataPath_endcap_,
+                                                  dnnOnnxModelPath_endcap_, dnnBackend_, dnnPrecision_,
+                                                  validateDnnBackend_);
+      }
+      if (dnnBatchSize_ > 0) {
+          dnnBatcher_barrel_ = OIStrategyBatcher::get(dnnModel_barrel_, dnnBatchSize_, dnnBatchMaxWait_);
+          dnnBatcher_endcap_ = OIStrategyBatcher::get(dnnModel_endcap_, dnnBatchSize_, dnnBatchMaxWait_);
+      }
+      dnnInputSlots_barrel_ = dnnInputSlots(*dnnModel_barrel_);
+      dnnInputSlots_endcap_ = dnnInputSlots(*dnnModel_endcap_);
+      for (const auto* slots : {&dnnInputSlots_barrel_, &dnnInputSlots_endcap_})
+        for (unsigned int slot : *slots)
+          dnnUsesMuSFeatures_ |= (slot >= TSGForOIDnnFeatures::kMuSEta && slot <= TSGForOIDnnFeatures::kMuSValid);
   }
+  const std::string trackerBoundMapPath = iConfig.getParameter<std::string>("trackerBoundMap");
+  if (!trackerBoundMapPath.empty())
+    trackerBoundMap_ =
+        std::make_unique<const TSGForOITrackerBoundMap>(edm::FileInPath(trackerBoundMapPath).fullPath());
+
   produces<std::vector<TrajectorySeed> >();
+  if (produceTiming_) {
+#ifndef TSGFOROI_TIMING
+    edm::LogWarning(theCategory_) << "produceTiming is set, but the timers are not compiled in (TSGFOROI_TIMING): "
+                                     "the timing products will be empty";
+#endif
+    produces<std::vector<double> >("timing");
+  }
+  if (mergeL2Chi2_ > 0.)
+    produces<std::vector<int> >("l2Clusters");
+}
+
+TSGForOIFromL2::~TSGForOIFromL2() {}
+
+void TSGForOIFromL2::endStream(edm::StreamID sid) const {
+#ifdef TSGFOROI_TIMING
+  std::lock_guard<std::mutex> guard(timingMutex_);
+  timing_.add(streamCache(sid)->timing);
+#endif
+}
+
+void TSGForOIFromL2::endJob() {
+#ifdef TSGFOROI_TIMING
+  std::ostringstream report;
+  timing_.print(report);
+  edm::LogVerbatim(theCategory_) << "TSGForOIFromL2 stage timing, all streams\n" << report.str();
+#endif
+  // Latency of the backend against the TensorFlow reference it was validated with
+  if (dnnBatches_ > 0) {
+    const double batches = dnnBatches_, rows = std::max(1ULL, dnnRows_.load());
+    std::ostringstream dnnReport;
+    dnnReport << "TSGForOIFromL2 DNN backend " << OIStrategyBackend::name(dnnBackend_) << " (" << dnnPrecision_
+              << ") vs tensorflow: "
+              << dnnBatches_.load() << " batches, " << dnnRows_.load() << " L2's, " << dnnMismatches_.load()
+              << " differing decisions\n";
+    // In the batching services, only the reference is timed here
+    for (unsigned int i = dnnBatchSize_ > 0 ? 1 : 0; i != dnnNanoseconds_.size(); ++i)
+      dnnReport << std::left << std::setw(12) << (i == 0 ? OIStrategyBackend::name(dnnBackend_) : "tensorflow")
+                << std::right << std::fixed << std::setprecision(2) << std::setw(10)
+                << dnnNanoseconds_[i].load() * 1e-3 / batches << " us/batch" << std::setw(10)
+                << dnnNanoseconds_[i].load() * 1e-3 / rows << " us/L2\n";
+    edm::LogVerbatim(theCategory_) << dnnReport.str();
+  }
+  if (helixPrescreenCounts_[0] > 0) {
+    std::ostringstream prescreenReport;
+    prescreenReport << "TSGForOIFromL2 helix pre-screen: " << helixPrescreenCounts_[0].load()
+                    << " hitless layer searches, " << helixPrescreenCounts_[1].load() << " rejected";
+    if (validateHelixPrescreen_)
+      prescreenReport << ", " << helixPrescreenCounts_[2].load() << " of them with compatible dets";
+    edm::LogVerbatim(theCategory_) << prescreenReport.str();
+  }
+  if (validateSharedDetSearch_ && sharedDetSearchCounts_[0] > 0)
+    edm::LogVerbatim(theCategory_) << "TSGForOIFromL2 shared det search: " << sharedDetSearchCounts_[0].load()
+                                   << " L2's with filtered searches, " << sharedDetSearchCounts_[1].load()
+                                   << " of them with a first det or a det set differing from the exact search";
+  if (trackerBoundMap_)
+    edm::LogVerbatim(theCategory_) << "TSGForOIFromL2 tracker bound map: " << trackerBoundMapCounts_[0].load()
+                                   << " muon-system states, " << trackerBoundMapCounts_[1].load()
+                                   << " out of the map propagated with the stepping helix";
+  if (ioCheckedL2s_ > 0)
+    edm::LogVerbatim(theCategory_) << "TSGForOIFromL2 cascade: " << ioMatchedL2s_.load() << " of "
+                                   << ioCheckedL2s_.load() << " L2's matched to inside-out L3 muons";
+  for (const auto* batcher : {dnnBatcher_barrel_.get(), dnnBatcher_endcap_.get()}) {
+    if (batcher == nullptr || batcher->batches() == 0)
+      continue;
+    edm::LogVerbatim(theCategory_) << "TSGForOIFromL2 DNN batching service (shared by all modules using the model): "
+                                   << batcher->requests() << " requests in " << batcher->batches() << " batches, "
+                                   << double(batcher->rows()) / batcher->batches() << " rows per batch, "
+                                   << batcher->waitSeconds() * 1e6 / batcher->requests() << " us mean wait";
+  }
+}
+
+std::unique_ptr<TSGForOIStreamCache> TSGForOIFromL2::beginStream(edm::StreamID) const {
+  auto cache = std::make_unique<TSGForOIStreamCache>();
+  cache->event = std::make_unique<TSGForOIEventState>();
+  return cache;
+}
+
+//
+// Refresh the EventSetup products cached for a stream
+//
+const TSGForOIStreamCache& TSGForOIFromL2::updateStreamCache(edm::StreamID sid, const edm::EventSetup& iSetup) const {
+  TSGForOIStreamCache& cache = *streamCache(sid);
+
+  // check() of all watchers, so that each one remembers the current IOV
+  bool changed = cache.magfieldWatcher.check(iSetup);
+  changed |= cache.geometryWatcher.check(iSetup);
+  changed |= cache.searchTrackerWatcher.check(iSetup);
+  changed |= cache.trackingComponentsWatcher.check(iSetup);
+  changed |= cache.navSchoolWatcher.check(iSetup);
+  if (!changed)
+    return cache;
+
+  LogTrace(theCategory_) << "TSGForOIFromL2::updateStreamCache: EventSetup changed, refreshing stream " << sid;
+  cache.magfield = &iSetup.getData(magfieldToken_);
+  cache.geometry = &iSetup.getData(geometryToken_);
+  cache.estimator = &iSetup.getData(estimatorToken_);
+  cache.navSchool = &iSetup.getData(navSchoolToken_);
+  cache.SHPOpposite = &iSetup.getData(SHPOppositeToken_);
+  cache.trackerBoundMap = trackerBoundMap_.get();
+  cache.trackerBoundMapMinEntries = trackerBoundMapMinEntries_;
+
+  // Get suitable propagators
+  const Propagator& propagator = iSetup.getData(propagatorToken_);
+  cache.propagatorAlong = SetPropagationDirection(propagator, alongMomentum);
+  cache.propagatorOpposite = SetPropagationDirection(propagator, oppositeToMomentum);
+
+  // Get vector of Detector layers
+  const GeometricSearchTracker& searchTracker = iSetup.getData(searchTrackerToken_);
+  const bool isPhase2OT = iSetup.getData(tkGeometryToken_).isThere(GeomDetEnumerators::P2OTEC);
+  cache.tob = &searchTracker.tobLayers();
+  cache.tecPositive = isPhase2OT ? &searchTracker.posTidLayers() : &searchTracker.posTecLayers();
+  cache.tecNegative = isPhase2OT ? &searchTracker.negTidLayers() : &searchTracker.negTecLayers();
+  return cache;
 }
 
-TSGForOIFromL2::~TSGForOIFromL2() {
-    if (getStrategyFromDNN_){
-        tensorflow::closeSession(tf_session_barrel_);
-        tensorflow::closeSession(tf_session_endcap_);
-        delete graphDef_barrel_;
-        delete graphDef_endcap_;
-        metadataFile_barrel_->Close();
-        metadataFile_endcap_->Close();
+//
+// Run the work for each L2 either in order, or as independent tasks
+//
+void TSGForOIFromL2::forEachL2(unsigned int nL2, const std::function<void(unsigned int)>& work) const {
+  if (parallelizeL2s_ && nL2 > 1)
+    tbb::parallel_for(0u, nL2, work);
+  else
+    for (unsigned int l2TrackColIndex(0); l2TrackColIndex != nL2; ++l2TrackColIndex)
+      work(l2TrackColIndex);
+}
+
+//
+// With the batching service, prepare the event while the stream waits for the DNN outputs;
+// without it, there is nothing to wait for and produce() prepares the event itself
+//
+void TSGForOIFromL2::acquire(edm::StreamID sid,
+                             const edm::Event& iEvent,
+                             const edm::EventSetup& iSetup,
+                             edm::WaitingTaskWithArenaHolder holder) const {
+  if (dnnBatchSize_ > 0)
+    prepareEvent(sid, iEvent, iSetup, &holder);
+}
+
+//
+// Propagate the L2's and evaluate the strategy DNN, or submit its rows to the batching service with the holder
+//
+void TSGForOIFromL2::prepareEvent(edm::StreamID sid,
+                                  const edm::Event& iEvent,
+                                  const edm::EventSetup& iSetup,
+                                  edm::WaitingTaskWithArenaHolder* holder) const {
+  // EventSetup products, only looked up again when their IOV changes
+  const TSGForOIStreamCache& setup = updateStreamCache(sid, iSetup);
+  // The measurement dets cached in the scratch belong to the previous event
+  for (auto& scratch : setup.scratch) {
+    scratch.measurementDets.clear();
+#ifdef TSGFOROI_TIMING
+    scratch.timing.reset();
+#endif
+  }
+
+  // Read L2 track collection
+  edm::Handle<reco::TrackCollection> l2TrackCol;
+  iEvent.getByToken(src_, l2TrackCol);
+
+  LogTrace(theCategory_) << "TSGForOIFromL2::prepareEvent: Number of L2's: " << l2TrackCol->size();
+  const unsigned int nL2 = l2TrackCol->size();
+  TSGForOIEventState& state = *setup.event;
+
+  // Build the states of all L2's first, so that the strategy DNN is evaluated
+  // once per event for all barrel L2's and once for all endcap L2's
+  std::vector<TrajectoryStateOnSurface>& tsosAtIPs = state.tsosAtIPs;
+  tsosAtIPs.assign(nL2, TrajectoryStateOnSurface());
+  forEachL2(nL2, [&](unsigned int l2TrackColIndex) {
+    TSGFOROI_TIMER(timer, setup.scratch.local().timing.stages[TSGForOITiming::kIPStates]);
+    // One surface per L2, as the states are kept until the seeding loop
+    tsosAtIPs[l2TrackColIndex] = stateAtIP((*l2TrackCol)[l2TrackColIndex], setup.magfield);
+    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::prepareEvent: Created TSOSatIP: " << tsosAtIPs[l2TrackColIndex]
+                               << std::endl;
+  });
+
+  // Clusters of compatible L2's, each seeded once from its representative L2
+  std::vector<int>& l2Clusters = state.l2Clusters;
+  l2Clusters.resize(nL2);
+  std::iota(l2Clusters.begin(), l2Clusters.end(), 0);
+  if (mergeL2Chi2_ > 0.)
+    clusterL2s(*l2TrackCol, tsosAtIPs, l2Clusters);
+
+  // L2's already reconstructed by the inside-out iteration are not seeded, or only with hitless seeds
+  std::vector<L2Seeding>& l2Seeding = state.l2Seeding;
+  l2Seeding.assign(nL2, L2Seeding::Full);
+  if (!ioL3TracksToken_.isUninitialized() || !ioL3MuonTrackLinksToken_.isUninitialized()) {
+    matchIOL3Muons(iEvent, l2TrackCol, l2Seeding);
+    for (unsigned int l2TrackColIndex(0); l2TrackColIndex != nL2; ++l2TrackColIndex) {
+      L2Seeding& clusterSeeding = l2Seeding[l2Clusters[l2TrackColIndex]];
+      clusterSeeding = std::max(clusterSeeding, l2Seeding[l2TrackColIndex]);
     }
+  }
+  auto isSeeded = [&l2Clusters, &l2Seeding](unsigned int l2TrackColIndex) {
+    return l2Clusters[l2TrackColIndex] == int(l2TrackColIndex) && l2Seeding[l2TrackColIndex] != L2Seeding::None;
+  };
+
+  // The states at the tracker bound are only propagated when the DNN or the seeding asks for them
+  std::vector<OuterTkStates>& outerTkStates = state.outerTkStates;
+  outerTkStates.clear();
+  outerTkStates.reserve(nL2);
+  for (unsigned int l2TrackColIndex(0); l2TrackColIndex != nL2; ++l2TrackColIndex)
+    outerTkStates.emplace_back((*l2TrackCol)[l2TrackColIndex], tsosAtIPs[l2TrackColIndex], setup);
+
+  // Evaluate the DNN in one batch per model, or submit the rows to the batching services
+  state.dnnStrategies.assign(nL2, DnnStrategy());
+  if (getStrategyFromDNN_) {
+    std::vector<DnnFeatures> features(nL2);
+    forEachL2(nL2, [&](unsigned int l2TrackColIndex) {
+      if (!isSeeded(l2TrackColIndex))
+        return;
+      const TrajectoryStateOnSurface noState;
+      const TrajectoryStateOnSurface& tsosMuS =
+          !dnnUsesMuSFeatures_
+              ? noState
+              : (approximateMuSFeatures_ ? outerTkStates[l2TrackColIndex].inside()
+                                         : outerTkStates[l2TrackColIndex].outside());
+      getFeatures((*l2TrackCol)[l2TrackColIndex], tsosAtIPs[l2TrackColIndex], tsosMuS, features[l2TrackColIndex]);
+    });
+    std::vector<unsigned int> barrelL2s, endcapL2s;
+    for (unsigned int l2TrackColIndex(0); l2TrackColIndex != nL2; ++l2TrackColIndex) {
+      if (!isSeeded(l2TrackColIndex))
+        continue;
+      if (std::abs((*l2TrackCol)[l2TrackColIndex].eta()) < etaSplitForDnn_)
+        barrelL2s.push_back(l2TrackColIndex);
+      else
+        endcapL2s.push_back(l2TrackColIndex);
+    }
+    if (holder != nullptr) {
+      submitDnn(features, barrelL2s, *dnnBatcher_barrel_, dnnInputSlots_barrel_, state.dnnStrategies, *holder);
+      submitDnn(features, endcapL2s, *dnnBatcher_endcap_, dnnInputSlots_endcap_, state.dnnStrategies, *holder);
+    } else {
+      TSGFOROI_TIMER(timer, setup.scratch.local().timing.stages[TSGForOITiming::kDnn]);
+      evaluateDnn(features, barrelL2s, *dnnModel_barrel_, dnnInputSlots_barrel_, state.dnnStrategies);
+      evaluateDnn(features, endcapL2s, *dnnModel_endcap_, dnnInputSlots_endcap_, state.dnnStrategies);
+    }
+  }
 }
 
 //
-// Produce seeds
+// TSOS at the PCA to the beamline
 //
-void TSGForOIFromL2::produce(edm::StreamID sid, edm::Event& iEvent, const edm::EventSetup& iSetup) const {
-  // Initialize variables
-  unsigned int numSeedsMade = 0;
-  unsigned int layerCount = 0;
-  unsigned int hitlessSeedsMadeIP = 0;
-  unsigned int hitlessSeedsMadeMuS = 0;
-  unsigned int hitSeedsMade = 0;
-  unsigned int hitDoubletSeedsMade = 0;
+TrajectoryStateOnSurface TSGForOIFromL2::stateAtIP(const reco::Track& l2, const MagneticField* magfield) {
+  FreeTrajectoryState fts = trajectoryStateTransform::initialFreeState(l2, magfield);
+  Plane::PlanePointer dummyPlane = Plane::build(fts.position(), Plane::RotationType());
+  return TrajectoryStateOnSurface(fts, *dummyPlane);
+}
 
-  // Surface used to make a TSOS at the PCA to the beamline
-  Plane::PlanePointer dummyPlane = Plane::build(Plane::PositionType(), Plane::RotationType());
+//
+// Make the seeds from the states and strategies of prepareEvent()
+//
+void TSGForOIFromL2::produce(edm::StreamID sid, edm::Event& iEvent, const edm::EventSetup& iSetup) const {
+  if (dnnBatchSize_ == 0)
+    prepareEvent(sid, iEvent, iSetup, nullptr);
+  const TSGForOIStreamCache& setup = *streamCache(sid);
+  TSGForOIEventState& state = *setup.event;
+  std::vector<TrajectoryStateOnSurface>& tsosAtIPs = state.tsosAtIPs;
+  std::vector<int>& l2Clusters = state.l2Clusters;
+  const std::vector<L2Seeding>& l2Seeding = state.l2Seeding;
+  std::vector<OuterTkStates>& outerTkStates = state.outerTkStates;
+  const std::vector<DnnStrategy>& dnnStrategies = state.dnnStrategies;
+  auto isSeeded = [&l2Clusters, &l2Seeding](unsigned int l2TrackColIndex) {
+    return l2Clusters[l2TrackColIndex] == int(l2TrackColIndex) && l2Seeding[l2TrackColIndex] != L2Seeding::None;
+  };
 
-  // Read ESHandles
   edm::Handle<MeasurementTrackerEvent> measurementTrackerH;
-  edm::ESHandle<Chi2MeasurementEstimatorBase> estimatorH;
-  edm::ESHandle<MagneticField> magfieldH;
-  edm::ESHandle<Propagator> propagatorAlongH;
-  edm::ESHandle<Propagator> propagatorOppositeH;
-  edm::ESHandle<TrackerGeometry> tmpTkGeometryH;
-  edm::ESHandle<GlobalTrackingGeometry> geometryH;
-  edm::ESHandle<NavigationSchool> navSchool;
-
-  iSetup.get<IdealMagneticFieldRecord>().get(magfieldH);
-  iSetup.get<TrackingComponentsRecord>().get(propagatorName_, propagatorOppositeH);
-  iSetup.get<TrackingComponentsRecord>().get(propagatorName_, propagatorAlongH);
-  iSetup.get<GlobalTrackingGeometryRecord>().get(geometryH);
-  iSetup.get<TrackerDigiGeometryRecord>().get(tmpTkGeometryH);
-  iSetup.get<TrackingComponentsRecord>().get(estimatorName_, estimatorH);
   iEvent.getByToken(measurementTrackerTag_, measurementTrackerH);
-  iSetup.get<NavigationSchoolRecord>().get("SimpleNavigationSchool", navSchool);
 
-  // Read L2 track collection
   edm::Handle<reco::TrackCollection> l2TrackCol;
   iEvent.getByToken(src_, l2TrackCol);
+  const unsigned int nL2 = l2TrackCol->size();
 
   // The product
   std::unique_ptr<std::vector<TrajectorySeed> > result(new std::vector<TrajectorySeed>());
 
-  // Get vector of Detector layers
-  std::vector<BarrelDetLayer const*> const& tob = measurementTrackerH->geometricSearchTracker()->tobLayers();
-  std::vector<ForwardDetLayer const*> const& tecPositive =
-      tmpTkGeometryH->isThere(GeomDetEnumerators::P2OTEC)
-          ? measurementTrackerH->geometricSearchTracker()->posTidLayers()
-          : measurementTrackerH->geometricSearchTracker()->posTecLayers();
-  std::vector<ForwardDetLayer const*> const& tecNegative =
-      tmpTkGeometryH->isThere(GeomDetEnumerators::P2OTEC)
-          ? measurementTrackerH->geometricSearchTracker()->negTidLayers()
-          : measurementTrackerH->geometricSearchTracker()->negTecLayers();
+  // Outer layers whose hits are indexed for all L2's, each read by the first L2 searching it with hits
+  if (hitIndexLayers_ > 0) {
+    state.hitIndex.clear(hitIndexNSigma_, *measurementTrackerH, setup.magfield);
+    auto addLayers = [&](const auto& layers) {
+      unsigned int layerCount = 0;
+      for (auto it = layers.rbegin(); it != layers.rend() && layerCount != hitIndexLayers_; ++it, ++layerCount)
+        state.hitIndex.addLayer(**it);
+    };
+    addLayers(*setup.tob);
+    addLayers(*setup.tecPositive);
+    addLayers(*setup.tecNegative);
+  }
 
-  // Get suitable propagators
-  std::unique_ptr<Propagator> propagatorAlong = SetPropagationDirection(*propagatorAlongH, alongMomentum);
-  std::unique_ptr<Propagator> propagatorOpposite = SetPropagationDirection(*propagatorOppositeH, oppositeToMomentum);
+  const SeedingContext context{*measurementTrackerH,
+                               *setup.estimator,
+                               *setup.navSchool,
+                               *setup.propagatorAlong,
+                               *setup.propagatorOpposite,
+                               *setup.tob,
+                               *setup.tecPositive,
+                               *setup.tecNegative,
+                               hitIndexLayers_ > 0 ? &state.hitIndex : nullptr};
+
+  // The state of a merged cluster covers the search windows of all its L2's
+  // (after the DNN, which takes the state of the representative as it is)
+  if (mergeL2Chi2_ > 0.)
+    widenClusterStates(l2Clusters, tsosAtIPs);
+
+  // Make seeds for all L2's, in L2 order
+  // (for the seed budget and de-duplication, also keep the first seed and the seed chi2 of each L2)
+  const bool keepSeedInfo = maxSeedsPerEvent_ > 0 || seedDuplicateChi2_ > 0.;
+  std::vector<unsigned int> l2SeedOffsets;
+  std::vector<float> seedChi2;
+  result->reserve(nL2 * maxSeeds_);
+  if (parallelizeL2s_ && nL2 > 1) {
+    // Each task fills its own container, moved into the product in order afterwards
+    std::vector<std::vector<TrajectorySeed> > seedsPerL2(nL2);
+    std::vector<std::vector<float> > seedChi2PerL2(keepSeedInfo ? nL2 : 0);
+    forEachL2(nL2, [&](unsigned int l2TrackColIndex) {
+      if (!isSeeded(l2TrackColIndex))
+        return;
+      TSGForOIScratch& scratch = setup.scratch.local();
+      makeSeedsForL2(reco::TrackRef(l2TrackCol, l2TrackColIndex),
+                     tsosAtIPs[l2TrackColIndex],
+                     outerTkStates[l2TrackColIndex],
+                     getStrategyFromDNN_ ? &dnnStrategies[l2TrackColIndex] : nullptr,
+                     l2Seeding[l2TrackColIndex] == L2Seeding::Hitless,
+                     context,
+                     scratch,
+                     seedsPerL2[l2TrackColIndex]);
+      if (keepSeedInfo)
+        seedChi2PerL2[l2TrackColIndex] = scratch.seedChi2;
+    });
+    for (unsigned int l2TrackColIndex(0); l2TrackColIndex != nL2; ++l2TrackColIndex) {
+      auto& out = seedsPerL2[l2TrackColIndex];
+      if (keepSeedInfo) {
+        l2SeedOffsets.push_back(result->size());
+        seedChi2.insert(seedChi2.end(), seedChi2PerL2[l2TrackColIndex].begin(), seedChi2PerL2[l2TrackColIndex].end());
+      }
+      result->insert(result->end(), std::make_move_iterator(out.begin()), std::make_move_iterator(out.end()));
+    }
+  } else {
+    TSGForOIScratch& scratch = setup.scratch.local();
+    for (unsigned int l2TrackColIndex(0); l2TrackColIndex != nL2; ++l2TrackColIndex) {
+      if (keepSeedInfo)
+        l2SeedOffsets.push_back(result->size());
+      if (!isSeeded(l2TrackColIndex))
+        continue;
+      makeSeedsForL2(reco::TrackRef(l2TrackCol, l2TrackColIndex),
+                     tsosAtIPs[l2TrackColIndex],
+                     outerTkStates[l2TrackColIndex],
+                     getStrategyFromDNN_ ? &dnnStrategies[l2TrackColIndex] : nullptr,
+                     l2Seeding[l2TrackColIndex] == L2Seeding::Hitless,
+                     context,
+                     scratch,
+                     *result);
+      if (keepSeedInfo)
+        seedChi2.insert(seedChi2.end(), scratch.seedChi2.begin(), scratch.seedChi2.end());
+    }
+  }
 
-  // Stepping Helix Propagator for propogation from muon system to tracker
-  edm::ESHandle<Propagator> SHPOpposite;
-  iSetup.get<TrackingComponentsRecord>().get("hltESPSteppingHelixPropagatorOpposite", SHPOpposite);
+  if (helixPrescreen_ || trackerBoundMap_ || validateSharedDetSearch_) {
+    for (auto& scratch : setup.scratch) {
+      for (unsigned int i = 0; i != helixPrescreenCounts_.size(); ++i)
+        helixPrescreenCounts_[i] += scratch.helixPrescreenCounts[i];
+      for (unsigned int i = 0; i != trackerBoundMapCounts_.size(); ++i)
+        trackerBoundMapCounts_[i] += scratch.trackerBoundMapCounts[i];
+      for (unsigned int i = 0; i != sharedDetSearchCounts_.size(); ++i)
+        sharedDetSearchCounts_[i] += scratch.sharedDetSearchCounts[i];
+      scratch.helixPrescreenCounts.fill(0);
+      scratch.trackerBoundMapCounts.fill(0);
+      scratch.sharedDetSearchCounts.fill(0);
+    }
+  }
 
-  // Loop over the L2's and make seeds for all of them
-  LogTrace(theCategory_) << "TSGForOIFromL2::produce: Number of L2's: " << l2TrackCol->size();
-  for (unsigned int l2TrackColIndex(0); l2TrackColIndex != l2TrackCol->size(); ++l2TrackColIndex) {
-    const reco::TrackRef l2(l2TrackCol, l2TrackColIndex);
+  if (keepSeedInfo)
+    l2SeedOffsets.push_back(result->size());
+  // Duplicates are removed first, so that they do not take up the budget
+  if (seedDuplicateChi2_ > 0.)
+    removeDuplicateSeeds(setup, l2SeedOffsets, seedChi2, *result);
+  if (maxSeedsPerEvent_ > 0 && result->size() > maxSeedsPerEvent_)
+    applySeedBudget(*l2TrackCol, dnnStrategies, l2SeedOffsets, seedChi2, *result);
 
-    // Container of Seeds
-    std::vector<TrajectorySeed> out;
-    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::produce: L2 muon pT, eta, phi --> " << l2->pt() << " , " << l2->eta()
-                               << " , " << l2->phi() << std::endl;
+  edm::LogInfo(theCategory_) << "TSGForOIFromL2::produce: number of seeds made: " << result->size();
+  if (hitIndexLayers_ > 0)
+    LogTrace(theCategory_) << "TSGForOIFromL2::produce: " << state.hitIndex.size() << " hits indexed in "
+                           << state.hitIndex.layersRead() << " layers";
+
+  if (produceTiming_) {
+    TSGForOITiming eventTiming;
+#ifdef TSGFOROI_TIMING
+    for (const auto& scratch : setup.scratch)
+      eventTiming.add(scratch.timing);
+    streamCache(sid)->timing.add(eventTiming);
+#endif
+    iEvent.put(std::make_unique<std::vector<double> >(eventTiming.seconds()), "timing");
+  } else {
+#ifdef TSGFOROI_TIMING
+    for (const auto& scratch : setup.scratch)
+      streamCache(sid)->timing.add(scratch.timing);
+#endif
+  }
 
-    FreeTrajectoryState fts = trajectoryStateTransform::initialFreeState(*l2, magfieldH.product());
+  if (mergeL2Chi2_ > 0.)
+    iEvent.put(std::make_unique<std::vector<int> >(l2Clusters), "l2Clusters");
 
-    dummyPlane->move(fts.position() - dummyPlane->position());
-    TrajectoryStateOnSurface tsosAtIP = TrajectoryStateOnSurface(fts, *dummyPlane);
-    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::produce: Created TSOSatIP: " << tsosAtIP << std::endl;
+  iEvent.put(std::move(result));
+}
 
+//
+// States at the tracker bound, propagated on first use
+//
+const TrajectoryStateOnSurface& TSGForOIFromL2::OuterTkStates::inside() {
+  if (!hasInside_) {
+    TSGFOROI_TIMER(timer, setup_->scratch.local().timing.stages[TSGForOITiming::kOuterTkStates]);
+    StateOnTrackerBound fromInside(setup_->propagatorAlong.get());
+    inside_ = fromInside(*tsosAtIP_->freeState());
+    hasInside_ = true;
+  }
+  return inside_;
+}
+
+const TrajectoryStateOnSurface& TSGForOIFromL2::OuterTkStates::outside() {
+  if (!hasOutside_) {
+    TSGForOIScratch& scratch = setup_->scratch.local();
+    TSGFOROI_TIMER(timer, scratch.timing.stages[TSGForOITiming::kOuterTkStates]);
     // Get the TSOS on the innermost layer of the L2
     TrajectoryStateOnSurface tsosAtMuonSystem =
-        trajectoryStateTransform::innerStateOnSurface(*l2, *geometryH, magfieldH.product());
-    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::produce: Created TSOSatMuonSystem: " << tsosAtMuonSystem
+        trajectoryStateTransform::innerStateOnSurface(*l2_, *setup_->geometry, setup_->magfield);
+    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::OuterTkStates: Created TSOSatMuonSystem: " << tsosAtMuonSystem
                                << std::endl;
-
-    LogTrace("TSGForOIFromL2")
-        << "TSGForOIFromL2::produce: Check the error of the L2 parameter and use hit seeds if big errors" << std::endl;
-
-    StateOnTrackerBound fromInside(propagatorAlong.get());
-    TrajectoryStateOnSurface outerTkStateInside = fromInside(fts);
-
-    StateOnTrackerBound fromOutside(&*SHPOpposite);
-    TrajectoryStateOnSurface outerTkStateOutside = fromOutside(tsosAtMuonSystem);
-
-    // Check if the two positions (using updated and not-updated TSOS) agree withing certain extent.
-    // If both TSOSs agree, use only the one at vertex, as it uses more information. If they do not agree, search for seeds based on both.
-    double L2muonEta = l2->eta();
-    double absL2muonEta = std::abs(L2muonEta);
-    bool useBoth = false;
-    
-    // make non-const copies of parameters
-    // (we want to override them if DNN evaluation is enabled)
-    unsigned int maxHitSeeds__ = maxHitSeeds_;
-    unsigned int maxHitDoubletSeeds__ = maxHitDoubletSeeds_;
-    unsigned int maxHitlessSeedsIP__ = maxHitlessSeedsIP_;
-    unsigned int maxHitlessSeedsMuS__ = maxHitlessSeedsMuS_; 
-    bool dontCreateHitbasedInBarrelAsInRun2__ = dontCreateHitbasedInBarrelAsInRun2_;
-    bool useBothAsInRun2__ = useBothAsInRun2_;
-    
-    // update strategy parameters by evaluating DNN
-    if (getStrategyFromDNN_){
-        int nHBd(0), nHLIP(0), nHLMuS(0);
-        bool dnnSuccess_ = false;
-
-        // Put variables needed for DNN into an std::map
-        std::map<std::string, float> feature_map_ = getFeatureMap(l2, tsosAtIP, outerTkStateOutside);
-        //for (auto const &pair: feature_map_) {
-        //    std::cout << pair.first << " = " << pair.second << srd::endl;
-        //}
-
-        if (std::abs(l2->eta())<etaSplitForDnn_){
-            // barrel
-            evaluateDnn(
-                feature_map_, tf_session_barrel_,
-                inpOrderHist_barrel_, layerNamesHist_barrel_, decoderHist_barrel_,
-                nHBd, nHLIP, nHLMuS, dnnSuccess_
-            );
-        } else {
-            // endcap
-            evaluateDnn(
-                feature_map_, tf_session_endcap_,
-                inpOrderHist_endcap_, layerNamesHist_endcap_, decoderHist_endcap_,
-                nHBd, nHLIP, nHLMuS, dnnSuccess_
-            );
-        }
-        if (!dnnSuccess_) break;
-        //std::cout << "DNN decision: " << nHBd << " " << nHLIP << " " << nHLMuS << std::endl;
-        maxHitSeeds__ = 0;
-        maxHitDoubletSeeds__ = nHBd;
-        maxHitlessSeedsIP__ = nHLIP;
-        maxHitlessSeedsMuS__ = nHLMuS;
-        
-        dontCreateHitbasedInBarrelAsInRun2__ = false;
-        useBothAsInRun2__ = false;
+    // The map if it covers the state, else the stepping helix
+    if (setup_->trackerBoundMap != nullptr)
+      outside_ = setup_->trackerBoundMap->propagate(
+          tsosAtMuonSystem, setup_->magfield, setup_->trackerBoundMapMinEntries);
+    if (outside_.isValid()) {
+      ++scratch.trackerBoundMapCounts[0];
+    } else {
+      StateOnTrackerBound fromOutside(setup_->SHPOpposite);
+      outside_ = fromOutside(tsosAtMuonSystem);
+      ++scratch.trackerBoundMapCounts[1];
     }
+    hasOutside_ = true;
+  }
+  return outside_;
+}
 
-    if (useBothAsInRun2__ && outerTkStateInside.isValid() && outerTkStateOutside.isValid()) {
-      if (l2->numberOfValidHits() < numL2ValidHitsCutAllEta_)
-        useBoth = true;
-      if (l2->numberOfValidHits() < numL2ValidHitsCutAllEndcap_ && absL2muonEta > eta7_)
-        useBoth = true;
-      if (absL2muonEta > eta1_ && absL2muonEta < eta1_)
-        useBoth = true;
-    }
-    
-    numSeedsMade = 0;
-    hitlessSeedsMadeIP = 0;
-    hitlessSeedsMadeMuS = 0;
-    hitSeedsMade = 0;
-    hitDoubletSeedsMade = 0;
-
-    // calculate scale factors
-    double errorSFHits = (adjustErrorsDynamicallyForHits_ ? calculateSFFromL2(l2) : fixedErrorRescalingForHits_);
-    double errorSFHitless =
-        (adjustErrorsDynamicallyForHitless_ ? calculateSFFromL2(l2) : fixedErrorRescalingForHitless_);
-
-    // BARREL
-    if (absL2muonEta < maxEtaForTOB_) {
-      layerCount = 0;
-      for (auto it = tob.rbegin(); it != tob.rend(); ++it) {
-        LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::produce: looping in TOB layer " << layerCount << std::endl;
-        if (useHitLessSeeds_ && hitlessSeedsMadeIP < maxHitlessSeedsIP__ && numSeedsMade < maxSeeds_)
-          makeSeedsWithoutHits(**it,
-                               tsosAtIP,
-                               *(propagatorAlong.get()),
-                               estimatorH,
-                               errorSFHitless,
-                               hitlessSeedsMadeIP,
-                               numSeedsMade,
-                               out);
-        if (outerTkStateInside.isValid() && outerTkStateOutside.isValid() &&
-            useHitLessSeeds_ && hitlessSeedsMadeMuS < maxHitlessSeedsMuS__ && numSeedsMade < maxSeeds_)
-            makeSeedsWithoutHits(**it,
-                                 outerTkStateOutside,
-                                 *(propagatorOpposite.get()),
-                                 estimatorH,
-                                 errorSFHitless,
-                                 hitlessSeedsMadeMuS,
-                                 numSeedsMade,
-                                 out);
-        // Do not create hitbased seeds in barrel region
-        if (hitSeedsMade < maxHitSeeds__ && numSeedsMade < maxSeeds_){
-            // Run2 approach, preserved for backward compatibility
-            if (!(dontCreateHitbasedInBarrelAsInRun2__ && (absL2muonEta <= 1.0)))
-              makeSeedsFromHits(**it,
-                            tsosAtIP,
-                            *(propagatorAlong.get()),
-                            estimatorH,
-                            measurementTrackerH,
-                            errorSFHits,
-                            hitSeedsMade,
-                            numSeedsMade,
-                            layerCount,
-                            out);
-        }
+//
+// Create the seeds of one L2
+//
+void TSGForOIFromL2::makeSeedsForL2(const reco::TrackRef& l2,
+                                    const TrajectoryStateOnSurface& tsosAtIP,
+                                    OuterTkStates& outerTkStates,
+                                    const DnnStrategy* strategy,
+                                    bool hitlessOnly,
+                                    const SeedingContext& context,
+                                    TSGForOIScratch& scratch,
+                                    std::vector<TrajectorySeed>& out) const {
+  scratch.seedChi2.clear();
+  LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsForL2: L2 muon pT, eta, phi --> " << l2->pt() << " , "
+                             << l2->eta() << " , " << l2->phi() << std::endl;
+
+  const double absL2muonEta = std::abs(l2->eta());
+
+  // Limits of the configuration, or of the DNN decision if enabled
+  SeedingPlan plan;
+  plan.maxHitSeeds = strategy != nullptr ? 0 : maxHitSeeds_;
+  plan.maxHitDoubletSeeds = strategy != nullptr ? strategy->nHB : maxHitDoubletSeeds_;
+  plan.maxHitlessSeedsIP = strategy != nullptr ? strategy->nHLIP : maxHitlessSeedsIP_;
+  plan.maxHitlessSeedsMuS = strategy != nullptr ? strategy->nHLMuS : maxHitlessSeedsMuS_;
+  const bool useBothAsInRun2 = strategy == nullptr && useBothAsInRun2_;
+  // Run2 approach, preserved for backward compatibility: no hit-based seeds in the central barrel
+  plan.hitBasedInBarrel = !(strategy == nullptr && dontCreateHitbasedInBarrelAsInRun2_ && absL2muonEta <= 1.0);
+
+  // The inside-out iteration found this L2: keep only its hitless seeds
+  if (hitlessOnly) {
+    plan.maxHitSeeds = 0;
+    plan.maxHitDoubletSeeds = 0;
+  }
 
-        if (hitDoubletSeedsMade < maxHitDoubletSeeds__ && numSeedsMade < maxSeeds_){
-            makeSeedsFromHitDoublets(**it,
-                            tsosAtIP,
-                            *(propagatorAlong.get()),
-                            estimatorH,
-                            measurementTrackerH,
-                            navSchool,
-                            errorSFHits,
-                            hitDoubletSeedsMade,
-                            numSeedsMade,
-                            layerCount,
-                            out);
-        }
-        // Run2 approach, preserved for backward compatibility
-        if (useBoth) {
-          if (useHitLessSeeds_ && hitlessSeedsMadeMuS < maxHitlessSeedsIP__ && numSeedsMade < maxSeeds_)
-            makeSeedsWithoutHits(**it,
-                                 outerTkStateOutside,
-                                 *(propagatorOpposite.get()),
-                                 estimatorH,
-                                 errorSFHitless,
-                                 hitlessSeedsMadeMuS,
-                                 numSeedsMade,
+  // The states at the tracker bound only serve the muon-system hitless seeds and the Run2 logic,
+  // which only adds such seeds: leave them invalid, and unpropagated, if neither can be used
+  if (useHitLessSeeds_ && (plan.maxHitlessSeedsMuS > 0 || useBothAsInRun2)) {
+    const TrajectoryStateOnSurface& outerTkStateInside = outerTkStates.inside();
+    plan.outerTkStateOutside = outerTkStates.outside();
+    plan.hasOuterTkStates = outerTkStateInside.isValid() && plan.outerTkStateOutside.isValid();
+  }
+
+  // Check if the two positions (using updated and not-updated TSOS) agree withing certain extent.
+  // If both TSOSs agree, use only the one at vertex, as it uses more information. If they do not agree, search for seeds based on both.
+  if (useBothAsInRun2 && plan.hasOuterTkStates) {
+    if (l2->numberOfValidHits() < numL2ValidHitsCutAllEta_)
+      plan.useBoth = true;
+    if (l2->numberOfValidHits() < numL2ValidHitsCutAllEndcap_ && absL2muonEta > eta7_)
+      plan.useBoth = true;
+    if (absL2muonEta > eta1_ && absL2muonEta < eta1_)
+      plan.useBoth = true;
+  }
+
+  // calculate scale factors
+  plan.errorSFHits =
+      (adjustErrorsDynamicallyForHits_ ? calculateSFFromL2(*l2, dynamicErrorSF_) : fixedErrorRescalingForHits_);
+  plan.errorSFHitless =
+      (adjustErrorsDynamicallyForHitless_ ? calculateSFFromL2(*l2, dynamicErrorSF_) : fixedErrorRescalingForHitless_);
+
+  // Hitless seeds search with the unscaled state, hit-based ones with errorSFHits
+  if (shareCompatibleDetSearch_)
+    plan.widestErrorSF =
+        (plan.maxHitSeeds > 0 || plan.maxHitDoubletSeeds > 0) ? std::max(1., plan.errorSFHits) : 1.;
+
+  TSGForOIDetSearchStore& detsIP = scratch.detsIP;
+  detsIP.validate = validateSharedDetSearch_ && plan.widestErrorSF > 0.;
+  detsIP.filtered = false;
+  detsIP.differs = false;
+
+  // Traversal with only the seed types this L2 can get; the single-hit seeds and the Run2 logic
+  // only exist with the configured limits, and hitlessOnly leaves no hit-based seeds
+  const bool hitBased = !hitlessOnly;
+  const bool run2 = strategy == nullptr;
+  if (useHitLessSeeds_ && hitBased && run2)
+    seedRegions<SeedingPolicy<true, true, true> >(l2, tsosAtIP, plan, context, scratch, out);
+  else if (useHitLessSeeds_ && hitBased)
+    seedRegions<SeedingPolicy<true, true, false> >(l2, tsosAtIP, plan, context, scratch, out);
+  else if (useHitLessSeeds_ && run2)
+    seedRegions<SeedingPolicy<true, false, true> >(l2, tsosAtIP, plan, context, scratch, out);
+  else if (useHitLessSeeds_)
+    seedRegions<SeedingPolicy<true, false, false> >(l2, tsosAtIP, plan, context, scratch, out);
+  else if (hitBased && run2)
+    seedRegions<SeedingPolicy<false, true, true> >(l2, tsosAtIP, plan, context, scratch, out);
+  else if (hitBased)
+    seedRegions<SeedingPolicy<false, true, false> >(l2, tsosAtIP, plan, context, scratch, out);
+
+  if (detsIP.filtered) {
+    ++scratch.sharedDetSearchCounts[0];
+    if (detsIP.differs)
+      ++scratch.sharedDetSearchCounts[1];
+  }
+}
+
+//
+// Seed the regions of an L2, with the seed counts restarted between the TOB and the TEC in their overlap
+//
+template <typename Policy>
+void TSGForOIFromL2::seedRegions(const reco::TrackRef& l2,
+                                 const TrajectoryStateOnSurface& tsosAtIP,
+                                 const SeedingPlan& plan,
+                                 const SeedingContext& context,
+                                 TSGForOIScratch& scratch,
+                                 std::vector<TrajectorySeed>& out) const {
+  const double L2muonEta = l2->eta();
+  const double absL2muonEta = std::abs(L2muonEta);
+  SeedCounts counts;
+
+  // BARREL
+  if (absL2muonEta < maxEtaForTOB_) {
+    scratch.region = TSGForOITiming::kTOB;
+    seedLayers<Policy>(context.tob, "TOB", tsosAtIP, plan, context, scratch, counts, out);
+  }
+
+  // Reset number of seeds if in overlap region
+  if (absL2muonEta > minEtaForTEC_ && absL2muonEta < maxEtaForTOB_)
+    counts = SeedCounts();
+
+  // ENDCAP+
+  if (L2muonEta > minEtaForTEC_) {
+    scratch.region = TSGForOITiming::kTECPositive;
+    seedLayers<Policy>(context.tecPositive, "TEC+", tsosAtIP, plan, context, scratch, counts, out);
+  }
+
+  // ENDCAP-
+  if (L2muonEta < -minEtaForTEC_) {
+    scratch.region = TSGForOITiming::kTECNegative;
+    seedLayers<Policy>(context.tecNegative, "TEC-", tsosAtIP, plan, context, scratch, counts, out);
+  }
+}
+
+//
+// Seed the layers of a region, from the outermost one, with the seed types of the policy
+//
+template <typename Policy, typename Layer>
+void TSGForOIFromL2::seedLayers(const std::vector<Layer const*>& layers,
+                                const char* regionName,
+                                const TrajectoryStateOnSurface& tsosAtIP,
+                                const SeedingPlan& plan,
+                                const SeedingContext& context,
+                                TSGForOIScratch& scratch,
+                                SeedCounts& counts,
+                                std::vector<TrajectorySeed>& out) const {
+  unsigned int layerCount = 0;
+  for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsForL2: looping in " << regionName << " layer "
+                               << layerCount << std::endl;
+    LayerSearch searchIP(**it,
+                         tsosAtIP,
+                         context.propagatorAlong,
+                         context.estimator,
+                         plan.widestErrorSF,
+                         context.hitIndex,
+                         scratch.detsIP,
+                         scratch.timing);
+    LayerSearch searchMuS(**it,
+                          plan.outerTkStateOutside,
+                          context.propagatorOpposite,
+                          context.estimator,
+                          0.,
+                          nullptr,
+                          scratch.detsMuS,
+                          scratch.timing);
+    if constexpr (Policy::kHitless) {
+      if (counts.hitlessIP < plan.maxHitlessSeedsIP && counts.total < maxSeeds_)
+        makeSeedsWithoutHits(searchIP, scratch, plan.errorSFHitless, counts.hitlessIP, counts.total, out);
+      if (plan.hasOuterTkStates && counts.hitlessMuS < plan.maxHitlessSeedsMuS && counts.total < maxSeeds_)
+        makeSeedsWithoutHits(searchMuS, scratch, plan.errorSFHitless, counts.hitlessMuS, counts.total, out);
+    }
+    if constexpr (Policy::kHitBased && Policy::kRun2) {
+      if (plan.hitBasedInBarrel && counts.hit < plan.maxHitSeeds && counts.total < maxSeeds_)
+        makeSeedsFromHits(searchIP,
+                          context.measurementTracker,
+                          scratch,
+                          plan.errorSFHits,
+                          counts.hit,
+                          counts.total,
+                          layerCount,
+                          out);
+    }
+    if constexpr (Policy::kHitBased) {
+      if (counts.hitDoublet < plan.maxHitDoubletSeeds && counts.total < maxSeeds_)
+        makeSeedsFromHitDoublets(searchIP,
+                                 context.measurementTracker,
+                                 context.navSchool,
+                                 scratch,
+                                 plan.errorSFHits,
+                                 counts.hitDoublet,
+                                 counts.total,
+                                 layerCount,
                                  out);
-        }
-      }
-      LogTrace("TSGForOIFromL2") << "TSGForOIFromL2:::produce: NumSeedsMade = " << numSeedsMade
-                                 << " , layerCount = " << layerCount << std::endl;
     }
-
-    // Reset number of seeds if in overlap region
-    if (absL2muonEta > minEtaForTEC_ && absL2muonEta < maxEtaForTOB_) {
-      numSeedsMade = 0;
-      hitlessSeedsMadeIP = 0;
-      hitlessSeedsMadeMuS = 0;
-      hitSeedsMade = 0;
-      hitDoubletSeedsMade = 0;
+    // Run2 approach, preserved for backward compatibility
+    if constexpr (Policy::kHitless && Policy::kRun2) {
+      if (plan.useBoth && counts.hitlessMuS < plan.maxHitlessSeedsIP && counts.total < maxSeeds_)
+        makeSeedsWithoutHits(searchMuS, scratch, plan.errorSFHitless, counts.hitlessMuS, counts.total, out);
     }
+  }
+  LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsForL2: NumSeedsMade = " << counts.total
+                             << " , layerCount = " << layerCount << std::endl;
+}
 
-    // ENDCAP+
-    if (L2muonEta > minEtaForTEC_) {
-      layerCount = 0;
-      for (auto it = tecPositive.rbegin(); it != tecPositive.rend(); ++it) {
-        LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::produce: looping in TEC+ layer " << layerCount << std::endl;
-        if (useHitLessSeeds_ && hitlessSeedsMadeIP < maxHitlessSeedsIP__ && numSeedsMade < maxSeeds_)
-          makeSeedsWithoutHits(**it,
-                               tsosAtIP,
-                               *(propagatorAlong.get()),
-                               estimatorH,
-                               errorSFHitless,
-                               hitlessSeedsMadeIP,
-                               numSeedsMade,
-                               out);
-        if (outerTkStateInside.isValid() && outerTkStateOutside.isValid() &&
-            useHitLessSeeds_ && hitlessSeedsMadeMuS < maxHitlessSeedsMuS__ && numSeedsMade < maxSeeds_)
-            makeSeedsWithoutHits(**it,
-                                 outerTkStateOutside,
-                                 *(propagatorOpposite.get()),
-                                 estimatorH,
-                                 errorSFHitless,
-                                 hitlessSeedsMadeMuS,
-                                 numSeedsMade,
-                                 out);
-        if (hitSeedsMade < maxHitSeeds__ && numSeedsMade < maxSeeds_){
-            // Run2 approach, preserved for backward compatibility
-            if (!(dontCreateHitbasedInBarrelAsInRun2__ && (absL2muonEta <= 1.0)))
-              makeSeedsFromHits(**it,
-                            tsosAtIP,
-                            *(propagatorAlong.get()),
-                            estimatorH,
-                            measurementTrackerH,
-                            errorSFHits,
-                            hitSeedsMade,
-                            numSeedsMade,
-                            layerCount,
-                            out);
-        }
-        if (hitDoubletSeedsMade < maxHitDoubletSeeds__ && numSeedsMade < maxSeeds_){
-            makeSeedsFromHitDoublets(**it,
-                            tsosAtIP,
-                            *(propagatorAlong.get()),
-                            estimatorH,
-                            measurementTrackerH,
-                            navSchool,
-                            errorSFHits,
-                            hitDoubletSeedsMade,
-                            numSeedsMade,
-                            layerCount,
-                            out);
-        }
-         // Run2 approach, preserved for backward compatibility
-        if (useBoth) {
-          if (useHitLessSeeds_ && hitlessSeedsMadeMuS < maxHitlessSeedsIP__ && numSeedsMade < maxSeeds_)
-            makeSeedsWithoutHits(**it,
-                                 outerTkStateOutside,
-                                 *(propagatorOpposite.get()),
-                                 estimatorH,
-                                 errorSFHitless,
-                                 hitlessSeedsMadeMuS,
-                                 numSeedsMade,
-                                 out);
-        }
-      }
-      LogTrace("TSGForOIFromL2") << "TSGForOIFromL2:::produce: NumSeedsMade = " << numSeedsMade
-                                 << " , layerCount = " << layerCount << std::endl;
+//
+// Compatible dets of a state on a layer, shared by the seed makers
+//
+const std::vector<GeometricSearchDet::DetWithState>& TSGForOIFromL2::LayerSearch::dets(double errorSF) {
+  // The same state with the same rescaling always gives the same dets
+  for (unsigned int i = 0; i != store_.size; ++i) {
+    if (store_.errorSF[i] == errorSF)
+      return store_.dets[i];
+  }
+  if (widestErrorSF_ <= 0. || errorSF >= widestErrorSF_)
+    return search(errorSF);
+
+  // The widest search, from the store or done now (not through dets(), which would come back here)
+  const std::vector<GeometricSearchDet::DetWithState>* widest = nullptr;
+  for (unsigned int i = 0; i != store_.size && widest == nullptr; ++i) {
+    if (store_.errorSF[i] == widestErrorSF_)
+      widest = &store_.dets[i];
+  }
+  if (widest == nullptr)
+    widest = &search(widestErrorSF_);
+  // A full store would give the filtered entry the place of the widest one
+  if (store_.size == TSGForOIDetSearchStore::kMaxEntries)
+    return search(errorSF);
+
+  // Keep the dets of the widest search which are compatible with the narrower error
+  std::vector<GeometricSearchDet::DetWithState>& filtered = newEntry(errorSF);
+  for (const auto& detWithState : *widest) {
+    TrajectoryStateOnSurface tsosOnDet(detWithState.second);
+    if (tsosOnDet.isValid()) {
+      tsosOnDet.rescaleError(errorSF / widestErrorSF_);
+      if (!estimator_.estimate(tsosOnDet, detWithState.first->surface()))
+        continue;
     }
+    filtered.emplace_back(detWithState.first, tsosOnDet);
+  }
 
-    // ENDCAP-
-    if (L2muonEta < -minEtaForTEC_) {
-      layerCount = 0;
-      for (auto it = tecNegative.rbegin(); it != tecNegative.rend(); ++it) {
-        LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::produce: looping in TEC- layer " << layerCount << std::endl;
-        if (useHitLessSeeds_ && hitlessSeedsMadeIP < maxHitlessSeedsIP__ && numSeedsMade < maxSeeds_)
-          makeSeedsWithoutHits(**it,
-                               tsosAtIP,
-                               *(propagatorAlong.get()),
-                               estimatorH,
-                               errorSFHitless,
-                               hitlessSeedsMadeIP,
-                               numSeedsMade,
-                               out);
-        if (outerTkStateInside.isValid() && outerTkStateOutside.isValid() &&
-            useHitLessSeeds_ && hitlessSeedsMadeMuS < maxHitlessSeedsMuS__ && numSeedsMade < maxSeeds_)
-            makeSeedsWithoutHits(**it,
-                                 outerTkStateOutside,
-                                 *(propagatorOpposite.get()),
-                                 estimatorH,
-                                 errorSFHitless,
-                                 hitlessSeedsMadeMuS,
-                                 numSeedsMade,
-                                 out);
+  // Validation: the exact search of the same rescaling, outside of the store and of the timing
+  if (store_.validate) {
+    store_.filtered = true;
+    TrajectoryStateOnSurface onLayer(tsos_);
+    onLayer.rescaleError(errorSF);
+    std::vector<GeometricSearchDet::DetWithState>& exact = store_.exact;
+    exact.clear();
+    layer_.compatibleDetsV(onLayer, propagator_, estimator_, exact);
+    auto sameDet = [](const GeometricSearchDet::DetWithState& a, const GeometricSearchDet::DetWithState& b) {
+      return a.first == b.first;
+    };
+    if (filtered.size() != exact.size() || (!exact.empty() && filtered.front().first != exact.front().first) ||
+        !std::is_permutation(filtered.begin(), filtered.end(), exact.begin(), sameDet))
+      store_.differs = true;
+  }
+  return filtered;
+}
 
-        if (hitSeedsMade < maxHitSeeds__ && numSeedsMade < maxSeeds_){
-            // Run2 approach, preserved for backward compatibility
-            if (!(dontCreateHitbasedInBarrelAsInRun2__ && (absL2muonEta <= 1.0)))
-              makeSeedsFromHits(**it,
-                            tsosAtIP,
-                            *(propagatorAlong.get()),
-                            estimatorH,
-                            measurementTrackerH,
-                            errorSFHits,
-                            hitSeedsMade,
-                            numSeedsMade,
-                            layerCount,
-                            out);
-        }
-        if (hitDoubletSeedsMade < maxHitDoubletSeeds__ && numSeedsMade < maxSeeds_){
-            makeSeedsFromHitDoublets(**it,
-                            tsosAtIP,
-                            *(propagatorAlong.get()),
-                            estimatorH,
-                            measurementTrackerH,
-                            navSchool,
-                            errorSFHits,
-                            hitDoubletSeedsMade,
-                            numSeedsMade,
-                            layerCount,
-                            out);
-        }
-        // Run2 approach, preserved for backward compatibility
-        if (useBoth) {
-          if (useHitLessSeeds_ && hitlessSeedsMadeMuS < maxHitlessSeedsIP__ && numSeedsMade < maxSeeds_)
-            makeSeedsWithoutHits(**it,
-                                 outerTkStateOutside,
-                                 *(propagatorOpposite.get()),
-                                 estimatorH,
-                                 errorSFHitless,
-                                 hitlessSeedsMadeMuS,
-                                 numSeedsMade,
-                                 out);
-        }
+const std::vector<GeometricSearchDet::DetWithState>& TSGForOIFromL2::LayerSearch::search(double errorSF) {
+  TrajectoryStateOnSurface onLayer(tsos_);
+  if (errorSF != 1.)
+    onLayer.rescaleError(errorSF);
+  std::vector<GeometricSearchDet::DetWithState>& result = newEntry(errorSF);
+  TSGFOROI_TIMER(timer, timing_.stages[TSGForOITiming::kCompatibleDets]);
+  layer_.compatibleDetsV(onLayer, propagator_, estimator_, result);
+  return result;
+}
+
+namespace {
+  // Whether a helix in a uniform field along z crosses a TOB cylinder or a TEC disk within its bounds
+  bool helixReachesLayer(const GeometricSearchDet& layer,
+                         const TrajectoryStateOnSurface& tsos,
+                         const Propagator& propagator,
+                         double tolerance) {
+    const BarrelDetLayer* barrel = dynamic_cast<const BarrelDetLayer*>(&layer);
+    const ForwardDetLayer* disk = dynamic_cast<const ForwardDetLayer*>(&layer);
+    if (!tsos.isValid() || (barrel == nullptr && disk == nullptr))
+      return true;
+
+    // Backward propagation is the forward one of the opposite charge and momentum
+    const GlobalPoint x0 = tsos.globalPosition();
+    const bool backward = propagator.propagationDirection() == oppositeToMomentum;
+    const GlobalVector p = backward ? -tsos.globalMomentum() : tsos.globalMomentum();
+    const double q = backward ? -tsos.charge() : tsos.charge();
+    const double bz = propagator.magneticField()->inTesla(x0).z();
+    const double pt = p.perp();
+    if (pt < 1e-3 || std::abs(bz) < 1e-3)
+      return true;
+
+    // Circle in the transverse plane: radius [cm], centre, and position angle turning by -sense per unit of path
+    const double rho = pt / (0.0029979246 * std::abs(bz));
+    const double sense = q * bz > 0. ? 1. : -1.;
+    const double cx = x0.x() + sense * rho * p.y() / pt;
+    const double cy = x0.y() - sense * rho * p.x() / pt;
+    const double alpha0 = std::atan2(x0.y() - cy, x0.x() - cx);
+    auto zAfter = [&](double phi) { return x0.z() + rho * phi * p.z() / pt; };
+
+    if (barrel != nullptr) {
+      const BoundCylinder& cylinder = barrel->specificSurface();
+      const double radius = cylinder.radius();
+      const double halfLength = 0.5 * cylinder.bounds().length();
+      const double zCentre = cylinder.position().z();
+      const double d = std::hypot(cx, cy);
+      if (d > rho + radius + tolerance || d < std::abs(rho - radius) - tolerance)
+        return false;
+      // Position angles of the two crossings, and the turning angle to them
+      const double cosine = std::max(-1., std::min(1., (radius * radius - d * d - rho * rho) / (2. * rho * d)));
+      const double beta = std::atan2(cy, cx);
+      for (double side : {-1., 1.}) {
+        double phi = std::fmod(sense * (alpha0 - beta - side * std::acos(cosine)), 2. * M_PI);
+        if (phi < 0.)
+          phi += 2. * M_PI;
+        if (std::abs(zAfter(phi) - zCentre) <= halfLength + tolerance)
+          return true;
       }
-      LogTrace("TSGForOIFromL2") << "TSGForOIFromL2:::produce: NumSeedsMade = " << numSeedsMade
-                                 << " , layerCount = " << layerCount << std::endl;
+      return false;
     }
 
-    for (std::vector<TrajectorySeed>::iterator it = out.begin(); it != out.end(); ++it) {
-      result->push_back(*it);
-    }
+    const BoundDisk& plane = disk->specificSurface();
+    const double dz = plane.position().z() - x0.z();
+    const double margin = tolerance + 0.5 * plane.bounds().thickness();
+    if (std::abs(dz) <= margin)
+      return true;
+    if (dz * p.z() <= 0.)
+      return false;
+    const double phi = dz * pt / (p.z() * rho);
+    const double alpha = alpha0 - sense * phi;
+    const double r = std::hypot(cx + rho * std::cos(alpha), cy + rho * std::sin(alpha));
+    return r >= plane.innerRadius() - margin && r <= plane.outerRadius() + margin;
+  }
+}  // namespace
 
-  }  // L2Collection
+bool TSGForOIFromL2::LayerSearch::reachable(double tolerance) {
+  if (reachable_ < 0)
+    reachable_ = helixReachesLayer(layer_, tsos_, propagator_, tolerance);
+  return reachable_ != 0;
+}
 
-  edm::LogInfo(theCategory_) << "TSGForOIFromL2::produce: number of seeds made: " << result->size();
+const std::vector<GeometricSearchDet::DetWithState>& TSGForOIFromL2::LayerSearch::hitDets(double errorSF) {
+  if (hitIndex_ == nullptr)
+    return dets(errorSF);
+  if (store_.hasIndexed && store_.indexedErrorSF == errorSF)
+    return store_.indexed;
+
+  const DetLayer* detLayer = dynamic_cast<const DetLayer*>(&layer_);
+  TrajectoryStateOnSurface onLayer(tsos_);
+  if (errorSF != 1.)
+    onLayer.rescaleError(errorSF);
+  store_.indexed.clear();
+  const bool indexed = detLayer != nullptr &&
+                       hitIndex_->compatibleDets(*detLayer, onLayer, propagator_, estimator_, store_.indexed, timing_);
+  // Layers beyond the indexed ones are searched as without index
+  if (!indexed)
+    return dets(errorSF);
+  store_.hasIndexed = true;
+  store_.indexedErrorSF = errorSF;
+  return store_.indexed;
+}
 
-  iEvent.put(std::move(result));
+std::vector<GeometricSearchDet::DetWithState>& TSGForOIFromL2::LayerSearch::newEntry(double errorSF) {
+  // There are at most three distinct rescalings per layer; should there be more, the last entry is reused
+  unsigned int i = std::min(store_.size, TSGForOIDetSearchStore::kMaxEntries - 1);
+  store_.size = i + 1;
+  store_.errorSF[i] = errorSF;
+  store_.dets[i].clear();
+  return store_.dets[i];
 }
 
 //
 // Create seeds without hits on a given layer (TOB or TEC)
 //
-void TSGForOIFromL2::makeSeedsWithoutHits(const GeometricSearchDet& layer,
-                                          const TrajectoryStateOnSurface& tsos,
-                                          const Propagator& propagatorAlong,
-                                          edm::ESHandle<Chi2MeasurementEstimatorBase>& estimator,
+void TSGForOIFromL2::makeSeedsWithoutHits(LayerSearch& search,
+                                          TSGForOIScratch& scratch,
                                           double errorSF,
                                           unsigned int& hitlessSeedsMade,
                                           unsigned int& numSeedsMade,
                                           std::vector<TrajectorySeed>& out) const {
+  // Seeds from the muon-system state are the ones propagated inwards
+  TSGFOROI_TIMER(timer,
+                 scratch.timing.seedMakers[scratch.region][search.propagator().propagationDirection() == alongMomentum
+                                                               ? TSGForOITiming::kHitlessIP
+                                                               : TSGForOITiming::kHitlessMuS],
+                 &hitlessSeedsMade);
+  // Layers out of reach of the state are not searched (with the validation, they are, to count the wrong rejections)
+  if (helixPrescreen_) {
+    ++scratch.helixPrescreenCounts[0];
+    if (!search.reachable(helixPrescreenTolerance_)) {
+      ++scratch.helixPrescreenCounts[1];
+      if (!validateHelixPrescreen_)
+        return;
+      if (!search.dets(1.).empty())
+        ++scratch.helixPrescreenCounts[2];
+    }
+  }
+
   // create hitless seeds
   LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsWithoutHits: Start hitless" << std::endl;
-  std::vector<GeometricSearchDet::DetWithState> dets;
-  layer.compatibleDetsV(tsos, propagatorAlong, *estimator, dets);
+  // The search is done with the unscaled state, the error is rescaled on the layer
+  const std::vector<GeometricSearchDet::DetWithState>& dets = search.dets(1.);
   if (!dets.empty()) {
     auto const& detOnLayer = dets.front().first;
-    auto const& tsosOnLayer = dets.front().second;
+    TrajectoryStateOnSurface tsosOnLayer = dets.front().second;
     LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsWithoutHits: tsosOnLayer " << tsosOnLayer << std::endl;
     if (!tsosOnLayer.isValid()) {
       edm::LogInfo(theCategory_) << "ERROR!: Hitless TSOS is not valid!";
     } else {
-      dets.front().second.rescaleError(errorSF);
+      tsosOnLayer.rescaleError(errorSF);
       PTrajectoryStateOnDet const& ptsod =
           trajectoryStateTransform::persistentState(tsosOnLayer, detOnLayer->geographicalId().rawId());
-      TrajectorySeed::RecHitContainer rHC;
-      out.push_back(TrajectorySeed(ptsod, rHC, oppositeToMomentum));
+      out.emplace_back(ptsod, TrajectorySeed::RecHitContainer(), oppositeToMomentum);
+      // No measurement: ranked after the hit-based seeds
+      scratch.seedChi2.push_back(std::numeric_limits<float>::max());
       LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsWithoutHits: TSOS (Hitless) done " << std::endl;
       hitlessSeedsMade++;
       numSeedsMade++;
@@ -525,11 +1044,9 @@ void TSGForOIFromL2::makeSeedsWithoutHits(const GeometricSearchDet& layer,
 //
 // Find hits on a given layer (TOB or TEC) and create seeds from updated TSOS with hit
 //
-void TSGForOIFromL2::makeSeedsFromHits(const GeometricSearchDet& layer,
-                                       const TrajectoryStateOnSurface& tsos,
-                                       const Propagator& propagatorAlong,
-                                       edm::ESHandle<Chi2MeasurementEstimatorBase>& estimator,
-                                       edm::Handle<MeasurementTrackerEvent>& measurementTracker,
+void TSGForOIFromL2::makeSeedsFromHits(LayerSearch& search,
+                                       const MeasurementTrackerEvent& measurementTracker,
+                                       TSGForOIScratch& scratch,
                                        double errorSF,
                                        unsigned int& hitSeedsMade,
                                        unsigned int& numSeedsMade,
@@ -537,33 +1054,23 @@ void TSGForOIFromL2::makeSeedsFromHits(const GeometricSearchDet& layer,
                                        std::vector<TrajectorySeed>& out) const {
   if (layerCount > numOfLayersToTry_)
     return;
+  TSGFOROI_TIMER(timer, scratch.timing.seedMakers[scratch.region][TSGForOITiming::kHits], &hitSeedsMade);
+
+  const Propagator& propagatorAlong = search.propagator();
+  const Chi2MeasurementEstimatorBase& estimator = search.estimator();
 
   // Error Rescaling
-  TrajectoryStateOnSurface onLayer(tsos);
+  TrajectoryStateOnSurface onLayer(search.tsos());
   onLayer.rescaleError(errorSF);
 
-  std::vector<GeometricSearchDet::DetWithState> dets;
-  layer.compatibleDetsV(onLayer, propagatorAlong, *estimator, dets);
+  const std::vector<GeometricSearchDet::DetWithState>& dets = search.hitDets(errorSF);
 
   // Find Measurements on each DetWithState
   LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHits: Find measurements on each detWithState  "
                              << dets.size() << std::endl;
-  std::vector<TrajectoryMeasurement> meas;
-  for (std::vector<GeometricSearchDet::DetWithState>::iterator it = dets.begin(); it != dets.end(); ++it) {
-    MeasurementDetWithData det = measurementTracker->idToDet(it->first->geographicalId());
-    if (det.isNull())
-      continue;
-    if (!it->second.isValid())
-      continue;  // Skip if TSOS is not valid
-
-    std::vector<TrajectoryMeasurement> mymeas =
-        det.fastMeasurements(it->second, onLayer, propagatorAlong, *estimator);  // Second TSOS is not used
-    for (std::vector<TrajectoryMeasurement>::const_iterator it2 = mymeas.begin(), ed2 = mymeas.end(); it2 != ed2;
-         ++it2) {
-      if (it2->recHit()->isValid())
-        meas.push_back(*it2);  // Only save those which are valid
-    }
-  }
+  std::vector<TrajectoryMeasurement>& meas = scratch.meas;
+  meas.clear();
+  findMeasurements(dets, onLayer, propagatorAlong, estimator, measurementTracker, scratch, meas);
 
   // Update TSOS using TMs after sorting, then create Trajectory Seed and put into vector
   LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHits: Update TSOS using TMs after sorting, then create "
@@ -573,7 +1080,7 @@ void TSGForOIFromL2::makeSeedsFromHits(const GeometricSearchDet& layer,
 
   unsigned int found = 0;
   for (std::vector<TrajectoryMeasurement>::const_iterator it = meas.begin(); it != meas.end(); ++it) {
-    TrajectoryStateOnSurface updatedTSOS = updator_->update(it->forwardPredictedState(), *it->recHit());
+    TrajectoryStateOnSurface updatedTSOS = update(it->forwardPredictedState(), *it->recHit(), scratch);
     LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHits: TSOS for TM " << found << std::endl;
     if (not updatedTSOS.isValid())
       continue;
@@ -584,8 +1091,8 @@ void TSGForOIFromL2::makeSeedsFromHits(const GeometricSearchDet& layer,
         trajectoryStateTransform::persistentState(updatedTSOS, it->recHit()->geographicalId().rawId());
     LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHits: Number of seedHits: " << seedHits.size()
                                << std::endl;
-    TrajectorySeed seed(pstate, std::move(seedHits), oppositeToMomentum);
-    out.push_back(seed);
+    out.emplace_back(pstate, std::move(seedHits), oppositeToMomentum);
+    scratch.seedChi2.push_back(it->estimate());
     found++;
     numSeedsMade++;
     hitSeedsMade++;
@@ -600,222 +1107,575 @@ void TSGForOIFromL2::makeSeedsFromHits(const GeometricSearchDet& layer,
 }
 
 
-
-void TSGForOIFromL2::makeSeedsFromHitDoublets(const GeometricSearchDet& layer,
-                                       const TrajectoryStateOnSurface& tsos,
-                                       const Propagator& propagatorAlong,
-                                       edm::ESHandle<Chi2MeasurementEstimatorBase>& estimator,
-                                       edm::Handle<MeasurementTrackerEvent>& measurementTracker,
-                                       edm::ESHandle<NavigationSchool> navSchool,
-                                       double errorSF,
-                                       unsigned int& hitDoubletSeedsMade,
-                                       unsigned int& numSeedsMade,
-                                       unsigned int& layerCount,
-                                       std::vector<TrajectorySeed>& out) const {
-
+//
+// Find hits on a given layer and on the next ones, and create seeds from the best multiplets
+//
+void TSGForOIFromL2::makeSeedsFromHitDoublets(LayerSearch& search,
+                                              const MeasurementTrackerEvent& measurementTracker,
+                                              const NavigationSchool& navSchool,
+                                              TSGForOIScratch& scratch,
+                                              double errorSF,
+                                              unsigned int& hitDoubletSeedsMade,
+                                              unsigned int& numSeedsMade,
+                                              unsigned int& layerCount,
+                                              std::vector<TrajectorySeed>& out) const {
   // This method is similar to makeSeedsFromHits, but the seed is created
   // only when in addition to a hit on a given layer, there are more compatible hits
   // on next layers (going from outside inwards), compatible with updated TSOS.
   // If that's the case, multiple compatible hits are used to create a single seed.
+  // For each hit on this layer, a beam search adds one hit per next layer, hitMultipletDepth_ times:
+  // each candidate branches into its hitMultipletBranching_ best hits on the adjacent layer, and only the
+  // hitMultipletBeamWidth_ candidates with the lowest chi2 are kept. The defaults (1, 1, 1) make doublets
+  // from the first compatible hit on the adjacent layer.
+  TSGFOROI_TIMER(timer, scratch.timing.seedMakers[scratch.region][TSGForOITiming::kHitDoublets], &hitDoubletSeedsMade);
 
-  // Configured to only check the immideately adjacent layer and add one more hit
-  int max_addtnl_layers = 1; // max number of additional layers to scan
-  int max_meas = 1; // number of measurements to consider on each additional layer
+  const GeometricSearchDet& layer = search.layer();
+  const Propagator& propagatorAlong = search.propagator();
+  const Chi2MeasurementEstimatorBase& estimator = search.estimator();
 
-  // // // First, regular procedure to find a compatible hit - like in makeSeedsFromHits // // //
-  
   // Error Rescaling
-  TrajectoryStateOnSurface onLayer(tsos);
+  TrajectoryStateOnSurface onLayer(search.tsos());
   onLayer.rescaleError(errorSF);
 
   // Find dets compatible with original TSOS
-  std::vector< GeometricSearchDet::DetWithState > dets;
-  layer.compatibleDetsV(onLayer, propagatorAlong, *estimator, dets);
-
-  LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: Find measurements on each detWithState  " << dets.size() << std::endl;
-  std::vector<TrajectoryMeasurement> meas;
-    
-  // Loop over dets
-  for (std::vector<GeometricSearchDet::DetWithState>::iterator idet=dets.begin(); idet!=dets.end(); ++idet) {
-    MeasurementDetWithData det = measurementTracker->idToDet(idet->first->geographicalId());
-
-    if (det.isNull()) continue;    // skip if det does not exist
-    if (!idet->second.isValid()) continue;    // skip if TSOS is invalid
-
-    // Find measurements on this det
-    std::vector <TrajectoryMeasurement> mymeas = det.fastMeasurements(idet->second, onLayer, propagatorAlong, *estimator);
-    
-    // Save valid measurements 
-    for (std::vector<TrajectoryMeasurement>::const_iterator imea = mymeas.begin(), ed2 = mymeas.end(); imea != ed2; ++imea) {
-      if (imea->recHit()->isValid()) meas.push_back(*imea);
-    } // end loop over meas
-  } // end loop over dets
-
-  LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: Update TSOS using TMs after sorting, then create Trajectory Seed, number of TM = " << meas.size() << std::endl;
-  
+  const std::vector<GeometricSearchDet::DetWithState>& dets = search.hitDets(errorSF);
+
+  LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: Find measurements on each detWithState  "
+                             << dets.size() << std::endl;
+  std::vector<TrajectoryMeasurement>& meas = scratch.meas;
+  meas.clear();
+  findMeasurements(dets, onLayer, propagatorAlong, estimator, measurementTracker, scratch, meas);
+
+  LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: Update TSOS using TMs after sorting, then "
+                                "create Trajectory Seed, number of TM = "
+                             << meas.size() << std::endl;
+
   // sort valid measurements found on the first layer
   std::sort(meas.begin(), meas.end(), TrajMeasLessEstim());
 
+  const DetLayer* detLayer = dynamic_cast<const DetLayer*>(&layer);
+  std::vector<TSGForOIHitCandidate>& candidates = scratch.candidates;
   unsigned int found = 0;
-  int hit_num = 0;
-  
+
   // Loop over all valid measurements compatible with original TSOS
-  for (std::vector<TrajectoryMeasurement>::const_iterator mea=meas.begin(); mea!=meas.end(); ++mea) {
-    hit_num++;
-    
+  for (std::vector<TrajectoryMeasurement>::const_iterator mea = meas.begin(); mea != meas.end(); ++mea) {
     // Update TSOS with measurement on first considered layer
-    TrajectoryStateOnSurface updatedTSOS = updator_->update(mea->forwardPredictedState(), *mea->recHit());
+    TrajectoryStateOnSurface updatedTSOS = update(mea->forwardPredictedState(), *mea->recHit(), scratch);
 
     LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: TSOS for TM " << found << std::endl;
-    if (not updatedTSOS.isValid()) continue;    // Skip if updated TSOS is invalid
+    if (not updatedTSOS.isValid())
+      continue;  // Skip if updated TSOS is invalid
+
+    candidates.clear();
+    scratch.hitNodes.clear();
+    scratch.hitNodes.push_back(TSGForOIHitNode{mea->recHit(), -1});
+    candidates.push_back(TSGForOIHitCandidate{updatedTSOS, detLayer, float(mea->estimate()), 0});
+    for (unsigned int step = 0; step != hitMultipletDepth_ && !candidates.empty(); ++step)
+      extendHitCandidates(
+          measurementTracker, navSchool, search.hitIndex(), propagatorAlong, estimator, errorSF, scratch);
+
+    // only consider the hit if there were compatible hits on all the additional scanned layers
+    if (candidates.empty())
+      continue;
 
+    // Create a seed from the best multiplet, whose hits are collected from the last one back
+    const TSGForOIHitCandidate& best = candidates.front();
+    std::vector<const TrackingRecHit*>& multipletHits = scratch.multipletHits;
+    multipletHits.clear();
+    for (int node = best.hit; node >= 0; node = scratch.hitNodes[node].parent)
+      multipletHits.push_back(scratch.hitNodes[node].hit->hit());
     edm::OwnVector<TrackingRecHit> seedHits;
-      
-    // Save hit on first layer
-    seedHits.push_back(*mea->recHit()->hit());
-    const DetLayer* detLayer = dynamic_cast<const DetLayer*>(&layer);
-
-
-    // // // Now for this measurement we will loop over additional layers and try to update the TSOS again // // //
+    for (auto hit = multipletHits.rbegin(); hit != multipletHits.rend(); ++hit)
+      seedHits.push_back(**hit);
+    PTrajectoryStateOnDet const& pstate =
+        trajectoryStateTransform::persistentState(best.state, multipletHits.front()->geographicalId().rawId());
+    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: Number of seedHits: " << seedHits.size()
+                               << std::endl;
+    out.emplace_back(pstate, std::move(seedHits), oppositeToMomentum);
+    scratch.seedChi2.push_back(best.chi2);
 
-    // find layers compatible with updated TSOS
-    auto const& compLayers = (*navSchool).nextLayers(*detLayer, *updatedTSOS.freeState(), alongMomentum);
+    found++;
+    numSeedsMade++;
+    hitDoubletSeedsMade++;
 
-    int addtnl_layers_scanned=0;
-    int found_compatible_on_next_layer = 0;
-    int det_id = 0;
-      
-    // Copy updated TSOS - we will update it again with a measurement from the next layer, if we find it
-    TrajectoryStateOnSurface updatedTSOS_next(updatedTSOS);
+    if (found == numOfHitsToTry_)
+      break;  // break if enough measurements scanned
+    if (hitDoubletSeedsMade > maxHitDoubletSeeds_)
+      return;  // abort if enough seeds created
+  }
 
-    // loop over layers compatible with updated TSOS
-    for (auto compLayer : compLayers) {
-      int nmeas=0;
+  if (found)
+    layerCount++;
+}
 
-      if (addtnl_layers_scanned>=max_addtnl_layers) break;    // break if we already looped over enough layers
-      if (found_compatible_on_next_layer>0) break;    // break if we already found additional hit
+//
+// Add one hit on the adjacent layer to each multiplet candidate, and keep the best ones
+//
+void TSGForOIFromL2::extendHitCandidates(const MeasurementTrackerEvent& measurementTracker,
+                                         const NavigationSchool& navSchool,
+                                         const TSGForOIHitIndex* hitIndex,
+                                         const Propagator& propagatorAlong,
+                                         const Chi2MeasurementEstimatorBase& estimator,
+                                         double errorSF,
+                                         TSGForOIScratch& scratch) const {
+  std::vector<TSGForOIHitCandidate>& extended = scratch.nextCandidates;
+  extended.clear();
+  for (const TSGForOIHitCandidate& candidate : scratch.candidates) {
+    // find layers compatible with updated TSOS, only the adjacent one is scanned
+    auto const& compLayers = navSchool.nextLayers(*candidate.layer, *candidate.state.freeState(), alongMomentum);
+    if (compLayers.empty())
+      continue;
+    const DetLayer* compLayer = compLayers.front();
+
+    // find dets compatible with updated TSOS
+    std::vector<GeometricSearchDet::DetWithState>& dets_next = scratch.detsNext;
+    dets_next.clear();
+    TrajectoryStateOnSurface onLayer_next(candidate.state);
+    onLayer_next.rescaleError(errorSF);
+    const bool indexed =
+        hitIndex != nullptr &&
+        hitIndex->compatibleDets(*compLayer, onLayer_next, propagatorAlong, estimator, dets_next, scratch.timing);
+    if (!indexed) {
+      TSGFOROI_TIMER(compatibleDetsTimer, scratch.timing.stages[TSGForOITiming::kCompatibleDets]);
+      compLayer->compatibleDetsV(onLayer_next, propagatorAlong, estimator, dets_next);
+    }
 
-      // find dets compatible with updated TSOS
-      std::vector< GeometricSearchDet::DetWithState > dets_next;
-      TrajectoryStateOnSurface onLayer_next(updatedTSOS);
-      onLayer_next.rescaleError(errorSF);//errorSF
-      compLayer->compatibleDetsV(onLayer_next, propagatorAlong, *estimator, dets_next);
+    // find measurements on dets_next and save the valid ones
+    std::vector<TrajectoryMeasurement>& meas_next = scratch.measNext;
+    meas_next.clear();
+    findMeasurements(dets_next, onLayer_next, propagatorAlong, estimator, measurementTracker, scratch, meas_next);
+    std::sort(meas_next.begin(), meas_next.end(), TrajMeasLessEstim());
+
+    // branch into the best measurements which give a valid updated TSOS
+    unsigned int nmeas = 0;
+    for (std::vector<TrajectoryMeasurement>::const_iterator mea_next = meas_next.begin();
+         mea_next != meas_next.end() && nmeas < hitMultipletBranching_;
+         ++mea_next) {
+      TrajectoryStateOnSurface updatedTSOS_next =
+          update(mea_next->forwardPredictedState(), *mea_next->recHit(), scratch);
+      if (not updatedTSOS_next.isValid())
+        continue;  // skip if TSOS updated with additional hit is not valid
+      scratch.hitNodes.push_back(TSGForOIHitNode{mea_next->recHit(), candidate.hit});
+      extended.push_back(TSGForOIHitCandidate{updatedTSOS_next,
+                                              compLayer,
+                                              candidate.chi2 + float(mea_next->estimate()),
+                                              int(scratch.hitNodes.size()) - 1});
+      nmeas++;
+    }
+  }
 
-      //if (!detWithState.size()) continue;
-      std::vector<TrajectoryMeasurement> meas_next;
-      
-      // find measurements on dets_next and save the valid ones
-      for (std::vector<GeometricSearchDet::DetWithState>::iterator idet_next=dets_next.begin(); idet_next!=dets_next.end(); ++idet_next) {
-        MeasurementDetWithData det = measurementTracker->idToDet(idet_next->first->geographicalId());
+  // keep the best candidates, ties in the order they were found
+  std::stable_sort(extended.begin(), extended.end(), [](const TSGForOIHitCandidate& a, const TSGForOIHitCandidate& b) {
+    return a.chi2 < b.chi2;
+  });
+  if (extended.size() > hitMultipletBeamWidth_)
+    extended.erase(extended.begin() + hitMultipletBeamWidth_, extended.end());
+  std::swap(scratch.candidates, extended);
+}
 
-        if (det.isNull()) continue;    // skip if det does not exist
-        if (!idet_next->second.isValid()) continue;    // skip if TSOS is invalid
+//
+// Valid measurements on compatible dets, with the measurement dets looked up once per event
+//
+void TSGForOIFromL2::findMeasurements(const std::vector<GeometricSearchDet::DetWithState>& dets,
+                                      const TrajectoryStateOnSurface& onLayer,
+                                      const Propagator& propagatorAlong,
+                                      const Chi2MeasurementEstimatorBase& estimator,
+                                      const MeasurementTrackerEvent& measurementTracker,
+                                      TSGForOIScratch& scratch,
+                                      std::vector<TrajectoryMeasurement>& meas) const {
+  for (std::vector<GeometricSearchDet::DetWithState>::const_iterator idet = dets.begin(); idet != dets.end(); ++idet) {
+    if (!idet->second.isValid())
+      continue;  // skip if TSOS is invalid
+    auto cached = scratch.measurementDets.find(idet->first);
+    if (cached == scratch.measurementDets.end())
+      cached = scratch.measurementDets.emplace(idet->first, measurementTracker.idToDet(idet->first->geographicalId()))
+                   .first;
+    const MeasurementDetWithData& det = cached->second;
+    if (det.isNull())
+      continue;  // skip if det does not exist
 
-        // Find measurements on this det
-        std::vector <TrajectoryMeasurement>mymeas_next=det.fastMeasurements(idet_next->second, onLayer_next, propagatorAlong, *estimator);
+    // Find measurements on this det (the second TSOS is not used)
+    TSGFOROI_TIMER(fastMeasurementsTimer, scratch.timing.stages[TSGForOITiming::kFastMeasurements]);
+    std::vector<TrajectoryMeasurement> mymeas = det.fastMeasurements(idet->second, onLayer, propagatorAlong, estimator);
 
-        for (std::vector<TrajectoryMeasurement>::const_iterator imea_next=mymeas_next.begin(), ed2=mymeas_next.end(); imea_next != ed2; ++imea_next) {
-            
-          // save valid measurements
-          if (imea_next->recHit()->isValid()) meas_next.push_back(*imea_next);
+    // Save valid measurements
+    for (std::vector<TrajectoryMeasurement>::iterator imea = mymeas.begin(), ed2 = mymeas.end(); imea != ed2; ++imea) {
+      if (imea->recHit()->isValid())
+        meas.push_back(std::move(*imea));
+    }
+  }
+}
 
-        }    // end loop over mymeas_next
-      }    // end loop over dets_next
+namespace {
+  // Curvilinear q/p, lambda and phi of a state
+  std::array<double, 3> curvilinearParameters(const FreeTrajectoryState& fts) {
+    return {{fts.signedInverseMomentum(), M_PI_2 - fts.momentum().theta(), fts.momentum().phi()}};
+  }
 
-      // sort valid measurements found on this layer
-      std::sort(meas_next.begin(), meas_next.end(), TrajMeasLessEstim());
-        
-      // loop over valid measurements compatible with updated TSOS (TSOS updated with a hit on the first layer)
-      for (std::vector<TrajectoryMeasurement>::const_iterator mea_next=meas_next.begin(); mea_next!=meas_next.end(); ++mea_next) {
+  // Differences of the curvilinear q/p, lambda and phi of two states
+  std::array<double, 3> curvilinearDifference(const FreeTrajectoryState& fts1, const FreeTrajectoryState& fts2) {
+    const std::array<double, 3> p1 = curvilinearParameters(fts1);
+    const std::array<double, 3> p2 = curvilinearParameters(fts2);
+    return {{p1[0] - p2[0], p1[1] - p2[1], reco::deltaPhi(p1[2], p2[2])}};
+  }
+}  // namespace
 
-        if (nmeas>=max_meas) break;    // skip if we already found enough hits
-        
-        // try to update TSOS again, with an additional hit
-        updatedTSOS_next = updator_->update(mea_next->forwardPredictedState(), *mea_next->recHit());
-        
-        if (not updatedTSOS_next.isValid()) continue;    // skip if TSOS updated with additional hit is not valid
+//
+// Cluster the L2's compatible in q/p, lambda and phi at the IP
+//
+void TSGForOIFromL2::clusterL2s(const reco::TrackCollection& l2s,
+                                const std::vector<TrajectoryStateOnSurface>& tsosAtIPs,
+                                std::vector<int>& l2Clusters) const {
+  // The L2's with most hits become the representatives
+  std::vector<unsigned int> order(l2s.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&l2s](unsigned int a, unsigned int b) {
+    return l2s[a].found() > l2s[b].found();
+  });
+
+  std::vector<unsigned int> representatives;
+  for (unsigned int l2TrackColIndex : order) {
+    l2Clusters[l2TrackColIndex] = l2TrackColIndex;
+    if (!tsosAtIPs[l2TrackColIndex].isValid())
+      continue;
+    const FreeTrajectoryState& fts = *tsosAtIPs[l2TrackColIndex].freeState();
+    for (unsigned int rep : representatives) {
+      const FreeTrajectoryState& ftsRep = *tsosAtIPs[rep].freeState();
+      // Diagonal chi2, the correlations of the two L2's are unknown
+      const std::array<double, 3> diff = curvilinearDifference(fts, ftsRep);
+      double chi2 = 0.;
+      for (unsigned int i = 0; i != 3; ++i)
+        chi2 += diff[i] * diff[i] /
+                (fts.curvilinearError().matrix()(i, i) + ftsRep.curvilinearError().matrix()(i, i));
+      if (chi2 < mergeL2Chi2_) {
+        l2Clusters[l2TrackColIndex] = rep;
+        break;
+      }
+    }
+    if (l2Clusters[l2TrackColIndex] == int(l2TrackColIndex))
+      representatives.push_back(l2TrackColIndex);
+  }
+}
 
-        // If there was a compatible hit on this layer, we end up here.
-        // An additional compatible hit is saved.
-        seedHits.push_back(*mea_next->recHit()->hit());
-        det_id = mea_next->recHit()->geographicalId().rawId();
-        nmeas++;
-        found_compatible_on_next_layer++;
+//
+// Match the L2's to the inside-out L3 muons
+//
+void TSGForOIFromL2::matchIOL3Muons(const edm::Event& iEvent,
+                                    const edm::Handle<reco::TrackCollection>& l2TrackCol,
+                                    std::vector<L2Seeding>& l2Seeding) const {
+  const reco::TrackCollection& l2s = *l2TrackCol;
+  const double maxDeltaR2 = ioMatchDeltaR_ * ioMatchDeltaR_;
+  auto match = [&](const reco::Track& l3) {
+    for (unsigned int l2TrackColIndex(0); l2TrackColIndex != l2s.size(); ++l2TrackColIndex) {
+      const reco::Track& l2 = l2s[l2TrackColIndex];
+      if (reco::deltaR2(l2, l3) < maxDeltaR2 && std::abs(l2.pt() - l3.pt()) < ioMatchRelDeltaPt_ * l3.pt())
+        l2Seeding[l2TrackColIndex] = ioMatchedL2Seeding_;
+    }
+  };
 
-      } // end loop over meas_next
+  if (!ioL3TracksToken_.isUninitialized()) {
+    edm::Handle<reco::TrackCollection> l3TrackCol;
+    iEvent.getByToken(ioL3TracksToken_, l3TrackCol);
+    for (const reco::Track& l3 : *l3TrackCol)
+      match(l3);
+  }
+  if (!ioL3MuonTrackLinksToken_.isUninitialized()) {
+    edm::Handle<reco::MuonTrackLinksCollection> links;
+    iEvent.getByToken(ioL3MuonTrackLinksToken_, links);
+    for (const reco::MuonTrackLinks& link : *links) {
+      if (link.trackerTrack().isNull())
+        continue;
+      // Links made from this L2 collection need no kinematic matching
+      if (link.standAloneTrack().id() == l2TrackCol.id())
+        l2Seeding[link.standAloneTrack().key()] = ioMatchedL2Seeding_;
+      else
+        match(*link.trackerTrack());
+    }
+  }
 
-    addtnl_layers_scanned++;    
+  unsigned int nMatched = 0;
+  for (L2Seeding seeding : l2Seeding)
+    nMatched += (seeding != L2Seeding::Full);
+  ioCheckedL2s_ += l2s.size();
+  ioMatchedL2s_ += nMatched;
+  LogTrace(theCategory_) << "TSGForOIFromL2::matchIOL3Muons: " << nMatched << " of " << l2s.size()
+                         << " L2's matched to inside-out L3 muons";
+}
 
-    } // end loop over compLayers (additional layers scanned after the original layer)
+//
+// Widen the state of each representative to cover the search windows of its cluster
+//
+void TSGForOIFromL2::widenClusterStates(const std::vector<int>& l2Clusters,
+                                        std::vector<TrajectoryStateOnSurface>& tsosAtIPs) const {
+  for (unsigned int l2TrackColIndex = 0; l2TrackColIndex != l2Clusters.size(); ++l2TrackColIndex) {
+    const int rep = l2Clusters[l2TrackColIndex];
+    if (rep == int(l2TrackColIndex))
+      continue;
+    const FreeTrajectoryState& ftsRep = *tsosAtIPs[rep].freeState();
+    const FreeTrajectoryState& fts = *tsosAtIPs[l2TrackColIndex].freeState();
+    // Each q/p, lambda and phi error of the representative reaches the far edge of the member's window;
+    // only diagonal terms are increased, so that the covariance stays positive definite
+    AlgebraicSymMatrix55 matrix = ftsRep.curvilinearError().matrix();
+    const std::array<double, 3> diff = curvilinearDifference(fts, ftsRep);
+    bool widened = false;
+    for (unsigned int i = 0; i != 3; ++i) {
+      const double reach = std::abs(diff[i]) + std::sqrt(fts.curvilinearError().matrix()(i, i));
+      if (reach * reach > matrix(i, i)) {
+        matrix(i, i) = reach * reach;
+        widened = true;
+      }
+    }
+    if (widened)
+      tsosAtIPs[rep] = TrajectoryStateOnSurface(
+          FreeTrajectoryState(ftsRep.parameters(), CurvilinearTrajectoryError(matrix)), tsosAtIPs[rep].surface());
+  }
+}
 
-    if (found_compatible_on_next_layer==0) continue;
-    // only consider the hit if there was a compatible hit on one of the additional scanned layers
+namespace {
+  // Remove the seeds not kept, in their original order, together with their chi2 and L2 offsets
+  void compactSeeds(const std::vector<bool>& keep,
+                    std::vector<TrajectorySeed>& seeds,
+                    std::vector<float>* seedChi2,
+                    std::vector<unsigned int>* l2SeedOffsets) {
+    unsigned int nOut = 0;
+    unsigned int iL2 = 0;
+    for (unsigned int iSeed = 0; iSeed != seeds.size(); ++iSeed) {
+      if (l2SeedOffsets) {
+        // Offsets of the L2's starting at this seed now point to the next kept one
+        while (iL2 != l2SeedOffsets->size() && (*l2SeedOffsets)[iL2] == iSeed)
+          (*l2SeedOffsets)[iL2++] = nOut;
+      }
+      if (!keep[iSeed])
+        continue;
+      if (nOut != iSeed) {
+        seeds[nOut] = std::move(seeds[iSeed]);
+        if (seedChi2)
+          (*seedChi2)[nOut] = (*seedChi2)[iSeed];
+      }
+      ++nOut;
+    }
+    if (l2SeedOffsets) {
+      for (; iL2 != l2SeedOffsets->size(); ++iL2)
+        (*l2SeedOffsets)[iL2] = nOut;
+    }
+    seeds.erase(seeds.begin() + nOut, seeds.end());
+    if (seedChi2)
+      seedChi2->resize(nOut);
+  }
 
-    // Create a seed from two saved hits
-    PTrajectoryStateOnDet const& pstate = trajectoryStateTransform::persistentState(updatedTSOS_next, det_id);
-    TrajectorySeed seed(pstate, std::move(seedHits), oppositeToMomentum);
+  // Seeds made from the same hits (none for hitless seeds)
+  bool sameHits(const TrajectorySeed& seed1, const TrajectorySeed& seed2) {
+    if (seed1.nHits() != seed2.nHits())
+      return false;
+    auto hits1 = seed1.recHits();
+    auto hits2 = seed2.recHits();
+    for (auto hit1 = hits1.first, hit2 = hits2.first; hit1 != hits1.second; ++hit1, ++hit2) {
+      if (!hit1->sharesInput(&*hit2, TrackingRecHit::all))
+        return false;
+    }
+    return true;
+  }
+}  // namespace
 
-    LogTrace("TSGForOIFromL2") << "TSGForOIFromL2::makeSeedsFromHitDoublets: Number of seedHits: " << seedHits.size() << std::endl;
-    out.push_back(seed);
+//
+// Drop seeds which duplicate an earlier seed
+//
+void TSGForOIFromL2::removeDuplicateSeeds(const TSGForOIStreamCache& setup,
+                                          std::vector<unsigned int>& l2SeedOffsets,
+                                          std::vector<float>& seedChi2,
+                                          std::vector<TrajectorySeed>& seeds) const {
+  // Cells of seedDuplicateCellSize_ in the local position on each det; a duplicate may be in
+  // a neighbouring cell, so the 3x3 cells around a seed are searched
+  auto cellKey = [](uint32_t detId, int ix, int iy) {
+    return (uint64_t(detId) << 32) | (uint64_t(uint16_t(ix)) << 16) | uint64_t(uint16_t(iy));
+  };
+  std::unordered_map<uint64_t, std::vector<unsigned int> > cells;
+  std::vector<TrajectoryStateOnSurface> states(seeds.size());
+  auto state = [&](unsigned int iSeed) -> const TrajectoryStateOnSurface& {
+    if (!states[iSeed].isValid()) {
+      const PTrajectoryStateOnDet& pstate = seeds[iSeed].startingState();
+      const GeomDet* det = setup.geometry->idToDet(DetId(pstate.detId()));
+      states[iSeed] = trajectoryStateTransform::transientState(pstate, &det->surface(), setup.magfield);
+    }
+    return states[iSeed];
+  };
+
+  std::vector<bool> keep(seeds.size(), true);
+  unsigned int nDuplicates = 0;
+  for (unsigned int iSeed = 0; iSeed != seeds.size(); ++iSeed) {
+    const PTrajectoryStateOnDet& pstate = seeds[iSeed].startingState();
+    const LocalPoint position = pstate.parameters().position();
+    const int ix = std::floor(position.x() / seedDuplicateCellSize_);
+    const int iy = std::floor(position.y() / seedDuplicateCellSize_);
+
+    bool duplicate = false;
+    for (int dx = -1; dx <= 1 && !duplicate; ++dx) {
+      for (int dy = -1; dy <= 1 && !duplicate; ++dy) {
+        auto cell = cells.find(cellKey(pstate.detId(), ix + dx, iy + dy));
+        if (cell == cells.end())
+          continue;
+        for (unsigned int jSeed : cell->second) {
+          if (!sameHits(seeds[iSeed], seeds[jSeed]))
+            continue;
+          double chi2 = match_Chi2(state(iSeed), state(jSeed));
+          if (chi2 >= 0. && chi2 < seedDuplicateChi2_) {
+            duplicate = true;
+            break;
+          }
+        }
+      }
+    }
+    if (duplicate) {
+      keep[iSeed] = false;
+      ++nDuplicates;
+    } else
+      cells[cellKey(pstate.detId(), ix, iy)].push_back(iSeed);
+  }
 
-    found++;
-    numSeedsMade++;
-    hitDoubletSeedsMade++;
+  LogTrace(theCategory_) << "TSGForOIFromL2::removeDuplicateSeeds: " << nDuplicates << " duplicates of "
+                         << seeds.size() << " seeds";
+  if (nDuplicates)
+    compactSeeds(keep, seeds, &seedChi2, &l2SeedOffsets);
+}
 
-    if (found == numOfHitsToTry_) break;    // break if enough measurements scanned
-    if (hitDoubletSeedsMade > maxHitDoubletSeeds_) return;    // abort if enough seeds created
+//
+// Keep the seeds of the event within the seed budget
+//
+void TSGForOIFromL2::applySeedBudget(const reco::TrackCollection& l2s,
+                                     const std::vector<DnnStrategy>& dnnStrategies,
+                                     const std::vector<unsigned int>& l2SeedOffsets,
+                                     const std::vector<float>& seedChi2,
+                                     std::vector<TrajectorySeed>& seeds) const {
+  std::vector<bool> keep(seeds.size(), false);
+  std::vector<unsigned int> l2OfSeed(seeds.size());
+  std::vector<unsigned int> candidates;
+  unsigned int nKept = 0;
+  for (unsigned int l2TrackColIndex(0); l2TrackColIndex + 1 < l2SeedOffsets.size(); ++l2TrackColIndex) {
+    for (unsigned int iSeed = l2SeedOffsets[l2TrackColIndex]; iSeed != l2SeedOffsets[l2TrackColIndex + 1]; ++iSeed) {
+      l2OfSeed[iSeed] = l2TrackColIndex;
+      // The first seeds of an L2 are the ones of its outermost layers and best measurements
+      if (iSeed - l2SeedOffsets[l2TrackColIndex] < minSeedsPerL2_) {
+        keep[iSeed] = true;
+        ++nKept;
+      } else
+        candidates.push_back(iSeed);
+    }
+  }
 
-  } // end loop over measurements compatible with original TSOS
+  // Fill the rest of the budget in ranking order, ties in seed order
+  if (nKept < maxSeedsPerEvent_) {
+    auto rankedBefore = [&](unsigned int a, unsigned int b) {
+      switch (seedRanking_) {
+        case SeedRanking::L2Pt:
+          return l2s[l2OfSeed[a]].pt() > l2s[l2OfSeed[b]].pt();
+        case SeedRanking::DnnConfidence:
+          return dnnStrategies[l2OfSeed[a]].confidence > dnnStrategies[l2OfSeed[b]].confidence;
+        default:
+          return seedChi2[a] < seedChi2[b];
+      }
+    };
+    std::stable_sort(candidates.begin(), candidates.end(), rankedBefore);
+    const unsigned int nMore = std::min<unsigned int>(maxSeedsPerEvent_ - nKept, candidates.size());
+    for (unsigned int i = 0; i != nMore; ++i)
+      keep[candidates[i]] = true;
+  }
 
-  if (found)
-      layerCount++;
+  LogTrace(theCategory_) << "TSGForOIFromL2::applySeedBudget: kept " << std::count(keep.begin(), keep.end(), true)
+                         << " of " << seeds.size() << " seeds";
+  compactSeeds(keep, seeds, nullptr, nullptr);
+}
 
+//
+// Kalman update of a state with a hit
+//
+TrajectoryStateOnSurface TSGForOIFromL2::update(const TrajectoryStateOnSurface& tsos,
+                                                const TrackingRecHit& hit,
+                                                TSGForOIScratch& scratch) const {
+  TSGFOROI_TIMER(timer, scratch.timing.stages[TSGForOITiming::kUpdate]);
+  return updator_->update(tsos, hit);
 }
 
+//
+// Ranges and scale factors of the dynamic error rescaling, shared with TSGForOIDetIdsFromL2
+//
+TSGForOIFromL2::DynamicErrorSF::DynamicErrorSF(const edm::ParameterSet& iConfig)
+    : pT1(iConfig.getParameter<double>("pT1")),
+      pT2(iConfig.getParameter<double>("pT2")),
+      pT3(iConfig.getParameter<double>("pT3")),
+      eta1(iConfig.getParameter<double>("eta1")),
+      eta2(iConfig.getParameter<double>("eta2")),
+      eta3(iConfig.getParameter<double>("eta3")),
+      eta4(iConfig.getParameter<double>("eta4")),
+      eta5(iConfig.getParameter<double>("eta5")),
+      eta6(iConfig.getParameter<double>("eta6")),
+      SF1(iConfig.getParameter<double>("SF1")),
+      SF2(iConfig.getParameter<double>("SF2")),
+      SF3(iConfig.getParameter<double>("SF3")),
+      SF4(iConfig.getParameter<double>("SF4")),
+      SF5(iConfig.getParameter<double>("SF5")),
+      SF6(iConfig.getParameter<double>("SF6")) {}
+
+void TSGForOIFromL2::DynamicErrorSF::fillDescription(edm::ParameterSetDescription& desc) {
+  desc.add<double>("pT1", 13.0);
+  desc.add<double>("pT2", 30.0);
+  desc.add<double>("pT3", 70.0);
+  desc.add<double>("eta1", 0.2);
+  desc.add<double>("eta2", 0.3);
+  desc.add<double>("eta3", 1.0);
+  desc.add<double>("eta4", 1.2);
+  desc.add<double>("eta5", 1.6);
+  desc.add<double>("eta6", 1.4);
+  desc.add<double>("SF1", 3.0);
+  desc.add<double>("SF2", 4.0);
+  desc.add<double>("SF3", 5.0);
+  desc.add<double>("SF4", 7.0);
+  desc.add<double>("SF5", 10.0);
+  desc.add<double>("SF6", 2.0);
+}
 
 //
 // Calculate the dynamic error SF by analysing the L2
 //
-double TSGForOIFromL2::calculateSFFromL2(const reco::TrackRef track) const {
+double TSGForOIFromL2::calculateSFFromL2(const reco::Track& l2, const DynamicErrorSF& ranges) {
   double theSF = 1.0;
   // L2 direction vs pT blowup - as was previously done:
-  // Split into 4 pT ranges: <pT1_, pT1_<pT2_, pT2_<pT3_, <pT4_: 13,30,70
+  // Split into 4 pT ranges: <pT1, pT1<pT2, pT2<pT3, <pT4: 13,30,70
   // Split into different eta ranges depending in pT
-  double abseta = std::abs(track->eta());
-  if (track->pt() <= pT1_)
-    theSF = SF1_;
-  else if (track->pt() > pT1_ && track->pt() <= pT2_) {
-    if (abseta <= eta3_)
-      theSF = SF3_;
-    else if (abseta > eta3_ && abseta <= eta6_)
-      theSF = SF2_;
-    else if (abseta > eta6_)
-      theSF = SF3_;
-  } else if (track->pt() > pT2_ && track->pt() <= pT3_) {
-    if (abseta <= eta1_)
-      theSF = SF6_;
-    else if (abseta > eta1_ && abseta <= eta2_)
-      theSF = SF4_;
-    else if (abseta > eta2_ && abseta <= eta3_)
-      theSF = SF6_;
-    else if (abseta > eta3_ && abseta <= eta4_)
-      theSF = SF1_;
-    else if (abseta > eta4_ && abseta <= eta5_)
-      theSF = SF1_;
-    else if (abseta > eta5_)
-      theSF = SF5_;
-  } else if (track->pt() > pT3_) {
-    if (abseta <= eta3_)
-      theSF = SF5_;
-    else if (abseta > eta3_ && abseta <= eta4_)
-      theSF = SF4_;
-    else if (abseta > eta4_ && abseta <= eta5_)
-      theSF = SF4_;
-    else if (abseta > eta5_)
-      theSF = SF5_;
+  double abseta = std::abs(l2.eta());
+  if (l2.pt() <= ranges.pT1)
+    theSF = ranges.SF1;
+  else if (l2.pt() > ranges.pT1 && l2.pt() <= ranges.pT2) {
+    if (abseta <= ranges.eta3)
+      theSF = ranges.SF3;
+    else if (abseta > ranges.eta3 && abseta <= ranges.eta6)
+      theSF = ranges.SF2;
+    else if (abseta > ranges.eta6)
+      theSF = ranges.SF3;
+  } else if (l2.pt() > ranges.pT2 && l2.pt() <= ranges.pT3) {
+    if (abseta <= ranges.eta1)
+      theSF = ranges.SF6;
+    else if (abseta > ranges.eta1 && abseta <= ranges.eta2)
+      theSF = ranges.SF4;
+    else if (abseta > ranges.eta2 && abseta <= ranges.eta3)
+      theSF = ranges.SF6;
+    else if (abseta > ranges.eta3 && abseta <= ranges.eta4)
+      theSF = ranges.SF1;
+    else if (abseta > ranges.eta4 && abseta <= ranges.eta5)
+      theSF = ranges.SF1;
+    else if (abseta > ranges.eta5)
+      theSF = ranges.SF5;
+  } else if (l2.pt() > ranges.pT3) {
+    if (abseta <= ranges.eta3)
+      theSF = ranges.SF5;
+    else if (abseta > ranges.eta3 && abseta <= ranges.eta4)
+      theSF = ranges.SF4;
+    else if (abseta > ranges.eta4 && abseta <= ranges.eta5)
+      theSF = ranges.SF4;
+    else if (abseta > ranges.eta5)
+      theSF = ranges.SF5;
   }
 
-  LogTrace(theCategory_) << "TSGForOIFromL2::calculateSFFromL2: SF has been calculated as: " << theSF;
+  LogTrace("Muon|RecoMuon|TSGForOIFromL2") << "TSGForOIFromL2::calculateSFFromL2: SF has been calculated as: " << theSF;
 
   return theSF;
 }
@@ -843,136 +1703,221 @@ double TSGForOIFromL2::match_Chi2(const TrajectoryStateOnSurface& tsos1, const T
 }
 
 
-std::map<std::string, float> TSGForOIFromL2::getFeatureMap(
-    reco::TrackRef l2,
+std::vector<unsigned int> TSGForOIFromL2::dnnInputSlots(const OIStrategyModel& model) const {
+    std::vector<unsigned int> slots;
+    for (const std::string& fname : model.inputNames()){
+        auto feature = std::find(TSGForOIDnnFeatures::names.begin(), TSGForOIDnnFeatures::names.end(), fname);
+        if (feature == TSGForOIDnnFeatures::names.end())
+            throw cms::Exception("Configuration") << "TSGForOIFromL2: DNN input " << fname << " is not a known feature";
+        slots.push_back(feature - TSGForOIDnnFeatures::names.begin());
+    }
+    return slots;
+}
+
+
+void TSGForOIFromL2::getFeatures(
+    const reco::Track& l2,
     const TrajectoryStateOnSurface& tsos_IP,
-    const TrajectoryStateOnSurface& tsos_MuS
+    const TrajectoryStateOnSurface& tsos_MuS,
+    DnnFeatures& features
 ) const {
-    std::map<std::string, float> the_map;
-    the_map["pt"] = l2->pt();
-    the_map["eta"] = l2->eta();
-    the_map["phi"] = l2->phi();
-    the_map["validHits"] = l2->found();
+    features[TSGForOIDnnFeatures::kPt] = l2.pt();
+    features[TSGForOIDnnFeatures::kEta] = l2.eta();
+    features[TSGForOIDnnFeatures::kPhi] = l2.phi();
+    features[TSGForOIDnnFeatures::kValidHits] = l2.found();
     if (tsos_IP.isValid()) {
-        the_map["tsos_IP_eta"] = tsos_IP.globalPosition().eta();
-        the_map["tsos_IP_phi"] = tsos_IP.globalPosition().phi();
-        the_map["tsos_IP_pt"] = tsos_IP.globalMomentum().perp();
-        the_map["tsos_IP_pt_eta"] = tsos_IP.globalMomentum().eta();
-        the_map["tsos_IP_pt_phi"] = tsos_IP.globalMomentum().phi();
-        AlgebraicSymMatrix55 matrix_IP = tsos_IP.curvilinearError().matrix();
-        the_map["err0_IP"] = sqrt(matrix_IP[0][0]);
-        the_map["err1_IP"] = sqrt(matrix_IP[1][1]);
-        the_map["err2_IP"] = sqrt(matrix_IP[2][2]);
-        the_map["err3_IP"] = sqrt(matrix_IP[3][3]);
-        the_map["err4_IP"] = sqrt(matrix_IP[4][4]);
-        the_map["tsos_IP_valid"] = 1.0;
+        features[TSGForOIDnnFeatures::kIPEta] = tsos_IP.globalPosition().eta();
+        features[TSGForOIDnnFeatures::kIPPhi] = tsos_IP.globalPosition().phi();
+        features[TSGForOIDnnFeatures::kIPPt] = tsos_IP.globalMomentum().perp();
+        features[TSGForOIDnnFeatures::kIPPtEta] = tsos_IP.globalMomentum().eta();
+        features[TSGForOIDnnFeatures::kIPPtPhi] = tsos_IP.globalMomentum().phi();
+        const AlgebraicSymMatrix55& matrix_IP = tsos_IP.curvilinearError().matrix();
+        features[TSGForOIDnnFeatures::kIPErr0] = sqrt(matrix_IP[0][0]);
+        features[TSGForOIDnnFeatures::kIPErr1] = sqrt(matrix_IP[1][1]);
+        features[TSGForOIDnnFeatures::kIPErr2] = sqrt(matrix_IP[2][2]);
+        features[TSGForOIDnnFeatures::kIPErr3] = sqrt(matrix_IP[3][3]);
+        features[TSGForOIDnnFeatures::kIPErr4] = sqrt(matrix_IP[4][4]);
+        features[TSGForOIDnnFeatures::kIPValid] = 1.0;
     } else {
-        the_map["tsos_IP_eta"] = -999;
-        the_map["tsos_IP_phi"] = -999;
-        the_map["tsos_IP_pt"] = -999;
-        the_map["tsos_IP_pt_eta"] = -999;
-        the_map["tsos_IP_pt_phi"] = -999;
-        the_map["err0_IP"] = -999;
-        the_map["err1_IP"] = -999;
-        the_map["err2_IP"] = -999;
-        the_map["err3_IP"] = -999;
-        the_map["err4_IP"] = -999;
-        the_map["tsos_IP_valid"] = 0.0;
+        std::fill(features.begin() + TSGForOIDnnFeatures::kIPEta,
+                  features.begin() + TSGForOIDnnFeatures::kIPValid,
+                  -999);
+        features[TSGForOIDnnFeatures::kIPValid] = 0.0;
     }
     if (tsos_MuS.isValid()) {
-        the_map["tsos_MuS_eta"] = tsos_MuS.globalPosition().eta();
-        the_map["tsos_MuS_phi"] = tsos_MuS.globalPosition().phi();
-        the_map["tsos_MuS_pt"] = tsos_MuS.globalMomentum().perp();
-        the_map["tsos_MuS_pt_eta"] = tsos_MuS.globalMomentum().eta();
-        the_map["tsos_MuS_pt_phi"] = tsos_MuS.globalMomentum().phi();
-        AlgebraicSymMatrix55 matrix_MuS = tsos_MuS.curvilinearError().matrix();
-        the_map["err0_MuS"] = sqrt(matrix_MuS[0][0]);
-        the_map["err1_MuS"] = sqrt(matrix_MuS[1][1]);
-        the_map["err2_MuS"] = sqrt(matrix_MuS[2][2]);
-        the_map["err3_MuS"] = sqrt(matrix_MuS[3][3]);
-        the_map["err4_MuS"] = sqrt(matrix_MuS[4][4]);
-        the_map["tsos_MuS_valid"] = 1.0;
+        features[TSGForOIDnnFeatures::kMuSEta] = tsos_MuS.globalPosition().eta();
+        features[TSGForOIDnnFeatures::kMuSPhi] = tsos_MuS.globalPosition().phi();
+        features[TSGForOIDnnFeatures::kMuSPt] = tsos_MuS.globalMomentum().perp();
+        features[TSGForOIDnnFeatures::kMuSPtEta] = tsos_MuS.globalMomentum().eta();
+        features[TSGForOIDnnFeatures::kMuSPtPhi] = tsos_MuS.globalMomentum().phi();
+        const AlgebraicSymMatrix55& matrix_MuS = tsos_MuS.curvilinearError().matrix();
+        features[TSGForOIDnnFeatures::kMuSErr0] = sqrt(matrix_MuS[0][0]);
+        features[TSGForOIDnnFeatures::kMuSErr1] = sqrt(matrix_MuS[1][1]);
+        features[TSGForOIDnnFeatures::kMuSErr2] = sqrt(matrix_MuS[2][2]);
+        features[TSGForOIDnnFeatures::kMuSErr3] = sqrt(matrix_MuS[3][3]);
+        features[TSGForOIDnnFeatures::kMuSErr4] = sqrt(matrix_MuS[4][4]);
+        features[TSGForOIDnnFeatures::kMuSValid] = 1.0;
     } else {
-        the_map["tsos_MuS_eta"] = -999;
-        the_map["tsos_MuS_phi"] = -999;
-        the_map["tsos_MuS_pt"] = -999;
-        the_map["tsos_MuS_pt_eta"] = -999;
-        the_map["tsos_MuS_pt_phi"] = -999;
-        the_map["err0_MuS"] = -999;
-        the_map["err1_MuS"] = -999;
-        the_map["err2_MuS"] = -999;
-        the_map["err3_MuS"] = -999;
-        the_map["err4_MuS"] = -999;
-        the_map["tsos_MuS_valid"] = 0.0;
+        std::fill(features.begin() + TSGForOIDnnFeatures::kMuSEta,
+                  features.begin() + TSGForOIDnnFeatures::kMuSValid,
+                  -999);
+        features[TSGForOIDnnFeatures::kMuSValid] = 0.0;
     }
-    return the_map;
 }
 
 
-void TSGForOIFromL2::evaluateDnn(
-    std::map<std::string, float> feature_map,
-    tensorflow::Session* session,
-    TH1D * inpOrderHist,
-    TH1D * layerNamesHist,
-    TH2D * decoderHist,
-    int& nHB,
-    int& nHLIP,
-    int& nHLMuS,
-    bool& dnnSuccess
-) const {
-    int n_features = inpOrderHist->GetXaxis()->GetNbins();
-    
-    // Prepare tensor for DNN inputs
-    tensorflow::Tensor input(tensorflow::DT_FLOAT, { 1, n_features });
-    std::string fname;
-    for (int i=0; i<n_features; i++){
-        fname = inpOrderHist->GetXaxis()->GetBinLabel(i+1);
-        if (feature_map.find(fname) == feature_map.end()) {
-            std::cout << "Couldn't find " << fname << " in feature_map! Will not evaluate DNN." << std::endl;
-            return;
-        }
-        else {
-            input.matrix<float>()(0, i) = float(feature_map.at(fname));
-            //std::cout << "Input #" << i << ": " << fname << " = " << feature_map.at(fname) << std::endl;
+namespace {
+    // Index of the output with largest prediction
+    int dnnDecision(const float* outputs, int n_outputs) {
+        int imax = -1;
+        float out_max = 0;
+        for (int i = 0; i < n_outputs; i++) {
+            if (outputs[i] > out_max){
+                imax = i;
+                out_max = outputs[i];
+            }
         }
+        return imax;
     }
+}
 
-    // Prepare tensor for DNN outputs
-    std::vector<tensorflow::Tensor> outputs;
-
-    // Evaluate DNN and put results in output tensor
-    std::string inputLayer = layerNamesHist->GetXaxis()->GetBinLabel(1);
-    std::string outputLayer = layerNamesHist->GetXaxis()->GetBinLabel(2);
-    //std::cout << inputLayer << " " << outputLayer << std::endl;
-    tensorflow::run(session, { { inputLayer, input } }, { outputLayer }, &outputs);
-    tensorflow::Tensor out_tensor = outputs[0];
-    tensorflow::TTypes<float, 1>::Matrix dnn_outputs = out_tensor.matrix<float>();
-
-    // Find output with largest prediction
-    int imax = -1;
-    float out_max = 0;
-    for (long long int i = 0; i < out_tensor.dim_size(1); i++) {
-        float ith_output = dnn_outputs(0, i);
-        //std::cout << outputLayer << "#" <<  i << " = " << ith_output << std::endl;
-        if (ith_output > out_max){
-            imax = i;
-            out_max = ith_output;
+
+std::vector<float> TSGForOIFromL2::dnnInputs(
+    const std::vector<DnnFeatures>& features,
+    const std::vector<unsigned int>& l2Indices,
+    const std::vector<unsigned int>& inputSlots
+) const {
+    int n_features = inputSlots.size();
+    int n_rows = l2Indices.size();
+
+    // One row per L2, in the input order of the model
+    std::vector<float> inputs(n_rows * n_features);
+    for (int row=0; row<n_rows; row++){
+        const DnnFeatures& l2Features = features[l2Indices[row]];
+        for (int i=0; i<n_features; i++){
+            inputs[row * n_features + i] = l2Features[inputSlots[i]];
         }
     }
+    return inputs;
+}
+
+
+void TSGForOIFromL2::evaluateDnn(
+    const std::vector<DnnFeatures>& features,
+    const std::vector<unsigned int>& l2Indices,
+    const OIStrategyModel& model,
+    const std::vector<unsigned int>& inputSlots,
+    std::vector<DnnStrategy>& strategies
+) const {
+    if (l2Indices.empty()) return;
+
+    std::vector<float> inputs = dnnInputs(features, l2Indices, inputSlots);
+
+    // Evaluate DNN, timing the backend when validating
+    auto start = std::chrono::steady_clock::now();
+    std::vector<float> dnn_outputs;
+    model.backend().evaluate(inputs, l2Indices.size(), inputSlots.size(), dnn_outputs);
+    if (validateDnnBackend_ && model.reference() != nullptr)
+        dnnNanoseconds_[0] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    decodeDnn(inputs, dnn_outputs, l2Indices, model, strategies);
+}
+
+
+void TSGForOIFromL2::submitDnn(
+    const std::vector<DnnFeatures>& features,
+    const std::vector<unsigned int>& l2Indices,
+    OIStrategyBatcher& batcher,
+    const std::vector<unsigned int>& inputSlots,
+    std::vector<DnnStrategy>& strategies,
+    edm::WaitingTaskWithArenaHolder holder
+) const {
+    if (l2Indices.empty()) return;
+
+    std::vector<float> inputs = dnnInputs(features, l2Indices, inputSlots);
+    // The inputs are only needed again to validate the backend
+    std::vector<float> validationInputs;
+    if (validateDnnBackend_ && batcher.model().reference() != nullptr)
+        validationInputs = inputs;
+
+    // The strategies are decoded on the service thread, then produce() may run once all holders are done
+    batcher.submit(
+        std::move(inputs),
+        l2Indices.size(),
+        inputSlots.size(),
+        [this, &batcher, &strategies, l2Indices, validationInputs, holder](std::vector<float>&& dnn_outputs,
+                                                                          std::exception_ptr exception) mutable {
+            if (!exception) {
+                try {
+                    decodeDnn(validationInputs, dnn_outputs, l2Indices, batcher.model(), strategies);
+                } catch (...) {
+                    exception = std::current_exception();
+                }
+            }
+            holder.doneWaiting(exception);
+        });
+}
+
+
+void TSGForOIFromL2::decodeDnn(
+    const std::vector<float>& inputs,
+    const std::vector<float>& dnn_outputs,
+    const std::vector<unsigned int>& l2Indices,
+    const OIStrategyModel& model,
+    std::vector<DnnStrategy>& strategies
+) const {
+    const OIStrategyBackend* reference = validateDnnBackend_ ? model.reference() : nullptr;
+
+    int n_rows = l2Indices.size();
+    int n_outputs = dnn_outputs.size() / n_rows;
+
+    std::vector<float> tf_outputs;
+    if (reference != nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        reference->evaluate(inputs, n_rows, inputs.size() / n_rows, tf_outputs);
+        dnnNanoseconds_[1] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ++dnnBatches_;
+        dnnRows_ += n_rows;
+        if (tf_outputs.size() != dnn_outputs.size())
+            throw cms::Exception("OIStrategyBackend") << "TSGForOIFromL2::decodeDnn: " << dnn_outputs.size()
+                                                      << " DNN outputs differ from " << tf_outputs.size()
+                                                      << " TensorFlow outputs";
+    }
 
-    // Decode output
-    nHB = decoderHist->GetBinContent(1, imax+1);
-    nHLIP = decoderHist->GetBinContent(2, imax+1);
-    nHLMuS = decoderHist->GetBinContent(3, imax+1);
-
-    // If you want to verify that parameters are interpreted correctly,
-    // you can print out parameter names, stored as bin lables
-    /*for (int i=0; i<decoderHist->GetXaxis()->GetNbins(); i++){
-        std::cout << decoderHist->GetXaxis()->GetBinLabel(i+1) << std::endl;
-    }*/
-    
-    //std::cout << "DNN output #"<< imax << ": " << nHB << " " << nHLIP << " " << nHLMuS << std::endl;
-    dnnSuccess = true;
+    for (int row=0; row<n_rows; row++){
+        // Find output with largest prediction
+        int imax = dnnDecision(&dnn_outputs[row * n_outputs], n_outputs);
+
+        if (!tf_outputs.empty()) {
+            int imax_tf = dnnDecision(&tf_outputs[row * n_outputs], n_outputs);
+            float max_diff = 0;
+            for (int i = 0; i < n_outputs; i++)
+                max_diff = std::max(max_diff, std::abs(dnn_outputs[row * n_outputs + i] - tf_outputs[row * n_outputs + i]));
+            // Classes decoding to the same numbers of seeds are equivalent
+            if (model.decode(imax) != model.decode(imax_tf)) {
+                ++dnnMismatches_;
+                edm::LogWarning(theCategory_) << "TSGForOIFromL2::decodeDnn: " << OIStrategyBackend::name(dnnBackend_)
+                                              << " (" << dnnPrecision_ << ") DNN decision " << imax
+                                              << " differs from TensorFlow decision " << imax_tf
+                                              << ", largest output difference " << max_diff;
+            } else {
+                LogTrace(theCategory_) << "TSGForOIFromL2::decodeDnn: largest output difference to TensorFlow "
+                                       << max_diff;
+            }
+        }
+
+        // Decode output
+        DnnStrategy& strategy = strategies[l2Indices[row]];
+        const OIStrategyModel::Decision decision = model.decode(imax);
+        strategy.nHB = decision[0];
+        strategy.nHLIP = decision[1];
+        strategy.nHLMuS = decision[2];
+        strategy.confidence = imax >= 0 ? dnn_outputs[row * n_outputs + imax] : 0.f;
+        LogTrace(theCategory_) << "TSGForOIFromL2::decodeDnn: DNN output #" << imax << ": " << strategy.nHB << " "
+                               << strategy.nHLIP << " " << strategy.nHLMuS;
+    }
     return;
 }
 
@@ -1000,22 +1945,8 @@ void TSGForOIFromL2::fillDescriptions(edm::ConfigurationDescriptions& descriptio
   desc.add<unsigned int>("maxHitSeeds", 1);
   desc.add<unsigned int>("numL2ValidHitsCutAllEta", 20);
   desc.add<unsigned int>("numL2ValidHitsCutAllEndcap", 30);
-  desc.add<double>("pT1", 13.0);
-  desc.add<double>("pT2", 30.0);
-  desc.add<double>("pT3", 70.0);
-  desc.add<double>("eta1", 0.2);
-  desc.add<double>("eta2", 0.3);
-  desc.add<double>("eta3", 1.0);
-  desc.add<double>("eta4", 1.2);
-  desc.add<double>("eta5", 1.6);
-  desc.add<double>("eta6", 1.4);
+  DynamicErrorSF::fillDescription(desc);
   desc.add<double>("eta7", 2.1);
-  desc.add<double>("SF1", 3.0);
-  desc.add<double>("SF2", 4.0);
-  desc.add<double>("SF3", 5.0);
-  desc.add<double>("SF4", 7.0);
-  desc.add<double>("SF5", 10.0);
-  desc.add<double>("SF6", 2.0);
   desc.add<double>("tsosDiff1", 0.2);
   desc.add<double>("tsosDiff2", 0.02);
   desc.add<std::string>("propagatorName", "PropagatorWithMaterialParabolicMf");
@@ -1026,10 +1957,44 @@ void TSGForOIFromL2::fillDescriptions(edm::ConfigurationDescriptions& descriptio
   desc.add<unsigned int>("maxHitDoubletSeeds", 0);
   desc.add<bool>("getStrategyFromDNN", false);
   desc.add<double>("etaSplitForDnn", 1.0);
+  desc.add<std::string>("dnnBackend", "tensorflow");
+  desc.add<std::string>("dnnPrecision", "float");
+  desc.add<bool>("validateDnnBackend", false);
+  desc.add<unsigned int>("dnnBatchSize", 0);
+  desc.add<unsigned int>("dnnBatchMaxWait", 200);
   desc.add<std::string>("dnnModelPath_barrel", "");
   desc.add<std::string>("dnnMetadataPath_barrel", "");
   desc.add<std::string>("dnnModelPath_endcap", "");
   desc.add<std::string>("dnnMetadataPath_endcap", "");
+  desc.add<std::string>("dnnOnnxModelPath_barrel", "");
+  desc.add<std::string>("dnnOnnxModelPath_endcap", "");
+  desc.add<std::string>("dnnBundlePath", "");
+  desc.add<bool>("parallelizeL2s", false);
+  desc.add<bool>("shareCompatibleDetSearch", false);
+  desc.add<bool>("validateSharedDetSearch", false);
+  desc.add<bool>("approximateMuSFeatures", false);
+  desc.add<std::string>("trackerBoundMap", "");
+  desc.add<uint32_t>("trackerBoundMapMinEntries", 20);
+  desc.add<uint32_t>("hitMultipletDepth", 1);
+  desc.add<uint32_t>("hitMultipletBeamWidth", 1);
+  desc.add<uint32_t>("hitMultipletBranching", 1);
+  desc.add<bool>("helixPrescreen", false);
+  desc.add<double>("helixPrescreenTolerance", 10.);
+  desc.add<bool>("validateHelixPrescreen", false);
+  desc.add<uint32_t>("hitIndexLayers", 0);
+  desc.add<double>("hitIndexNSigma", 10.);
+  desc.add<uint32_t>("maxSeedsPerEvent", 0);
+  desc.add<uint32_t>("minSeedsPerL2", 1);
+  desc.add<std::string>("seedRanking", "chi2");
+  desc.add<double>("seedDuplicateChi2", 0.);
+  desc.add<double>("seedDuplicateCellSize", 0.5);
+  desc.add<double>("mergeL2Chi2", 0.);
+  desc.add<edm::InputTag>("ioL3Tracks", edm::InputTag(""));
+  desc.add<edm::InputTag>("ioL3MuonTrackLinks", edm::InputTag(""));
+  desc.add<double>("ioMatchDeltaR", 0.1);
+  desc.add<double>("ioMatchRelDeltaPt", 0.5);
+  desc.add<std::string>("ioMatchedL2Seeding", "none");
+  desc.add<bool>("produceTiming", false);
   descriptions.add("TSGForOIFromL2", desc);
 }
 
@@ -7,7 +7,9 @@
  \author   Benjamin Radburn-Smith, Santiago Folgueras, Bibhuprasad Mahakud, Jan Frederik Schulte, Dmitry Kondratyev (Purdue University, West Lafayette)
  */
 
+#include "DataFormats/MuonReco/interface/MuonTrackLinks.h"
 #include "DataFormats/TrackReco/interface/Track.h"
+#include "FWCore/Concurrency/interface/WaitingTaskWithArenaHolder.h"
 #include "FWCore/Framework/interface/global/EDProducer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/EventSetup.h"
@@ -15,6 +17,7 @@
 #include "FWCore/Framework/interface/MakerMacros.h"
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/ParameterSet/interface/ParameterSetDescription.h"
 #include "Geometry/CommonDetUnit/interface/GlobalTrackingGeometry.h"
 #include "Geometry/Records/interface/GlobalTrackingGeometryRecord.h"
 #include "MagneticField/Engine/interface/MagneticField.h"
@@ -33,18 +36,161 @@
 #include "PhysicsTools/TensorFlow/interface/TensorFlow.h"
 #include "TrackingTools/DetLayers/interface/NavigationSchool.h"
 #include "RecoTracker/Record/interface/NavigationSchoolRecord.h"
-#include <TFile.h>
-#include <TH2D.h>
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyBatcher.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyModel.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIDnnFeatures.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIHitIndex.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITiming.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITrackerBoundMap.h"
+#include "FWCore/Framework/interface/ESWatcher.h"
+#include "FWCore/Utilities/interface/ESGetToken.h"
+#include "Geometry/Records/interface/TrackerDigiGeometryRecord.h"
+#include "Geometry/TrackerGeometryBuilder/interface/TrackerGeometry.h"
+#include "RecoTracker/Record/interface/TrackerRecoGeometryRecord.h"
+#include "RecoTracker/TkDetLayers/interface/GeometricSearchTracker.h"
 
+#include "tbb/enumerable_thread_specific.h"
 
-class TSGForOIFromL2 : public edm::global::EDProducer<> {
+#include <array>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
+
+/// Compatible dets of one state on the current layer, one entry per error rescaling
+struct TSGForOIDetSearchStore {
+  static constexpr unsigned int kMaxEntries = 4;
+  std::array<double, kMaxEntries> errorSF;
+  std::array<std::vector<GeometricSearchDet::DetWithState>, kMaxEntries> dets;
+  unsigned int size = 0;
+  /// Dets with hits found through the hit index, for one rescaling
+  std::vector<GeometricSearchDet::DetWithState> indexed;
+  double indexedErrorSF = 0.;
+  bool hasIndexed = false;
+  /// Validation of the shared search: the exact search of each filtered rescaling, and whether a
+  /// filtered search was done, and differed from the exact one, since the flags were last reset
+  bool validate = false;
+  std::vector<GeometricSearchDet::DetWithState> exact;
+  bool filtered = false;
+  bool differs = false;
+};
+
+/// Hit of a partial multiplet, in a flat buffer where each hit points to the previous hit of its multiplet
+struct TSGForOIHitNode {
+  TrackingRecHit::ConstRecHitPointer hit;
+  /// Index of the previous hit, -1 for the first one
+  int parent;
+};
+
+/// Partial hit multiplet of the beam search of the multi-hit seeds. Only the measurement det of each
+/// det id is cached between candidates (TSGForOIScratch::measurementDets): the dets and measurements
+/// on the next layer depend on the updated state of each candidate, so they are searched again for
+/// every candidate, even those which share their last hit.
+struct TSGForOIHitCandidate {
+  TrajectoryStateOnSurface state;
+  const DetLayer* layer;
+  float chi2;
+  /// Last hit of the multiplet in TSGForOIScratch::hitNodes
+  int hit;
+};
+
+/// Buffers reused by the seed makers from one layer and one L2 to the next, so that their capacity is kept
+struct TSGForOIScratch {
+  TSGForOIDetSearchStore detsIP;
+  TSGForOIDetSearchStore detsMuS;
+  std::vector<GeometricSearchDet::DetWithState> detsNext;
+  std::vector<TrajectoryMeasurement> meas;
+  std::vector<TrajectoryMeasurement> measNext;
+  std::vector<TSGForOIHitCandidate> candidates;
+  std::vector<TSGForOIHitCandidate> nextCandidates;
+  /// Hits of all the candidates grown from one first hit, and the hits of the best one, in order
+  std::vector<TSGForOIHitNode> hitNodes;
+  std::vector<const TrackingRecHit*> multipletHits;
+  /// Measurement dets of the current event
+  std::unordered_map<const GeomDet*, MeasurementDetWithData> measurementDets;
+  /// Measurement chi2 of each seed made for the current L2, in the order of the seeds
+  std::vector<float> seedChi2;
+  /// Hitless layer searches pre-screened, rejected, and rejected although the layer has compatible dets
+  std::array<unsigned long long, 3> helixPrescreenCounts{{0, 0, 0}};
+  /// Muon-system states taken to the tracker bound by the map, and by the propagator
+  std::array<unsigned long long, 2> trackerBoundMapCounts{{0, 0}};
+  /// L2's with filtered det searches, and those with a filtered search differing from the exact one
+  std::array<unsigned long long, 2> sharedDetSearchCounts{{0, 0}};
+
+  /// Stage timers of the current event (only filled with TSGFOROI_TIMING) and the region being seeded
+  TSGForOITiming timing;
+  TSGForOITiming::Region region = TSGForOITiming::kTOB;
+};
+
+/// Event in flight on a stream, from prepareEvent() to produce()
+struct TSGForOIEventState;
+
+/// EventSetup products and the objects derived from them, kept per stream while their records do not change
+struct TSGForOIStreamCache {
+  edm::ESWatcher<IdealMagneticFieldRecord> magfieldWatcher;
+  edm::ESWatcher<GlobalTrackingGeometryRecord> geometryWatcher;
+  edm::ESWatcher<TrackerRecoGeometryRecord> searchTrackerWatcher;
+  edm::ESWatcher<TrackingComponentsRecord> trackingComponentsWatcher;
+  edm::ESWatcher<NavigationSchoolRecord> navSchoolWatcher;
+
+  const MagneticField* magfield = nullptr;
+  const GlobalTrackingGeometry* geometry = nullptr;
+  const Chi2MeasurementEstimatorBase* estimator = nullptr;
+  const NavigationSchool* navSchool = nullptr;
+  const Propagator* SHPOpposite = nullptr;
+  /// Parametrization replacing SHPOpposite where it covers the state, nullptr without it
+  const TSGForOITrackerBoundMap* trackerBoundMap = nullptr;
+  unsigned int trackerBoundMapMinEntries = 0;
+  std::unique_ptr<Propagator> propagatorAlong;
+  std::unique_ptr<Propagator> propagatorOpposite;
+  const std::vector<BarrelDetLayer const*>* tob = nullptr;
+  const std::vector<ForwardDetLayer const*>* tecPositive = nullptr;
+  const std::vector<ForwardDetLayer const*>* tecNegative = nullptr;
+
+  /// One set of seeding buffers per thread working on this stream (not part of the setup state)
+  mutable tbb::enumerable_thread_specific<TSGForOIScratch> scratch;
+  /// Stage timers summed over the events of this stream
+  TSGForOITiming timing;
+  /// Not part of the setup state either
+  std::unique_ptr<TSGForOIEventState> event;
+};
+
+class TSGForOIFromL2 : public edm::global::EDProducer<edm::ExternalWork, edm::StreamCache<TSGForOIStreamCache> > {
 public:
   explicit TSGForOIFromL2(const edm::ParameterSet& iConfig);
   ~TSGForOIFromL2() override;
   static void fillDescriptions(edm::ConfigurationDescriptions& descriptions);
+  std::unique_ptr<TSGForOIStreamCache> beginStream(edm::StreamID) const override;
+  void acquire(edm::StreamID sid,
+               const edm::Event& iEvent,
+               const edm::EventSetup& iSetup,
+               edm::WaitingTaskWithArenaHolder holder) const override;
   void produce(edm::StreamID sid, edm::Event& iEvent, const edm::EventSetup& iSetup) const override;
+  void endStream(edm::StreamID sid) const override;
+  void endJob() override;
+
+  /// State of an L2 at its PCA to the beamline, on a plane of its own
+  static TrajectoryStateOnSurface stateAtIP(const reco::Track& l2, const MagneticField* magfield);
+
+  /// pT and |eta| ranges of the dynamic error rescaling of the L2 states, and their scale factors
+  struct DynamicErrorSF {
+    explicit DynamicErrorSF(const edm::ParameterSet& iConfig);
+    /// Parameters pT1-3, eta1-6 and SF1-6, with their defaults
+    static void fillDescription(edm::ParameterSetDescription& desc);
+    double pT1, pT2, pT3;
+    double eta1, eta2, eta3, eta4, eta5, eta6;
+    double SF1, SF2, SF3, SF4, SF5, SF6;
+  };
+
+  /// Calculate the dynamic error SF by analysing the L2
+  static double calculateSFFromL2(const reco::Track& l2, const DynamicErrorSF& ranges);
 
 private:
+  friend struct TSGForOIEventState;
+
+  /// Features available to the DNN, in the order of the buffer filled by getFeatures
+  typedef std::array<float, TSGForOIDnnFeatures::kNFeatures> DnnFeatures;
+
   /// Labels for input collections
   const edm::EDGetTokenT<reco::TrackCollection> src_;
 
@@ -93,10 +239,29 @@ private:
 
   const edm::EDGetTokenT<MeasurementTrackerEvent> measurementTrackerTag_;
 
+  /// EventSetup products
+  const edm::ESGetToken<MagneticField, IdealMagneticFieldRecord> magfieldToken_;
+  const edm::ESGetToken<GlobalTrackingGeometry, GlobalTrackingGeometryRecord> geometryToken_;
+  const edm::ESGetToken<TrackerGeometry, TrackerDigiGeometryRecord> tkGeometryToken_;
+  const edm::ESGetToken<GeometricSearchTracker, TrackerRecoGeometryRecord> searchTrackerToken_;
+  const edm::ESGetToken<Chi2MeasurementEstimatorBase, TrackingComponentsRecord> estimatorToken_;
+  const edm::ESGetToken<Propagator, TrackingComponentsRecord> propagatorToken_;
+  const edm::ESGetToken<Propagator, TrackingComponentsRecord> SHPOppositeToken_;
+  const edm::ESGetToken<NavigationSchool, NavigationSchoolRecord> navSchoolToken_;
+
+  /// Refresh the cached EventSetup products of a stream if any of their records changed
+  const TSGForOIStreamCache& updateStreamCache(edm::StreamID sid, const edm::EventSetup& iSetup) const;
+
+  /// Fill the event state of the stream for produce(); from acquire() with the holder of the batching
+  /// service, from produce() without it
+  void prepareEvent(edm::StreamID sid,
+                    const edm::Event& iEvent,
+                    const edm::EventSetup& iSetup,
+                    edm::WaitingTaskWithArenaHolder* holder) const;
+
   /// pT, eta ranges and scale factor values
-  const double pT1_, pT2_, pT3_;
-  const double eta1_, eta2_, eta3_, eta4_, eta5_, eta6_, eta7_;
-  const double SF1_, SF2_, SF3_, SF4_, SF5_, SF6_;
+  const DynamicErrorSF dynamicErrorSF_;
+  const double eta1_, eta7_;
 
   /// Distance of L2 TSOSs before and after updated with vertex
   const double tsosDiff1_;
@@ -118,84 +283,435 @@ private:
   /// Get number of seeds to use from DNN output instead of "max..Seeds" parameters
   const bool getStrategyFromDNN_;
   const double etaSplitForDnn_;
+  /// Inference backend of the DNN: TensorFlow session, native kernel or ONNX Runtime
+  const OIStrategyBackend::Type dnnBackend_;
+  /// Precision of the native backend: "float", or quantized "fp16" or "int8"
+  const std::string dnnPrecision_;
+  /// Also run the TensorFlow session, report differing decisions of the backend, and compare their latencies
+  const bool validateDnnBackend_;
+  /// Batches, rows, and nanoseconds of the backend and of the TensorFlow reference, with validateDnnBackend_
+  mutable std::atomic<unsigned long long> dnnBatches_;
+  mutable std::atomic<unsigned long long> dnnRows_;
+  mutable std::atomic<unsigned long long> dnnMismatches_;
+  mutable std::array<std::atomic<unsigned long long>, 2> dnnNanoseconds_;
+
+  /// Evaluate the DNN rows of all streams in the process-wide batching services: at most
+  /// dnnBatchSize_ rows per batch (0: evaluate in each event), rows waiting at most
+  /// dnnBatchMaxWait_ microseconds for the batch to fill
+  const unsigned int dnnBatchSize_;
+  const unsigned int dnnBatchMaxWait_;
+
+  /// Propagate and seed the L2's of an event as parallel tasks; the seeds stay in L2 order
+  const bool parallelizeL2s_;
+
+  /// Search the compatible dets of the IP state once per layer with the widest error rescaling,
+  /// and filter them for the seed makers using smaller ones (approximate if the rescalings differ);
+  /// with validateSharedDetSearch_, also search the smaller ones exactly and count the L2's for which
+  /// the first filtered det or the set of filtered dets differs
+  const bool shareCompatibleDetSearch_;
+  const bool validateSharedDetSearch_;
+  mutable std::array<std::atomic<unsigned long long>, 2> sharedDetSearchCounts_;
+
+  /// Hit multiplet seeds: number of hits added to the first one, and the beam search width and
+  /// branching per added hit
+  const unsigned int hitMultipletDepth_;
+  const unsigned int hitMultipletBeamWidth_;
+  const unsigned int hitMultipletBranching_;
+
+  /// Skip the hitless seeds on layers that the helix of the state misses in a uniform field, by more than
+  /// helixPrescreenTolerance_ [cm] beyond the layer bounds; with validateHelixPrescreen_, search them
+  /// anyway and count the rejections of layers with compatible dets
+  const bool helixPrescreen_;
+  const double helixPrescreenTolerance_;
+  const bool validateHelixPrescreen_;
+  mutable std::array<std::atomic<unsigned long long>, 3> helixPrescreenCounts_;
+
+  /// Index the hits of the hitIndexLayers_ outermost TOB and TEC layers once per event (0: no index),
+  /// and search the hits of the hit-based seeds on these layers in windows of hitIndexNSigma_
+  /// standard deviations instead of searching the compatible dets of each L2. A layer is indexed when
+  /// the first L2 of the event searches it with hits, and indexing it builds the hits of all its
+  /// active dets: with on-demand strip unpacking, this unpacks and runs the CPE on every cluster of
+  /// the layer, where the search of each L2 only touches its compatible dets.
+  const unsigned int hitIndexLayers_;
+  const double hitIndexNSigma_;
+
+  /// Event-wide seed budget: at most maxSeedsPerEvent_ seeds (0: no budget), but at least
+  /// minSeedsPerL2_ seeds of each L2, the first ones it made
+  const unsigned int maxSeedsPerEvent_;
+  const unsigned int minSeedsPerL2_;
+  /// Order in which the seeds beyond the guaranteed ones fill the budget
+  enum class SeedRanking { Chi2, L2Pt, DnnConfidence };
+  SeedRanking seedRanking_;
+
+  /// Seeds on the same det, from the same hits, and with local states within this match_Chi2 of an
+  /// earlier seed are dropped (0: no de-duplication); candidates are searched in cells of this size [cm]
+  const double seedDuplicateChi2_;
+  const double seedDuplicateCellSize_;
+
+  /// L2's within this chi2 in q/p, lambda and phi at the IP are seeded once, from the one with
+  /// most hits, and their map to it is put into the event (0: every L2 is seeded)
+  const double mergeL2Chi2_;
+
+  /// Cascade after the inside-out iteration: L2's matched to one of its L3 tracks, or to the tracker
+  /// track of one of its links, within ioMatchDeltaR_ and a relative pT difference of ioMatchRelDeltaPt_
+  /// (links to the L2 itself always match) are seeded as ioMatchedL2Seeding_ says
+  edm::EDGetTokenT<reco::TrackCollection> ioL3TracksToken_;
+  edm::EDGetTokenT<reco::MuonTrackLinksCollection> ioL3MuonTrackLinksToken_;
+  const double ioMatchDeltaR_;
+  const double ioMatchRelDeltaPt_;
+  /// Seeds made for an L2, from least to most: with clustered L2's, a cluster is seeded as its least matched L2
+  enum class L2Seeding : char { None, Hitless, Full };
+  L2Seeding ioMatchedL2Seeding_;
+  /// L2's looked at and L2's matched in the cascade, reported at the end of the job
+  mutable std::atomic<unsigned long long> ioCheckedL2s_;
+  mutable std::atomic<unsigned long long> ioMatchedL2s_;
+
+  /// Put the stage times of each event into the event (filled only with TSGFOROI_TIMING)
+  const bool produceTiming_;
+  /// Stage timers summed over the ended streams, reported at the end of the job
+  mutable std::mutex timingMutex_;
+  mutable TSGForOITiming timing_;
 
-  tensorflow::GraphDef* graphDef_barrel_;
-  tensorflow::Session* tf_session_barrel_;
   const std::string dnnModelPath_barrel_;
   const std::string dnnMetadataPath_barrel_;
-  TFile * metadataFile_barrel_;
-  TH1D * inpOrderHist_barrel_;
-  TH1D * layerNamesHist_barrel_;
-  TH2D * decoderHist_barrel_;
-
-  tensorflow::GraphDef* graphDef_endcap_;
-  tensorflow::Session* tf_session_endcap_;
   const std::string dnnModelPath_endcap_;
   const std::string dnnMetadataPath_endcap_;
-  TFile * metadataFile_endcap_;
-  TH1D * inpOrderHist_endcap_;
-  TH1D * layerNamesHist_endcap_;
-  TH2D * decoderHist_endcap_;
+  /// ONNX conversions of the models, for the onnx backend
+  const std::string dnnOnnxModelPath_barrel_;
+  const std::string dnnOnnxModelPath_endcap_;
+  /// Strategy bundle with the barrel and endcap models, used instead of the files above if set
+  const std::string dnnBundlePath_;
+  /// Shared with all module instances using the same model files
+  std::shared_ptr<const OIStrategyModel> dnnModel_barrel_;
+  std::shared_ptr<const OIStrategyModel> dnnModel_endcap_;
+  std::shared_ptr<OIStrategyBatcher> dnnBatcher_barrel_;
+  std::shared_ptr<OIStrategyBatcher> dnnBatcher_endcap_;
+  /// Feature slot of each DNN input, resolved from the input order at construction
+  std::vector<unsigned int> dnnInputSlots_barrel_;
+  std::vector<unsigned int> dnnInputSlots_endcap_;
+
+  /// Some DNN input is computed from the muon-system state at the tracker bound
+  bool dnnUsesMuSFeatures_;
+  /// Take the MuS features from the IP state propagated outwards instead of the stepping helix
+  /// propagation of the muon-system state (cheaper, but not the state the DNN was trained on)
+  const bool approximateMuSFeatures_;
+
+  /// Parametrized propagation of the muon-system states to the tracker bound (see TSGForOITrackerBoundMap),
+  /// falling back to the stepping helix in bins with fewer than trackerBoundMapMinEntries_ L2's
+  std::unique_ptr<const TSGForOITrackerBoundMap> trackerBoundMap_;
+  const unsigned int trackerBoundMapMinEntries_;
+  mutable std::array<std::atomic<unsigned long long>, 2> trackerBoundMapCounts_;
+
+  /// Resolve the feature slot of each input of a model
+  std::vector<unsigned int> dnnInputSlots(const OIStrategyModel& model) const;
+
+  /// Seeding strategy decoded from the DNN output
+  struct DnnStrategy {
+    int nHB = 0;
+    int nHLIP = 0;
+    int nHLMuS = 0;
+    /// Output of the chosen class
+    float confidence = 0.f;
+  };
+
+  /// Event data and setup used in the seeding of each L2
+  struct SeedingContext {
+    const MeasurementTrackerEvent& measurementTracker;
+    const Chi2MeasurementEstimatorBase& estimator;
+    const NavigationSchool& navSchool;
+    const Propagator& propagatorAlong;
+    const Propagator& propagatorOpposite;
+    const std::vector<BarrelDetLayer const*>& tob;
+    const std::vector<ForwardDetLayer const*>& tecPositive;
+    const std::vector<ForwardDetLayer const*>& tecNegative;
+    /// Hits of the outer layers, nullptr without hit index
+    const TSGForOIHitIndex* hitIndex;
+  };
+
+  /// States of an L2 at the outer tracker bound, each propagated on first use
+  class OuterTkStates {
+  public:
+    OuterTkStates(const reco::Track& l2, const TrajectoryStateOnSurface& tsosAtIP, const TSGForOIStreamCache& setup)
+        : l2_(&l2), tsosAtIP_(&tsosAtIP), setup_(&setup) {}
+
+    /// State at the IP propagated outwards
+    const TrajectoryStateOnSurface& inside();
+    /// Innermost state of the L2 in the muon system propagated inwards with the stepping helix, or the map
+    const TrajectoryStateOnSurface& outside();
+
+  private:
+    const reco::Track* l2_;
+    const TrajectoryStateOnSurface* tsosAtIP_;
+    const TSGForOIStreamCache* setup_;
+    TrajectoryStateOnSurface inside_;
+    TrajectoryStateOnSurface outside_;
+    bool hasInside_ = false;
+    bool hasOutside_ = false;
+  };
+
+  /// Create the seeds of one L2 in the TOB and TEC layers
+  void makeSeedsForL2(const reco::TrackRef& l2,
+                      const TrajectoryStateOnSurface& tsosAtIP,
+                      OuterTkStates& outerTkStates,
+                      const DnnStrategy* strategy,
+                      bool hitlessOnly,
+                      const SeedingContext& context,
+                      TSGForOIScratch& scratch,
+                      std::vector<TrajectorySeed>& out) const;
+
+  /// Seed types of a layer traversal, fixed at compile time so that its loop only tests the seed limits
+  template <bool hitless, bool hitBased, bool run2>
+  struct SeedingPolicy {
+    /// Hitless seeds from the IP and muon-system states
+    static constexpr bool kHitless = hitless;
+    /// Hit-based doublet seeds, and the single-hit ones of the configured limits
+    static constexpr bool kHitBased = hitBased;
+    /// Configured limits instead of the DNN strategy: single-hit seeds, vetoed in the central barrel
+    /// with dontCreateHitbasedInBarrelAsInRun2, and the extra muon-system hitless seeds of useBothAsInRun2
+    static constexpr bool kRun2 = run2;
+  };
+
+  /// Limits and error rescalings of the seeds of one L2, resolved before its layer traversal
+  struct SeedingPlan {
+    unsigned int maxHitSeeds = 0;
+    unsigned int maxHitDoubletSeeds = 0;
+    unsigned int maxHitlessSeedsIP = 0;
+    unsigned int maxHitlessSeedsMuS = 0;
+    double errorSFHits = 1.;
+    double errorSFHitless = 1.;
+    double widestErrorSF = 0.;
+    bool hitBasedInBarrel = true;
+    bool useBoth = false;
+    /// Muon-system state at the tracker bound, for the muon-system hitless seeds if hasOuterTkStates
+    TrajectoryStateOnSurface outerTkStateOutside;
+    bool hasOuterTkStates = false;
+  };
+
+  /// Seeds made for one L2, counted against the limits of its plan
+  struct SeedCounts {
+    unsigned int total = 0;
+    unsigned int hitlessIP = 0;
+    unsigned int hitlessMuS = 0;
+    unsigned int hit = 0;
+    unsigned int hitDoublet = 0;
+  };
+
+  /// Seed an L2 in the TOB and TEC regions its eta reaches
+  template <typename Policy>
+  void seedRegions(const reco::TrackRef& l2,
+                   const TrajectoryStateOnSurface& tsosAtIP,
+                   const SeedingPlan& plan,
+                   const SeedingContext& context,
+                   TSGForOIScratch& scratch,
+                   std::vector<TrajectorySeed>& out) const;
+
+  /// Seed an L2 on the layers of one region, from the outermost one
+  template <typename Policy, typename Layer>
+  void seedLayers(const std::vector<Layer const*>& layers,
+                  const char* regionName,
+                  const TrajectoryStateOnSurface& tsosAtIP,
+                  const SeedingPlan& plan,
+                  const SeedingContext& context,
+                  TSGForOIScratch& scratch,
+                  SeedCounts& counts,
+                  std::vector<TrajectorySeed>& out) const;
+
+  /// Compatible dets of one state on one layer, searched once and shared by the seed makers
+  class LayerSearch {
+  public:
+    /// widestErrorSF > 0: search once with the widest error rescaling and filter the narrower
+    /// ones from it; otherwise search each distinct rescaling exactly. The results are kept in store.
+    LayerSearch(const GeometricSearchDet& layer,
+                const TrajectoryStateOnSurface& tsos,
+                const Propagator& propagator,
+                const Chi2MeasurementEstimatorBase& estimator,
+                double widestErrorSF,
+                const TSGForOIHitIndex* hitIndex,
+                TSGForOIDetSearchStore& store,
+                TSGForOITiming& timing)
+        : layer_(layer),
+          tsos_(tsos),
+          propagator_(propagator),
+          estimator_(estimator),
+          widestErrorSF_(widestErrorSF),
+          hitIndex_(hitIndex),
+          store_(store),
+          timing_(timing) {
+      store_.size = 0;
+      store_.hasIndexed = false;
+    }
+
+    /// Dets compatible with the state, with its errors rescaled by errorSF
+    const std::vector<GeometricSearchDet::DetWithState>& dets(double errorSF);
+    /// The same for the hit-based seeds: only the dets with hits in the window of the state if the
+    /// layer is indexed
+    const std::vector<GeometricSearchDet::DetWithState>& hitDets(double errorSF);
+
+    const GeometricSearchDet& layer() const { return layer_; }
+    const TrajectoryStateOnSurface& tsos() const { return tsos_; }
+    const Propagator& propagator() const { return propagator_; }
+    const Chi2MeasurementEstimatorBase& estimator() const { return estimator_; }
+    const TSGForOIHitIndex* hitIndex() const { return hitIndex_; }
+
+    /// Whether the helix of the state in the field at its position crosses the layer within its bounds
+    /// and the tolerance [cm]; true if it cannot tell
+    bool reachable(double tolerance);
+
+  private:
+    const std::vector<GeometricSearchDet::DetWithState>& search(double errorSF);
+    /// Empty entry of the store for errorSF
+    std::vector<GeometricSearchDet::DetWithState>& newEntry(double errorSF);
+
+    const GeometricSearchDet& layer_;
+    const TrajectoryStateOnSurface& tsos_;
+    const Propagator& propagator_;
+    const Chi2MeasurementEstimatorBase& estimator_;
+    const double widestErrorSF_;
+    const TSGForOIHitIndex* hitIndex_;
+    TSGForOIDetSearchStore& store_;
+    TSGForOITiming& timing_;
+    /// Result of reachable(), -1 until computed
+    int reachable_ = -1;
+  };
 
   /// Create seeds without hits on a given layer (TOB or TEC)
-  void makeSeedsWithoutHits(const GeometricSearchDet& layer,
-                            const TrajectoryStateOnSurface& tsos,
-                            const Propagator& propagatorAlong,
-                            edm::ESHandle<Chi2MeasurementEstimatorBase>& estimator,
+  void makeSeedsWithoutHits(LayerSearch& search,
+                            TSGForOIScratch& scratch,
                             double errorSF,
                             unsigned int& hitlessSeedsMade,
                             unsigned int& numSeedsMade,
                             std::vector<TrajectorySeed>& out) const;
 
   /// Find hits on a given layer (TOB or TEC) and create seeds from updated TSOS with hit
-  void makeSeedsFromHits(const GeometricSearchDet& layer,
-                         const TrajectoryStateOnSurface& tsos,
-                         const Propagator& propagatorAlong,
-                         edm::ESHandle<Chi2MeasurementEstimatorBase>& estimator,
-                         edm::Handle<MeasurementTrackerEvent>& measurementTracker,
+  void makeSeedsFromHits(LayerSearch& search,
+                         const MeasurementTrackerEvent& measurementTracker,
+                         TSGForOIScratch& scratch,
                          double errorSF,
                          unsigned int& hitSeedsMade,
                          unsigned int& numSeedsMade,
                          unsigned int& layerCount,
                          std::vector<TrajectorySeed>& out) const;
 
-  void makeSeedsFromHitDoublets(const GeometricSearchDet& layer,
-                                       const TrajectoryStateOnSurface& tsos,
-                                       const Propagator& propagatorAlong,
-                                       edm::ESHandle<Chi2MeasurementEstimatorBase>& estimator,
-                                       edm::Handle<MeasurementTrackerEvent>& measurementTracker,
-                                       edm::ESHandle<NavigationSchool> navSchool,
-                                       double errorSF,
-                                       unsigned int& hitDoubletSeedsMade,
-                                       unsigned int& numSeedsMade,
-                                       unsigned int& layerCount,
-                                       std::vector<TrajectorySeed>& out) const;
-  /// Calculate the dynamic error SF by analysing the L2
-  double calculateSFFromL2(const reco::TrackRef track) const;
+  /// Find hits on a given layer and on the next ones, and create seeds from the best hit multiplets
+  void makeSeedsFromHitDoublets(LayerSearch& search,
+                                const MeasurementTrackerEvent& measurementTracker,
+                                const NavigationSchool& navSchool,
+                                TSGForOIScratch& scratch,
+                                double errorSF,
+                                unsigned int& hitDoubletSeedsMade,
+                                unsigned int& numSeedsMade,
+                                unsigned int& layerCount,
+                                std::vector<TrajectorySeed>& out) const;
+
+  /// One step of the beam search of makeSeedsFromHitDoublets, on scratch.candidates
+  void extendHitCandidates(const MeasurementTrackerEvent& measurementTracker,
+                           const NavigationSchool& navSchool,
+                           const TSGForOIHitIndex* hitIndex,
+                           const Propagator& propagatorAlong,
+                           const Chi2MeasurementEstimatorBase& estimator,
+                           double errorSF,
+                           TSGForOIScratch& scratch) const;
+
+  /// Append the valid measurements on the given dets to meas
+  void findMeasurements(const std::vector<GeometricSearchDet::DetWithState>& dets,
+                        const TrajectoryStateOnSurface& onLayer,
+                        const Propagator& propagatorAlong,
+                        const Chi2MeasurementEstimatorBase& estimator,
+                        const MeasurementTrackerEvent& measurementTracker,
+                        TSGForOIScratch& scratch,
+                        std::vector<TrajectoryMeasurement>& meas) const;
+
+  /// Representative L2 of each L2: the first one, by number of hits, it is compatible with
+  void clusterL2s(const reco::TrackCollection& l2s,
+                  const std::vector<TrajectoryStateOnSurface>& tsosAtIPs,
+                  std::vector<int>& l2Clusters) const;
+
+  /// Seeding of each L2 in the cascade, given the IO L3 tracks and links of the event
+  void matchIOL3Muons(const edm::Event& iEvent,
+                      const edm::Handle<reco::TrackCollection>& l2TrackCol,
+                      std::vector<L2Seeding>& l2Seeding) const;
+
+  /// Enlarge the IP state errors of the representatives to the search windows of their clusters
+  void widenClusterStates(const std::vector<int>& l2Clusters, std::vector<TrajectoryStateOnSurface>& tsosAtIPs) const;
+
+  /// Drop the seeds duplicating an earlier one, keeping the L2 offsets and chi2 of the others
+  void removeDuplicateSeeds(const TSGForOIStreamCache& setup,
+                            std::vector<unsigned int>& l2SeedOffsets,
+                            std::vector<float>& seedChi2,
+                            std::vector<TrajectorySeed>& seeds) const;
+
+  /// Keep the seeds of the event within the seed budget; l2SeedOffsets gives the first seed of each L2
+  void applySeedBudget(const reco::TrackCollection& l2s,
+                       const std::vector<DnnStrategy>& dnnStrategies,
+                       const std::vector<unsigned int>& l2SeedOffsets,
+                       const std::vector<float>& seedChi2,
+                       std::vector<TrajectorySeed>& seeds) const;
+
+  /// Update a state with a hit, timed as a stage
+  TrajectoryStateOnSurface update(const TrajectoryStateOnSurface& tsos,
+                                  const TrackingRecHit& hit,
+                                  TSGForOIScratch& scratch) const;
 
   /// Find compatability between two TSOSs
   double match_Chi2(const TrajectoryStateOnSurface& tsos1, const TrajectoryStateOnSurface& tsos2) const;
   
-  /// Dictionary of inputs for DNN
-  std::map<std::string, float> getFeatureMap(
-      reco::TrackRef l2,
-      const TrajectoryStateOnSurface& tsos_IP,     
-      const TrajectoryStateOnSurface& tsos_MuS
+  /// Fill the inputs for DNN
+  void getFeatures(
+      const reco::Track& l2,
+      const TrajectoryStateOnSurface& tsos_IP,
+      const TrajectoryStateOnSurface& tsos_MuS,
+      DnnFeatures& features
   ) const;
-    
-  /// Evaluate DNN
+
+  /// DNN inputs of the L2's with given indices, one row per L2
+  std::vector<float> dnnInputs(
+      const std::vector<DnnFeatures>& features,
+      const std::vector<unsigned int>& l2Indices,
+      const std::vector<unsigned int>& inputSlots
+  ) const;
+
+  /// Evaluate DNN in one batch for the L2's with given indices
   void evaluateDnn(
-      std::map<std::string, float> feature_map,
-      tensorflow::Session* session,
-      TH1D * inpOrderHist,
-      TH1D * layerNamesHist,
-      TH2D * decoderHist,
-      int& nHB,
-      int& nHLIP,
-      int& nHLMuS,
-      bool& dnnSuccess
+      const std::vector<DnnFeatures>& features,
+      const std::vector<unsigned int>& l2Indices,
+      const OIStrategyModel& model,
+      const std::vector<unsigned int>& inputSlots,
+      std::vector<DnnStrategy>& strategies
   ) const;
 
+  /// Submit the DNN rows of the L2's with given indices to a batching service, which decodes
+  /// their strategies and then releases the holder
+  void submitDnn(
+      const std::vector<DnnFeatures>& features,
+      const std::vector<unsigned int>& l2Indices,
+      OIStrategyBatcher& batcher,
+      const std::vector<unsigned int>& inputSlots,
+      std::vector<DnnStrategy>& strategies,
+      edm::WaitingTaskWithArenaHolder holder
+  ) const;
+
+  /// Decode the strategies from the DNN outputs, validating them against TensorFlow if requested
+  /// (the inputs are only used then)
+  void decodeDnn(
+      const std::vector<float>& inputs,
+      const std::vector<float>& dnn_outputs,
+      const std::vector<unsigned int>& l2Indices,
+      const OIStrategyModel& model,
+      std::vector<DnnStrategy>& strategies
+  ) const;
+
+  /// Run the work for each L2, as parallel tasks with parallelizeL2s_
+  void forEachL2(unsigned int nL2, const std::function<void(unsigned int)>& work) const;
+
+};
+
+struct TSGForOIEventState {
+  std::vector<TrajectoryStateOnSurface> tsosAtIPs;
+  std::vector<int> l2Clusters;
+  std::vector<TSGForOIFromL2::L2Seeding> l2Seeding;
+  std::vector<TSGForOIFromL2::OuterTkStates> outerTkStates;
+  std::vector<TSGForOIFromL2::DnnStrategy> dnnStrategies;
+  TSGForOIHitIndex hitIndex;
 };
 
 #endif
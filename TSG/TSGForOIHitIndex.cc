@@ -0,0 +1,224 @@
+/**
+  \class    TSGForOIHitIndex
+  \brief    Valid hits of the outer tracker layers of an event, binned in phi and z (barrel) or r (endcap)
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIHitIndex.h"
+#include "DataFormats/Math/interface/deltaPhi.h"
+#include "TrackingTools/TrajectoryParametrization/interface/GlobalTrajectoryParameters.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace {
+  // Momentum [GeV] of the straight track the hits are built for
+  constexpr float kStraightMomentum = 100.f;
+
+  // Phi, z (barrel) or r (endcap), and their standard deviations, of a position
+  std::array<float, 4> coordinates(const GlobalPoint& pos, const GlobalError& err, bool barrel) {
+    const double x = pos.x(), y = pos.y(), r2 = x * x + y * y;
+    const double varRPhi = (y * y * err.cxx() - 2. * x * y * err.cyx() + x * x * err.cyy()) / r2;
+    const double varZR = barrel ? err.czz() : (x * x * err.cxx() + 2. * x * y * err.cyx() + y * y * err.cyy()) / r2;
+    return {{pos.barePhi(),
+             float(barrel ? pos.z() : std::sqrt(r2)),
+             float(std::sqrt(varRPhi / r2)),
+             float(std::sqrt(varZR))}};
+  }
+
+  unsigned int phiBin(float phi) {
+    const int bin = int((phi + M_PI) * (TSGForOIHitIndex::kPhiBins / (2. * M_PI)));
+    return std::min<int>(std::max(bin, 0), TSGForOIHitIndex::kPhiBins - 1);
+  }
+}  // namespace
+
+void TSGForOIHitIndex::clear(double nSigma,
+                             const MeasurementTrackerEvent& measurementTracker,
+                             const MagneticField* magfield) {
+  nLayers_ = 0;
+  nSigma_ = nSigma;
+  measurementTracker_ = &measurementTracker;
+  magfield_ = magfield;
+}
+
+void TSGForOIHitIndex::addLayer(const DetLayer& detLayer) {
+  if (nLayers_ == layers_.size())
+    layers_.push_back(std::make_unique<Layer>());
+  Layer& layer = *layers_[nLayers_++];
+  layer.detLayer = &detLayer;
+  layer.read.store(false, std::memory_order_relaxed);
+}
+
+unsigned int TSGForOIHitIndex::size() const {
+  unsigned int n = 0;
+  for (unsigned int i = 0; i != nLayers_; ++i)
+    if (layers_[i]->read.load(std::memory_order_acquire))
+      n += layers_[i]->det.size();
+  return n;
+}
+
+unsigned int TSGForOIHitIndex::layersRead() const {
+  unsigned int n = 0;
+  for (unsigned int i = 0; i != nLayers_; ++i)
+    n += layers_[i]->read.load(std::memory_order_acquire);
+  return n;
+}
+
+unsigned int TSGForOIHitIndex::zrBin(const Layer& layer, float zr) const {
+  if (layer.zrMax <= layer.zrMin)
+    return 0;
+  const int bin = int((zr - layer.zrMin) / (layer.zrMax - layer.zrMin) * kZRBins);
+  return std::min<int>(std::max(bin, 0), kZRBins - 1);
+}
+
+//
+// Read the hits of a layer and sort them by bin
+//
+void TSGForOIHitIndex::readHits(Layer& layer) const {
+  const DetLayer& detLayer = *layer.detLayer;
+  layer.barrel = detLayer.location() == GeomDetEnumerators::barrel;
+  layer.maxSigmaPhi = 0.f;
+  layer.maxSigmaZR = 0.f;
+  layer.unsorted.clear();
+  layer.unsortedDets.clear();
+
+  for (const GeomDet* det : detLayer.basicComponents()) {
+    MeasurementDetWithData measurementDet = measurementTracker_->idToDet(det->geographicalId());
+    if (measurementDet.isNull() || !measurementDet.isActive())
+      continue;
+    const GlobalPoint center = det->position();
+    const TrajectoryStateOnSurface straight(
+        GlobalTrajectoryParameters(center, GlobalVector(center.basicVector().unit() * kStraightMomentum), 1, magfield_),
+        det->surface());
+    for (const auto& hit : measurementDet.recHits(straight)) {
+      if (!hit->isValid())
+        continue;
+      const std::array<float, 4> c = coordinates(hit->globalPosition(), hit->globalPositionError(), layer.barrel);
+      layer.unsorted.insert(layer.unsorted.end(), c.begin(), c.end());
+      layer.unsortedDets.push_back(det);
+      layer.maxSigmaPhi = std::max(layer.maxSigmaPhi, c[2]);
+      layer.maxSigmaZR = std::max(layer.maxSigmaZR, c[3]);
+    }
+  }
+
+  const unsigned int nHits = layer.unsortedDets.size();
+  layer.zrMin = nHits > 0 ? std::numeric_limits<float>::max() : 0.f;
+  layer.zrMax = nHits > 0 ? std::numeric_limits<float>::lowest() : 0.f;
+  for (unsigned int i = 0; i != nHits; ++i) {
+    layer.zrMin = std::min(layer.zrMin, layer.unsorted[4 * i + 1]);
+    layer.zrMax = std::max(layer.zrMax, layer.unsorted[4 * i + 1]);
+  }
+
+  // Counting sort: offsets of the bins, then each hit at the next free slot of its bin
+  layer.binOffsets.assign(kPhiBins * kZRBins + 1, 0);
+  layer.unsortedBins.resize(nHits);
+  for (unsigned int i = 0; i != nHits; ++i) {
+    const unsigned int bin = phiBin(layer.unsorted[4 * i]) * kZRBins + zrBin(layer, layer.unsorted[4 * i + 1]);
+    layer.unsortedBins[i] = bin;
+    ++layer.binOffsets[bin + 1];
+  }
+  std::partial_sum(layer.binOffsets.begin(), layer.binOffsets.end(), layer.binOffsets.begin());
+  layer.phi.resize(nHits);
+  layer.zr.resize(nHits);
+  layer.sigmaPhi.resize(nHits);
+  layer.sigmaZR.resize(nHits);
+  layer.det.resize(nHits);
+  for (unsigned int i = 0; i != nHits; ++i) {
+    const unsigned int h = layer.binOffsets[layer.unsortedBins[i]]++;
+    layer.phi[h] = layer.unsorted[4 * i];
+    layer.zr[h] = layer.unsorted[4 * i + 1];
+    layer.sigmaPhi[h] = layer.unsorted[4 * i + 2];
+    layer.sigmaZR[h] = layer.unsorted[4 * i + 3];
+    layer.det[h] = layer.unsortedDets[i];
+  }
+  // Each offset now is the start of the next bin
+  std::copy_backward(layer.binOffsets.begin(), layer.binOffsets.end() - 2, layer.binOffsets.end() - 1);
+  layer.binOffsets[0] = 0;
+}
+
+//
+// Dets with a hit in the window of a state
+//
+bool TSGForOIHitIndex::compatibleDets(const DetLayer& detLayer,
+                                      const TrajectoryStateOnSurface& tsos,
+                                      const Propagator& propagator,
+                                      const Chi2MeasurementEstimatorBase& estimator,
+                                      std::vector<GeometricSearchDet::DetWithState>& dets,
+                                      TSGForOITiming& timing) const {
+  Layer* layer = nullptr;
+  for (unsigned int i = 0; i != nLayers_ && layer == nullptr; ++i)
+    if (layers_[i]->detLayer == &detLayer)
+      layer = layers_[i].get();
+  if (layer == nullptr)
+    return false;
+
+  // The first L2 asking for the layer reads its hits, the others wait for them
+  if (!layer->read.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> guard(layer->readMutex);
+    if (!layer->read.load(std::memory_order_relaxed)) {
+      TSGFOROI_TIMER(timer, timing.stages[TSGForOITiming::kHitIndex]);
+      readHits(*layer);
+      layer->read.store(true, std::memory_order_release);
+    }
+  }
+
+  TSGFOROI_TIMER(timer, timing.stages[TSGForOITiming::kCompatibleDets]);
+  if (layer->det.empty())
+    return true;
+
+  const TrajectoryStateOnSurface onSurface = propagator.propagate(tsos, detLayer.surface());
+  if (!onSurface.isValid() || !onSurface.hasError())
+    return true;
+  const std::array<float, 4> c =
+      coordinates(onSurface.globalPosition(), onSurface.cartesianError().position(), layer->barrel);
+
+  // Bins of the window, widened by the largest hit errors of the layer
+  const double phiWindow = nSigma_ * std::hypot(c[2], layer->maxSigmaPhi);
+  const double zrWindow = nSigma_ * std::hypot(c[3], layer->maxSigmaZR);
+  if (c[1] + zrWindow < layer->zrMin || c[1] - zrWindow > layer->zrMax)
+    return true;
+  int phiFirst = std::floor((c[0] - phiWindow + M_PI) * (kPhiBins / (2. * M_PI)));
+  int phiLast = std::floor((c[0] + phiWindow + M_PI) * (kPhiBins / (2. * M_PI)));
+  if (phiLast - phiFirst >= int(kPhiBins)) {
+    phiFirst = 0;
+    phiLast = kPhiBins - 1;
+  }
+  const unsigned int zrFirst = zrBin(*layer, c[1] - zrWindow);
+  const unsigned int zrLast = zrBin(*layer, c[1] + zrWindow);
+
+  // Hits in the window of their own errors and the state errors
+  const double nSigma2 = nSigma_ * nSigma_;
+  const std::size_t first = dets.size();
+  for (int p = phiFirst; p <= phiLast; ++p) {
+    const unsigned int bin = ((p % int(kPhiBins)) + kPhiBins) % kPhiBins * kZRBins;
+    for (unsigned int h = layer->binOffsets[bin + zrFirst]; h != layer->binOffsets[bin + zrLast + 1]; ++h) {
+      if (dets.size() > first && dets.back().first == layer->det[h])
+        continue;
+      const double dPhi = reco::deltaPhi(layer->phi[h], c[0]);
+      const double dZR = layer->zr[h] - c[1];
+      if (dPhi * dPhi < nSigma2 * (c[2] * c[2] + layer->sigmaPhi[h] * layer->sigmaPhi[h]) &&
+          dZR * dZR < nSigma2 * (c[3] * c[3] + layer->sigmaZR[h] * layer->sigmaZR[h]))
+        dets.emplace_back(layer->det[h], TrajectoryStateOnSurface());
+    }
+  }
+
+  // Each det once, in a reproducible order, with the state on it if compatible as for compatibleDetsV
+  std::sort(dets.begin() + first, dets.end(), [](const auto& a, const auto& b) {
+    return a.first->geographicalId().rawId() < b.first->geographicalId().rawId();
+  });
+  dets.erase(std::unique(dets.begin() + first,
+                         dets.end(),
+                         [](const auto& a, const auto& b) { return a.first == b.first; }),
+             dets.end());
+  auto out = dets.begin() + first;
+  for (auto it = dets.begin() + first; it != dets.end(); ++it) {
+    TrajectoryStateOnSurface onDet = propagator.propagate(tsos, it->first->surface());
+    if (!onDet.isValid() || !estimator.estimate(onDet, it->first->surface()))
+      continue;
+    *out++ = GeometricSearchDet::DetWithState(it->first, onDet);
+  }
+  dets.erase(out, dets.end());
+  return true;
+}
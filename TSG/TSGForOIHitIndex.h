@@ -0,0 +1,97 @@
+#ifndef RecoMuon_TrackerSeedGenerator_TSGForOIHitIndex_H
+#define RecoMuon_TrackerSeedGenerator_TSGForOIHitIndex_H
+
+/**
+ \class    TSGForOIHitIndex
+ \brief    Valid hits of the outer tracker layers of an event, binned in phi and z (barrel) or r (endcap)
+
+ The layers the hit-based OI seeds search are registered for each event, and the hits of a layer
+ are only read when the first L2 of the event asks for its dets: reading them builds the hits of
+ every active det of the whole layer, which unpacks its strip clusters if they are unpacked on
+ demand, so that layers no L2 seeds with hits cost nothing. The hits are built by their measurement
+ dets for a straight track from the origin, only to place them: the seeds still get their
+ measurements from the measurement dets, with the states of the L2's. The window of a state is a
+ box of nSigma standard deviations of the state and hit positions in both coordinates, which holds
+ every hit passing a chi2 cut of nSigma^2. The dets of a layer may be asked for concurrently.
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITiming.h"
+#include "RecoTracker/MeasurementDet/interface/MeasurementTrackerEvent.h"
+#include "TrackingTools/DetLayers/interface/DetLayer.h"
+#include "TrackingTools/GeomPropagators/interface/Propagator.h"
+#include "TrackingTools/KalmanUpdators/interface/Chi2MeasurementEstimator.h"
+#include "TrackingTools/TrajectoryState/interface/TrajectoryStateOnSurface.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class MagneticField;
+
+class TSGForOIHitIndex {
+public:
+  static constexpr unsigned int kPhiBins = 128;
+  static constexpr unsigned int kZRBins = 32;
+
+  /// Drop the layers of the previous event, keeping the capacity; the hits of this event are read
+  /// from measurementTracker, in windows of nSigma standard deviations
+  void clear(double nSigma, const MeasurementTrackerEvent& measurementTracker, const MagneticField* magfield);
+
+  /// Index the valid hits of a layer, once its dets are first asked for
+  void addLayer(const DetLayer& detLayer);
+
+  /// Dets of an indexed layer with a hit in the window of the state, with the state propagated to them,
+  /// if the estimator finds the state compatible with the det; false if the layer is not indexed.
+  /// Reading the hits of the layer, and the search, are timed as stages.
+  bool compatibleDets(const DetLayer& detLayer,
+                      const TrajectoryStateOnSurface& tsos,
+                      const Propagator& propagator,
+                      const Chi2MeasurementEstimatorBase& estimator,
+                      std::vector<GeometricSearchDet::DetWithState>& dets,
+                      TSGForOITiming& timing) const;
+
+  /// Number of indexed hits, in the layers read so far
+  unsigned int size() const;
+  /// Number of layers read so far
+  unsigned int layersRead() const;
+
+private:
+  /// Hits of one layer, sorted by bin, phi-major
+  struct Layer {
+    const DetLayer* detLayer = nullptr;
+    /// Whether the hits below are those of the current event
+    std::atomic<bool> read{false};
+    std::mutex readMutex;
+    bool barrel = true;
+    float zrMin = 0.f;
+    float zrMax = 0.f;
+    /// Largest hit errors, which widen the bin range of a window
+    float maxSigmaPhi = 0.f;
+    float maxSigmaZR = 0.f;
+    /// First hit of each bin, and the end of the last one
+    std::vector<unsigned int> binOffsets;
+    std::vector<float> phi;
+    std::vector<float> zr;
+    std::vector<float> sigmaPhi;
+    std::vector<float> sigmaZR;
+    std::vector<const GeomDet*> det;
+    /// Hits in the order they were read, and their bins
+    std::vector<unsigned int> unsortedBins;
+    std::vector<float> unsorted;
+    std::vector<const GeomDet*> unsortedDets;
+  };
+
+  /// Read and sort the hits of a layer
+  void readHits(Layer& layer) const;
+  unsigned int zrBin(const Layer& layer, float zr) const;
+
+  std::vector<std::unique_ptr<Layer> > layers_;
+  /// Layers of the current event, the first ones of layers_
+  unsigned int nLayers_ = 0;
+  double nSigma_ = 0.;
+  const MeasurementTrackerEvent* measurementTracker_ = nullptr;
+  const MagneticField* magfield_ = nullptr;
+};
+
+#endif
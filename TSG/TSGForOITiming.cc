@@ -0,0 +1,64 @@
+/**
+  \class    TSGForOITiming
+  \brief    Time and call count accumulators of the stages of the OI seeding
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITiming.h"
+
+#include <iomanip>
+#include <string>
+
+void TSGForOITiming::add(const TSGForOITiming& other) {
+  for (unsigned int i = 0; i != kNStages; ++i)
+    stages[i].add(other.stages[i]);
+  for (unsigned int r = 0; r != kNRegions; ++r)
+    for (unsigned int t = 0; t != kNSeedTypes; ++t)
+      seedMakers[r][t].add(other.seedMakers[r][t]);
+}
+
+std::vector<double> TSGForOITiming::seconds() const {
+  std::vector<double> result;
+  result.reserve(kNStages + kNRegions * kNSeedTypes);
+  for (const auto& stage : stages)
+    result.push_back(stage.seconds);
+  for (const auto& region : seedMakers)
+    for (const auto& seedMaker : region)
+      result.push_back(seedMaker.seconds);
+  return result;
+}
+
+void TSGForOITiming::print(std::ostream& os) const {
+  auto line = [&os](const std::string& name, const Counter& counter, bool withItems) {
+    os << std::left << std::setw(28) << name << std::right << std::setw(12) << counter.calls << std::setw(14)
+       << std::fixed << std::setprecision(3) << counter.seconds * 1e3 << std::setw(12)
+       << (counter.calls ? counter.seconds * 1e6 / counter.calls : 0.);
+    if (withItems)
+      os << std::setw(10) << counter.items;
+    os << "\n";
+  };
+  os << std::left << std::setw(28) << "stage" << std::right << std::setw(12) << "calls" << std::setw(14)
+     << "total [ms]" << std::setw(12) << "mean [us]" << std::setw(10) << "seeds"
+     << "\n";
+  for (unsigned int i = 0; i != kNStages; ++i)
+    line(stageName(Stage(i)), stages[i], false);
+  for (unsigned int r = 0; r != kNRegions; ++r)
+    for (unsigned int t = 0; t != kNSeedTypes; ++t)
+      line(std::string(regionName(Region(r))) + " " + seedTypeName(SeedType(t)), seedMakers[r][t], true);
+}
+
+const char* TSGForOITiming::stageName(Stage stage) {
+  static const char* const names[kNStages] = {
+      "IP states", "tracker bound states", "DNN", "compatibleDetsV", "fastMeasurements", "KFUpdator::update",
+      "hit index"};
+  return names[stage];
+}
+
+const char* TSGForOITiming::regionName(Region region) {
+  static const char* const names[kNRegions] = {"TOB", "TEC+", "TEC-"};
+  return names[region];
+}
+
+const char* TSGForOITiming::seedTypeName(SeedType seedType) {
+  static const char* const names[kNSeedTypes] = {"hitless IP", "hitless MuS", "hits", "hit doublets"};
+  return names[seedType];
+}
@@ -0,0 +1,81 @@
+#ifndef RecoMuon_TrackerSeedGenerator_TSGForOITiming_H
+#define RecoMuon_TrackerSeedGenerator_TSGForOITiming_H
+
+/**
+ \class    TSGForOITiming
+ \brief    Time and call count accumulators of the stages of the OI seeding
+
+ The timers are only compiled in with TSGFOROI_TIMING defined (see BuildFile.xml). Otherwise
+ TSGFOROI_TIMER expands to nothing, the accumulators stay empty and the module reports nothing.
+ Accumulators are filled per thread and per stream, and only summed at the end of each event.
+ */
+
+#include <array>
+#include <chrono>
+#include <ostream>
+#include <vector>
+
+struct TSGForOITiming {
+  enum Stage { kIPStates, kOuterTkStates, kDnn, kCompatibleDets, kFastMeasurements, kUpdate, kHitIndex, kNStages };
+  enum Region { kTOB, kTECPositive, kTECNegative, kNRegions };
+  enum SeedType { kHitlessIP, kHitlessMuS, kHits, kHitDoublets, kNSeedTypes };
+
+  struct Counter {
+    double seconds = 0.;
+    unsigned long long calls = 0;
+    /// Seeds made, for the seed makers
+    unsigned long long items = 0;
+
+    void add(const Counter& other) {
+      seconds += other.seconds;
+      calls += other.calls;
+      items += other.items;
+    }
+  };
+
+  std::array<Counter, kNStages> stages;
+  std::array<std::array<Counter, kNSeedTypes>, kNRegions> seedMakers;
+
+  void add(const TSGForOITiming& other);
+  void reset() { *this = TSGForOITiming(); }
+
+  /// Seconds of the stages, then of the seed makers (region-major), as stored in the per-event product
+  std::vector<double> seconds() const;
+
+  /// Table of all counters
+  void print(std::ostream& os) const;
+
+  static const char* stageName(Stage stage);
+  static const char* regionName(Region region);
+  static const char* seedTypeName(SeedType seedType);
+};
+
+#ifdef TSGFOROI_TIMING
+/// Adds the time spent in its scope, and the increase of a seed count if given, to a counter
+class TSGForOIScopedTimer {
+public:
+  explicit TSGForOIScopedTimer(TSGForOITiming::Counter& counter, const unsigned int* nItems = nullptr)
+      : counter_(counter), nItems_(nItems), items0_(nItems ? *nItems : 0), start_(std::chrono::steady_clock::now()) {}
+  ~TSGForOIScopedTimer() {
+    counter_.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    ++counter_.calls;
+    if (nItems_)
+      counter_.items += *nItems_ - items0_;
+  }
+
+  TSGForOIScopedTimer(const TSGForOIScopedTimer&) = delete;
+  TSGForOIScopedTimer& operator=(const TSGForOIScopedTimer&) = delete;
+
+private:
+  TSGForOITiming::Counter& counter_;
+  const unsigned int* nItems_;
+  const unsigned int items0_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+#define TSGFOROI_TIMER(name, ...) TSGForOIScopedTimer name(__VA_ARGS__)
+#else
+#define TSGFOROI_TIMER(name, ...)
+#endif
+
+#endif
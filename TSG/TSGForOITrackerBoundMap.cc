@@ -0,0 +1,162 @@
+/**
+  \class    TSGForOITrackerBoundMap
+  \brief    Parametrization of the propagation of the innermost muon-system state of an L2 to the tracker bound
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITrackerBoundMap.h"
+#include "DataFormats/Math/interface/deltaPhi.h"
+#include "FWCore/Utilities/interface/Exception.h"
+#include "TrackingTools/GeomPropagators/interface/TrackerBounds.h"
+
+#include <TFile.h>
+#include <TH1D.h>
+#include <TH2F.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+TSGForOITrackerBoundMap::TSGForOITrackerBoundMap(
+    unsigned int nEta, double maxEta, unsigned int nPhi, unsigned int nQoverPt, double maxQoverPt)
+    : nEta_(nEta),
+      maxEta_(maxEta),
+      nPhi_(nPhi),
+      nQoverPt_(nQoverPt),
+      maxQoverPt_(maxQoverPt),
+      parameters_(nBins() * kNParameters, 0.f) {}
+
+TSGForOITrackerBoundMap::TSGForOITrackerBoundMap(const std::string& path) {
+  std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+  if (!file || file->IsZombie())
+    throw cms::Exception("TSGForOITrackerBoundMap") << "cannot open " << path;
+  const TH1D* binning = dynamic_cast<const TH1D*>(file->Get("binning"));
+  const TH2F* parameters = dynamic_cast<const TH2F*>(file->Get("parameters"));
+  if (binning == nullptr || parameters == nullptr || binning->GetNbinsX() != 6 ||
+      binning->GetBinContent(6) != kNParameters)
+    throw cms::Exception("TSGForOITrackerBoundMap") << path << " is not a tracker bound map of this layout";
+  nEta_ = binning->GetBinContent(1);
+  maxEta_ = binning->GetBinContent(2);
+  nPhi_ = binning->GetBinContent(3);
+  nQoverPt_ = binning->GetBinContent(4);
+  maxQoverPt_ = binning->GetBinContent(5);
+  if (parameters->GetNbinsX() != int(nBins()) || parameters->GetNbinsY() != kNParameters)
+    throw cms::Exception("TSGForOITrackerBoundMap") << path << ": parameters do not match the binning";
+  parameters_.resize(nBins() * kNParameters);
+  for (unsigned int bin = 0; bin != nBins(); ++bin)
+    for (unsigned int i = 0; i != kNParameters; ++i)
+      parameters_[bin * kNParameters + i] = parameters->GetBinContent(bin + 1, i + 1);
+}
+
+int TSGForOITrackerBoundMap::bin(const TrajectoryStateOnSurface& tsos) const {
+  const GlobalPoint pos = tsos.globalPosition();
+  const double eta = pos.eta();
+  const double qoverPt = tsos.charge() / tsos.globalMomentum().perp();
+  if (std::abs(eta) >= maxEta_ || std::abs(qoverPt) >= maxQoverPt_)
+    return -1;
+  const int iEta = std::min<int>((eta + maxEta_) / (2. * maxEta_) * nEta_, nEta_ - 1);
+  const int iPhi = std::min<int>(std::max<int>((pos.barePhi() + M_PI) / (2. * M_PI) * nPhi_, 0), nPhi_ - 1);
+  const int iQoverPt = std::min<int>((qoverPt + maxQoverPt_) / (2. * maxQoverPt_) * nQoverPt_, nQoverPt_ - 1);
+  return (iEta * nPhi_ + iPhi) * nQoverPt_ + iQoverPt;
+}
+
+double TSGForOITrackerBoundMap::qoverPtCentre(unsigned int bin) const {
+  return -maxQoverPt_ + (bin % nQoverPt_ + 0.5) * 2. * maxQoverPt_ / nQoverPt_;
+}
+
+//
+// State at the tracker bound from the parameters of the bin
+//
+TrajectoryStateOnSurface TSGForOITrackerBoundMap::propagate(const TrajectoryStateOnSurface& tsosAtMuonSystem,
+                                                            const MagneticField* magfield,
+                                                            unsigned int minEntries) const {
+  if (!tsosAtMuonSystem.isValid())
+    return TrajectoryStateOnSurface();
+  const int b = bin(tsosAtMuonSystem);
+  if (b < 0)
+    return TrajectoryStateOnSurface();
+  const float* par = parameters(b);
+  const GlobalPoint x = tsosAtMuonSystem.globalPosition();
+  const GlobalVector p = tsosAtMuonSystem.globalMomentum();
+  const double r = x.mag();
+  if (par[kEntries] < std::max(1U, minEntries) || r < par[kRMin] || r > par[kRMax])
+    return TrajectoryStateOnSurface();
+
+  const double qoverPt = tsosAtMuonSystem.charge() / p.perp();
+  const std::array<double, kNRegressors> u = {{1., qoverPt - qoverPtCentre(b), r - par[kRMean]}};
+  std::array<double, kNDeltas> d;
+  for (unsigned int i = 0; i != kNDeltas; ++i) {
+    d[i] = 0.;
+    for (unsigned int j = 0; j != kNRegressors; ++j)
+      d[i] += par[kCoefficients + i * kNRegressors + j] * u[j];
+  }
+  const double posTheta = x.theta() + d[kPositionTheta];
+  const double momTheta = p.theta() + d[kMomentumTheta];
+  if (posTheta <= 0. || posTheta >= M_PI || momTheta <= 0. || momTheta >= M_PI || d[kMomentumRatio] <= 0.)
+    return TrajectoryStateOnSurface();
+
+  // Where the direction of the position crosses the tracker bound
+  const double radius = TrackerBounds::radius(), halfLength = TrackerBounds::halfLength();
+  const double posPhi = x.barePhi() + d[kPositionPhi];
+  const double sinTheta = std::sin(posTheta), cosTheta = std::cos(posTheta);
+  const bool barrel = std::abs(radius * cosTheta) <= halfLength * sinTheta;
+  const double rho = barrel ? radius : halfLength * sinTheta / std::abs(cosTheta);
+  const double z = barrel ? radius * cosTheta / sinTheta : std::copysign(halfLength, cosTheta);
+  const GlobalPoint pos(rho * std::cos(posPhi), rho * std::sin(posPhi), z);
+  const double mag = p.mag() * d[kMomentumRatio], momPhi = p.barePhi() + d[kMomentumPhi];
+  const GlobalVector mom(mag * std::sin(momTheta) * std::cos(momPhi),
+                         mag * std::sin(momTheta) * std::sin(momPhi),
+                         mag * std::cos(momTheta));
+  const Surface& surface = barrel ? static_cast<const Surface&>(TrackerBounds::barrelBound())
+                                  : (z > 0. ? static_cast<const Surface&>(TrackerBounds::positiveEndcapDisk())
+                                            : static_cast<const Surface&>(TrackerBounds::negativeEndcapDisk()));
+  const GlobalTrajectoryParameters gtp(pos, mom, tsosAtMuonSystem.charge(), magfield);
+  if (!tsosAtMuonSystem.hasError())
+    return TrajectoryStateOnSurface(gtp, surface);
+
+  // Curvilinear errors transported with the mean Jacobian, plus the mean material noise
+  AlgebraicMatrix55 jacobian;
+  AlgebraicSymMatrix55 noise;
+  for (unsigned int i = 0, k = 0; i != 5; ++i) {
+    for (unsigned int j = 0; j != 5; ++j)
+      jacobian(i, j) = par[kJacobian + 5 * i + j];
+    for (unsigned int j = 0; j <= i; ++j, ++k)
+      noise(i, j) = par[kNoise + k];
+  }
+  const AlgebraicSymMatrix55 cov =
+      ROOT::Math::Similarity(jacobian, tsosAtMuonSystem.curvilinearError().matrix()) + noise;
+  for (unsigned int i = 0; i != 5; ++i)
+    if (!(cov(i, i) > 0.))
+      return TrajectoryStateOnSurface();
+  return TrajectoryStateOnSurface(gtp, CurvilinearTrajectoryError(cov), surface);
+}
+
+void TSGForOITrackerBoundMap::write(const std::string& path) const {
+  std::unique_ptr<TFile> file(TFile::Open(path.c_str(), "RECREATE"));
+  if (!file || file->IsZombie())
+    throw cms::Exception("TSGForOITrackerBoundMap") << "cannot write " << path;
+  TH1D binning("binning", "nEta, maxEta, nPhi, nQoverPt, maxQoverPt, nParameters", 6, 0., 6.);
+  binning.SetBinContent(1, nEta_);
+  binning.SetBinContent(2, maxEta_);
+  binning.SetBinContent(3, nPhi_);
+  binning.SetBinContent(4, nQoverPt_);
+  binning.SetBinContent(5, maxQoverPt_);
+  binning.SetBinContent(6, kNParameters);
+  TH2F parameters("parameters", "bin, parameter", nBins(), 0., nBins(), kNParameters, 0., kNParameters);
+  for (unsigned int bin = 0; bin != nBins(); ++bin)
+    for (unsigned int i = 0; i != kNParameters; ++i)
+      parameters.SetBinContent(bin + 1, i + 1, parameters_[bin * kNParameters + i]);
+  binning.Write();
+  parameters.Write();
+  file->Close();
+}
+
+std::array<double, TSGForOITrackerBoundMap::kNDeltas> TSGForOITrackerBoundMap::deltas(
+    const FreeTrajectoryState& atMuonSystem, const FreeTrajectoryState& atTrackerBound) {
+  std::array<double, kNDeltas> d;
+  d[kPositionPhi] = reco::deltaPhi(atTrackerBound.position().barePhi(), atMuonSystem.position().barePhi());
+  d[kPositionTheta] = atTrackerBound.position().theta() - atMuonSystem.position().theta();
+  d[kMomentumPhi] = reco::deltaPhi(atTrackerBound.momentum().barePhi(), atMuonSystem.momentum().barePhi());
+  d[kMomentumTheta] = atTrackerBound.momentum().theta() - atMuonSystem.momentum().theta();
+  d[kMomentumRatio] = atTrackerBound.momentum().mag() / atMuonSystem.momentum().mag();
+  return d;
+}
@@ -0,0 +1,81 @@
+#ifndef RecoMuon_TrackerSeedGenerator_TSGForOITrackerBoundMap_H
+#define RecoMuon_TrackerSeedGenerator_TSGForOITrackerBoundMap_H
+
+/**
+ \class    TSGForOITrackerBoundMap
+ \brief    Parametrization of the propagation of the innermost muon-system state of an L2 to the tracker bound
+
+ Replaces the stepping helix propagation of OuterTkStates::outside() by a table, binned in eta and phi
+ of the position and in q/pT of the momentum of the muon-system state. In each bin, five differences
+ between the state at the tracker bound and the muon-system state (azimuth and polar angle of the
+ position and of the momentum, momentum ratio) are linear in q/pT and in the distance of the
+ muon-system state to the origin, and the curvilinear errors are transported as J C J^T + Q, with
+ the mean Jacobian J and material noise Q of the bin. The state is placed where the direction of
+ its position crosses the tracker bound.
+
+ Written by TSGForOITrackerBoundMapMaker from the L2's of a sample, with the propagator and field of
+ its conditions, as a ROOT file with a "binning" TH1D and a "parameters" TH2F (bins x parameters).
+ */
+
+#include "MagneticField/Engine/interface/MagneticField.h"
+#include "TrackingTools/TrajectoryState/interface/TrajectoryStateOnSurface.h"
+
+#include <array>
+#include <string>
+#include <vector>
+
+class TSGForOITrackerBoundMap {
+public:
+  /// Differences between the states at the tracker bound and in the muon system
+  enum Delta { kPositionPhi, kPositionTheta, kMomentumPhi, kMomentumTheta, kMomentumRatio, kNDeltas };
+  /// Regressors of the differences: constant, q/pT from the bin centre, distance from the bin mean
+  static constexpr unsigned int kNRegressors = 3;
+  /// Parameters of a bin
+  enum Parameter : unsigned int {
+    kEntries,
+    kRMean,
+    kRMin,
+    kRMax,
+    kCoefficients,
+    kJacobian = kCoefficients + kNDeltas * kNRegressors,
+    kNoise = kJacobian + 25,
+    kNParameters = kNoise + 15
+  };
+
+  /// Empty table, for the maker
+  TSGForOITrackerBoundMap(
+      unsigned int nEta, double maxEta, unsigned int nPhi, unsigned int nQoverPt, double maxQoverPt);
+  /// Table read from a file
+  explicit TSGForOITrackerBoundMap(const std::string& path);
+
+  /// Bin of a muon-system state, -1 out of the table
+  int bin(const TrajectoryStateOnSurface& tsos) const;
+  unsigned int nBins() const { return nEta_ * nPhi_ * nQoverPt_; }
+  /// q/pT at the centre of a bin
+  double qoverPtCentre(unsigned int bin) const;
+
+  /// State at the tracker bound, invalid if the muon-system state is out of the table, in a bin with
+  /// fewer than minEntries entries, or farther from the origin than the states of its bin were
+  TrajectoryStateOnSurface propagate(const TrajectoryStateOnSurface& tsosAtMuonSystem,
+                                     const MagneticField* magfield,
+                                     unsigned int minEntries) const;
+
+  float* parameters(unsigned int bin) { return &parameters_[bin * kNParameters]; }
+  const float* parameters(unsigned int bin) const { return &parameters_[bin * kNParameters]; }
+
+  void write(const std::string& path) const;
+
+  /// Differences between a state at the tracker bound and the muon-system state it was propagated from
+  static std::array<double, kNDeltas> deltas(const FreeTrajectoryState& atMuonSystem,
+                                             const FreeTrajectoryState& atTrackerBound);
+
+private:
+  unsigned int nEta_;
+  double maxEta_;
+  unsigned int nPhi_;
+  unsigned int nQoverPt_;
+  double maxQoverPt_;
+  std::vector<float> parameters_;
+};
+
+#endif
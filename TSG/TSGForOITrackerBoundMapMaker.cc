@@ -0,0 +1,203 @@
+/**
+  \class    TSGForOITrackerBoundMapMaker
+  \brief    Fill the TSGForOITrackerBoundMap of TSGForOIFromL2 from the L2's of a sample
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITrackerBoundMapMaker.h"
+#include "DataFormats/Math/interface/deltaPhi.h"
+#include "TrackingTools/GeomPropagators/interface/StateOnTrackerBound.h"
+#include "TrackingTools/TrajectoryState/interface/TrajectoryStateTransform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+  // Shifts of the curvilinear parameters q/p (relative), lambda, phi, xT and yT for the Jacobian
+  constexpr std::array<double, 5> kSteps = {{1e-3, 1e-4, 1e-4, 1e-2, 1e-2}};
+
+  // Unit vectors of the curvilinear frame of a momentum, across it in the transverse plane and above it
+  std::array<GlobalVector, 2> curvilinearFrame(const GlobalVector& p) {
+    const double phi = p.barePhi(), lambda = M_PI_2 - p.theta();
+    return {{GlobalVector(-std::sin(phi), std::cos(phi), 0.),
+             GlobalVector(-std::sin(lambda) * std::cos(phi), -std::sin(lambda) * std::sin(phi), std::cos(lambda))}};
+  }
+
+  // State with one curvilinear parameter shifted
+  FreeTrajectoryState shifted(const FreeTrajectoryState& fts, unsigned int i, double step, const MagneticField* field) {
+    double qoverp = fts.signedInverseMomentum();
+    double lambda = M_PI_2 - fts.momentum().theta();
+    double phi = fts.momentum().barePhi();
+    GlobalPoint x = fts.position();
+    const std::array<GlobalVector, 2> frame = curvilinearFrame(fts.momentum());
+    if (i == 0)
+      qoverp += step;
+    else if (i == 1)
+      lambda += step;
+    else if (i == 2)
+      phi += step;
+    else
+      x += step * frame[i - 3];
+    const double p = 1. / std::abs(qoverp);
+    const GlobalVector mom(
+        p * std::cos(lambda) * std::cos(phi), p * std::cos(lambda) * std::sin(phi), p * std::sin(lambda));
+    return FreeTrajectoryState(GlobalTrajectoryParameters(x, mom, fts.charge(), field));
+  }
+
+  // Curvilinear parameters of a state less those of a reference, in the frame of the reference
+  std::array<double, 5> curvilinearDifference(const FreeTrajectoryState& fts, const FreeTrajectoryState& ref) {
+    const std::array<GlobalVector, 2> frame = curvilinearFrame(ref.momentum());
+    const GlobalVector dx = fts.position() - ref.position();
+    return {{fts.signedInverseMomentum() - ref.signedInverseMomentum(),
+             ref.momentum().theta() - fts.momentum().theta(),
+             reco::deltaPhi(fts.momentum().barePhi(), ref.momentum().barePhi()),
+             dx.dot(frame[0]),
+             dx.dot(frame[1])}};
+  }
+}  // namespace
+
+TSGForOITrackerBoundMapMaker::TSGForOITrackerBoundMapMaker(const edm::ParameterSet& iConfig)
+    : src_(consumes<reco::TrackCollection>(iConfig.getParameter<edm::InputTag>("src"))),
+      magfieldToken_(esConsumes<MagneticField, IdealMagneticFieldRecord>()),
+      geometryToken_(esConsumes<GlobalTrackingGeometry, GlobalTrackingGeometryRecord>()),
+      propagatorToken_(esConsumes<Propagator, TrackingComponentsRecord>(
+          edm::ESInputTag("", iConfig.getParameter<std::string>("propagatorName")))),
+      fileName_(iConfig.getParameter<std::string>("fileName")),
+      map_(iConfig.getParameter<uint32_t>("nEta"),
+           iConfig.getParameter<double>("maxEta"),
+           iConfig.getParameter<uint32_t>("nPhi"),
+           iConfig.getParameter<uint32_t>("nQoverPt"),
+           iConfig.getParameter<double>("maxQoverPt")),
+      sums_(map_.nBins()),
+      theCategory_(std::string("Muon|RecoMuon|TSGForOITrackerBoundMapMaker")) {}
+
+TSGForOITrackerBoundMapMaker::~TSGForOITrackerBoundMapMaker() {}
+
+//
+// Add the propagation of each L2 to the sums of its bin
+//
+void TSGForOITrackerBoundMapMaker::analyze(const edm::Event& iEvent, const edm::EventSetup& iSetup) {
+  const MagneticField* magfield = &iSetup.getData(magfieldToken_);
+  const GlobalTrackingGeometry& geometry = iSetup.getData(geometryToken_);
+  StateOnTrackerBound fromOutside(&iSetup.getData(propagatorToken_));
+
+  edm::Handle<reco::TrackCollection> l2TrackCol;
+  iEvent.getByToken(src_, l2TrackCol);
+  for (const reco::Track& l2 : *l2TrackCol) {
+    const TrajectoryStateOnSurface tsosAtMuonSystem =
+        trajectoryStateTransform::innerStateOnSurface(l2, geometry, magfield);
+    if (!tsosAtMuonSystem.isValid())
+      continue;
+    const int bin = map_.bin(tsosAtMuonSystem);
+    if (bin < 0)
+      continue;
+    const TrajectoryStateOnSurface outside = fromOutside(tsosAtMuonSystem);
+    if (!outside.isValid())
+      continue;
+
+    Sums& s = sums_[bin];
+    const FreeTrajectoryState& in = *tsosAtMuonSystem.freeState();
+    const double q = tsosAtMuonSystem.charge() / tsosAtMuonSystem.globalMomentum().perp() - map_.qoverPtCentre(bin);
+    const double r = tsosAtMuonSystem.globalPosition().mag();
+    s.rMin = s.n > 0. ? std::min(s.rMin, r) : r;
+    s.rMax = s.n > 0. ? std::max(s.rMax, r) : r;
+    s.n += 1.;
+    s.q += q;
+    s.r += r;
+    s.qq += q * q;
+    s.rr += r * r;
+    s.qr += q * r;
+    const auto y = TSGForOITrackerBoundMap::deltas(in, *outside.freeState());
+    for (unsigned int i = 0; i != y.size(); ++i) {
+      s.y[i] += y[i];
+      s.qy[i] += q * y[i];
+      s.ry[i] += r * y[i];
+    }
+
+    // Jacobian by finite differences, from shifted states crossing the same surface
+    AlgebraicMatrix55 jacobian;
+    bool sameSurface = true;
+    for (unsigned int j = 0; j != 5 && sameSurface; ++j) {
+      const double step = j == 0 ? kSteps[0] * std::abs(in.signedInverseMomentum()) : kSteps[j];
+      const TrajectoryStateOnSurface shiftedOutside = fromOutside(shifted(in, j, step, magfield));
+      sameSurface = shiftedOutside.isValid() && &shiftedOutside.surface() == &outside.surface();
+      if (!sameSurface)
+        break;
+      const std::array<double, 5> d = curvilinearDifference(*shiftedOutside.freeState(), *outside.freeState());
+      for (unsigned int i = 0; i != 5; ++i)
+        jacobian(i, j) = d[i] / step;
+    }
+    if (!sameSurface)
+      continue;
+    s.nJacobian += 1.;
+    for (unsigned int i = 0; i != 25; ++i)
+      s.jacobian[i] += jacobian(i / 5, i % 5);
+    if (!tsosAtMuonSystem.hasError() || !outside.hasError())
+      continue;
+    const AlgebraicSymMatrix55 noise =
+        outside.curvilinearError().matrix() -
+        ROOT::Math::Similarity(jacobian, tsosAtMuonSystem.curvilinearError().matrix());
+    s.nNoise += 1.;
+    for (unsigned int i = 0, k = 0; i != 5; ++i)
+      for (unsigned int j = 0; j <= i; ++j, ++k)
+        s.noise[k] += noise(i, j);
+  }
+}
+
+//
+// Fit the differences in each bin and write the map
+//
+void TSGForOITrackerBoundMapMaker::endJob() {
+  unsigned int filled = 0;
+  double entries = 0.;
+  for (unsigned int bin = 0; bin != sums_.size(); ++bin) {
+    const Sums& s = sums_[bin];
+    float* par = map_.parameters(bin);
+    if (s.n == 0. || s.nJacobian == 0.)
+      continue;
+    ++filled;
+    entries += s.n;
+    const double qMean = s.q / s.n, rMean = s.r / s.n;
+    par[TSGForOITrackerBoundMap::kEntries] = s.n;
+    par[TSGForOITrackerBoundMap::kRMean] = rMean;
+    par[TSGForOITrackerBoundMap::kRMin] = s.rMin;
+    par[TSGForOITrackerBoundMap::kRMax] = s.rMax;
+
+    // Least squares of each difference, linear in the regressors; a regressor without spread
+    // (one L2, or states all on the same station) gets no slope
+    const double vqq = s.qq / s.n - qMean * qMean + 1e-12, vrr = s.rr / s.n - rMean * rMean + 1e-6;
+    const double vqr = s.qr / s.n - qMean * rMean, det = vqq * vrr - vqr * vqr;
+    for (unsigned int i = 0; i != TSGForOITrackerBoundMap::kNDeltas; ++i) {
+      const double yMean = s.y[i] / s.n;
+      const double vqy = s.qy[i] / s.n - qMean * yMean, vry = s.ry[i] / s.n - rMean * yMean;
+      const double slopeQ = det > 0. ? (vrr * vqy - vqr * vry) / det : 0.;
+      const double slopeR = det > 0. ? (vqq * vry - vqr * vqy) / det : 0.;
+      float* coefficients = par + TSGForOITrackerBoundMap::kCoefficients + i * TSGForOITrackerBoundMap::kNRegressors;
+      coefficients[0] = yMean - slopeQ * qMean;
+      coefficients[1] = slopeQ;
+      coefficients[2] = slopeR;
+    }
+    for (unsigned int i = 0; i != 25; ++i)
+      par[TSGForOITrackerBoundMap::kJacobian + i] = s.jacobian[i] / s.nJacobian;
+    for (unsigned int i = 0; i != 15 && s.nNoise > 0.; ++i)
+      par[TSGForOITrackerBoundMap::kNoise + i] = s.noise[i] / s.nNoise;
+  }
+  map_.write(fileName_);
+  edm::LogVerbatim(theCategory_) << "TSGForOITrackerBoundMapMaker: " << entries << " L2's in " << filled << " of "
+                                 << sums_.size() << " bins, written to " << fileName_;
+}
+
+void TSGForOITrackerBoundMapMaker::fillDescriptions(edm::ConfigurationDescriptions& descriptions) {
+  edm::ParameterSetDescription desc;
+  desc.add<edm::InputTag>("src", edm::InputTag("hltL2Muons", "UpdatedAtVtx"));
+  desc.add<std::string>("propagatorName", "hltESPSteppingHelixPropagatorOpposite");
+  desc.add<std::string>("fileName", "trackerBoundMap.root");
+  desc.add<uint32_t>("nEta", 48);
+  desc.add<double>("maxEta", 2.4);
+  desc.add<uint32_t>("nPhi", 12);
+  desc.add<uint32_t>("nQoverPt", 20);
+  desc.add<double>("maxQoverPt", 0.5);
+  descriptions.add("TSGForOITrackerBoundMapMaker", desc);
+}
+
+DEFINE_FWK_MODULE(TSGForOITrackerBoundMapMaker);
@@ -0,0 +1,72 @@
+#ifndef RecoMuon_TrackerSeedGenerator_TSGForOITrackerBoundMapMaker_H
+#define RecoMuon_TrackerSeedGenerator_TSGForOITrackerBoundMapMaker_H
+
+/**
+ \class    TSGForOITrackerBoundMapMaker
+ \brief    Fill the TSGForOITrackerBoundMap of TSGForOIFromL2 from the L2's of a sample
+
+ Propagates the innermost muon-system state of each L2 to the tracker bound as TSGForOIFromL2 does,
+ with the same propagator, and fits in each bin the differences between the two states. The
+ Jacobian of each propagation is taken from five more propagations of the state, each shifted in one
+ curvilinear parameter, and the material noise is what the propagated errors have beyond the
+ transported ones. The map is written at the end of the job.
+ */
+
+#include "DataFormats/TrackReco/interface/Track.h"
+#include "FWCore/Framework/interface/one/EDAnalyzer.h"
+#include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/EventSetup.h"
+#include "FWCore/Framework/interface/MakerMacros.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+#include "FWCore/ParameterSet/interface/ParameterSet.h"
+#include "FWCore/Utilities/interface/ESGetToken.h"
+#include "Geometry/CommonDetUnit/interface/GlobalTrackingGeometry.h"
+#include "Geometry/Records/interface/GlobalTrackingGeometryRecord.h"
+#include "MagneticField/Engine/interface/MagneticField.h"
+#include "MagneticField/Records/interface/IdealMagneticFieldRecord.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOITrackerBoundMap.h"
+#include "TrackingTools/GeomPropagators/interface/Propagator.h"
+#include "TrackingTools/Records/interface/TrackingComponentsRecord.h"
+
+#include <array>
+#include <string>
+#include <vector>
+
+class TSGForOITrackerBoundMapMaker : public edm::one::EDAnalyzer<> {
+public:
+  explicit TSGForOITrackerBoundMapMaker(const edm::ParameterSet& iConfig);
+  ~TSGForOITrackerBoundMapMaker() override;
+  static void fillDescriptions(edm::ConfigurationDescriptions& descriptions);
+  void analyze(const edm::Event& iEvent, const edm::EventSetup& iSetup) override;
+  void endJob() override;
+
+private:
+  /// Sums over the L2's of a bin
+  struct Sums {
+    double n = 0.;
+    /// Regressors q/pT from the bin centre and distance to the origin, and their products
+    double q = 0., r = 0., qq = 0., rr = 0., qr = 0.;
+    double rMin = 0., rMax = 0.;
+    std::array<double, TSGForOITrackerBoundMap::kNDeltas> y{}, qy{}, ry{};
+    /// L2's with a Jacobian, and those of them with errors
+    double nJacobian = 0., nNoise = 0.;
+    std::array<double, 25> jacobian{};
+    std::array<double, 15> noise{};
+  };
+
+  /// L2 muons updated at vertex, as seeded by TSGForOIFromL2
+  const edm::EDGetTokenT<reco::TrackCollection> src_;
+
+  const edm::ESGetToken<MagneticField, IdealMagneticFieldRecord> magfieldToken_;
+  const edm::ESGetToken<GlobalTrackingGeometry, GlobalTrackingGeometryRecord> geometryToken_;
+  /// Propagator of the muon-system states of TSGForOIFromL2
+  const edm::ESGetToken<Propagator, TrackingComponentsRecord> propagatorToken_;
+
+  const std::string fileName_;
+  TSGForOITrackerBoundMap map_;
+  std::vector<Sums> sums_;
+
+  const std::string theCategory_;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+# Convert a frozen OI seeding strategy DNN graph to ONNX, for the onnx backend of TSGForOIFromL2.
+# The input and output names of the graph, read from the 'layer_names' histogram of the metadata,
+# are kept, so that the same metadata serves both models. The batch dimension stays dynamic.
+#
+#   python3 convertStrategyDnnToOnnx.py dnn_5_seeds_0.pb metadata_5_seeds.root dnn_5_seeds_0.onnx
+
+import argparse
+
+import ROOT
+import tensorflow as tf
+import tf2onnx
+
+parser = argparse.ArgumentParser(description='Convert a frozen OI seeding strategy DNN to ONNX')
+parser.add_argument('graph', help='frozen graph (.pb)')
+parser.add_argument('metadata', help='metadata of the DNN (.root)')
+parser.add_argument('output', help='ONNX model to write (.onnx)')
+parser.add_argument('--opset', type=int, default=11, help='ONNX opset, 11 is supported by the ONNX Runtime of CMSSW_11_2_0')
+args = parser.parse_args()
+
+metadata = ROOT.TFile.Open(args.metadata)
+layerNames = metadata.Get('layer_names')
+inputLayer = layerNames.GetXaxis().GetBinLabel(1)
+outputLayer = layerNames.GetXaxis().GetBinLabel(2)
+metadata.Close()
+
+graphDef = tf.compat.v1.GraphDef()
+with open(args.graph, 'rb') as f:
+    graphDef.ParseFromString(f.read())
+
+# ONNX tensor names of the graph nodes are '<node>:0'; rename them back to the node names
+model, _ = tf2onnx.convert.from_graph_def(graphDef,
+                                          input_names=[inputLayer + ':0'],
+                                          output_names=[outputLayer + ':0'],
+                                          opset=args.opset)
+for tensor in list(model.graph.input) + list(model.graph.output):
+    name = tensor.name.rsplit(':', 1)[0]
+    for node in model.graph.node:
+        node.input[:] = [name if i == tensor.name else i for i in node.input]
+        node.output[:] = [name if o == tensor.name else o for o in node.output]
+    tensor.name = name
+
+with open(args.output, 'wb') as f:
+    f.write(model.SerializeToString())
+print('Wrote %s: input %s, output %s' % (args.output, inputLayer, outputLayer))
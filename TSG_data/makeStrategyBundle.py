@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+# Build the strategy bundle of TSGForOIFromL2 (dnnBundlePath) from the frozen graphs and metadata files.
+# The dense layers are extracted as OIStrategyMLP does: batch normalization and other elementwise affine
+# operations are folded into the adjacent dense layers. See OIStrategyBundle.h for the file layout.
+#
+#   python3 makeStrategyBundle.py oi_strategy.bundle \
+#       barrel:dnn_5_seeds_0.pb:metadata_5_seeds.root endcap:dnn_7_seeds_0.pb:metadata_7_seeds.root
+
+import argparse
+import struct
+
+import numpy as np
+
+MAGIC = b'OISBNDL2'
+ALIGNMENT = 64
+PADDING = 16
+ACTIVATIONS = {'Linear': 0, 'Relu': 1, 'Tanh': 2, 'Sigmoid': 3}
+
+
+def read_metadata(path):
+    import ROOT
+    f = ROOT.TFile.Open(path)
+    inputOrder = f.Get('input_order')
+    layerNames = f.Get('layer_names')
+    scheme = f.Get('scheme')
+    inputs = [inputOrder.GetXaxis().GetBinLabel(i + 1) for i in range(inputOrder.GetXaxis().GetNbins())]
+    decoder = [[int(scheme.GetBinContent(j + 1, c + 1)) for j in range(3)] for c in range(scheme.GetYaxis().GetNbins())]
+    result = (inputs, layerNames.GetXaxis().GetBinLabel(1), layerNames.GetXaxis().GetBinLabel(2), decoder)
+    f.Close()
+    return result
+
+
+def extract_layers(graphPath, inputLayer, outputLayer):
+    import tensorflow as tf
+
+    graphDef = tf.compat.v1.GraphDef()
+    with open(graphPath, 'rb') as f:
+        graphDef.ParseFromString(f.read())
+    nodes = {n.name: n for n in graphDef.node}
+
+    def node_name(i):
+        return i.lstrip('^').split(':')[0]
+
+    def data_inputs(n):
+        return [node_name(i) for i in n.input if not i.startswith('^')]
+
+    constants = {}
+
+    def is_constant(name):
+        if name not in constants:
+            n = nodes[name]
+            if n.op == 'Const':
+                constants[name] = True
+            elif n.op == 'Placeholder':
+                constants[name] = False
+            else:
+                inputs = data_inputs(n)
+                constants[name] = bool(inputs) and all(is_constant(i) for i in inputs)
+        return constants[name]
+
+    def value(name):
+        n = nodes[name]
+        inputs = data_inputs(n)
+        if n.op == 'Const':
+            return tf.make_ndarray(n.attr['value'].tensor).astype(np.float32)
+        if n.op == 'Identity':
+            return value(inputs[0])
+        if n.op == 'Rsqrt':
+            return 1. / np.sqrt(value(inputs[0]))
+        if n.op == 'Sqrt':
+            return np.sqrt(value(inputs[0]))
+        a, b = value(inputs[0]).ravel(), value(inputs[1]).ravel()
+        ops = {'Add': np.add, 'AddV2': np.add, 'Sub': np.subtract, 'Mul': np.multiply, 'RealDiv': np.divide}
+        if n.op not in ops:
+            raise RuntimeError('Unsupported constant operation %s in %s' % (n.op, name))
+        return ops[n.op](a, b).astype(np.float32)
+
+    # Walk back from the output to the input along the non-constant inputs
+    path = []
+    name = node_name(outputLayer)
+    while name != node_name(inputLayer):
+        path.append(nodes[name])
+        nonConstant = [i for i in data_inputs(nodes[name]) if not is_constant(i)]
+        if len(nonConstant) != 1:
+            raise RuntimeError('Node %s does not have exactly one non-constant input' % name)
+        name = nonConstant[0]
+    path.reverse()
+
+    # Dense layers, with the pending elementwise affine operation x -> scale*x + shift
+    layers = []
+    scale, shift = np.ones(1, np.float32), np.zeros(1, np.float32)
+    activated = True
+    for n in path:
+        inputs = data_inputs(n)
+        if n.op == 'Identity':
+            continue
+        elif n.op == 'MatMul':
+            if n.attr['transpose_a'].b or is_constant(inputs[0]):
+                raise RuntimeError('Unsupported MatMul layout in %s' % n.name)
+            kernel = value(inputs[1])
+            if n.attr['transpose_b'].b:
+                kernel = kernel.T
+            nIn = kernel.shape[0]
+            s, t = np.broadcast_to(scale, nIn), np.broadcast_to(shift, nIn)
+            layers.append({'weights': s[:, None] * kernel, 'bias': t @ kernel, 'activation': 'Linear'})
+            scale, shift = np.ones(1, np.float32), np.zeros(1, np.float32)
+            activated = False
+        elif n.op in ('BiasAdd', 'Add', 'AddV2', 'Sub', 'Mul'):
+            dataFirst = not is_constant(inputs[0])
+            c = value(inputs[1 if dataFirst else 0]).ravel()
+            if not activated:
+                # Pre-activation: modify the open dense layer directly
+                layer = layers[-1]
+                if n.op == 'Mul':
+                    layer['weights'] = layer['weights'] * c[None, :]
+                    layer['bias'] = layer['bias'] * c
+                else:
+                    if n.op == 'Sub' and not dataFirst:
+                        layer['weights'], layer['bias'] = -layer['weights'], -layer['bias']
+                    layer['bias'] = layer['bias'] + (-c if (n.op == 'Sub' and dataFirst) else c)
+            elif n.op == 'Mul':
+                scale, shift = scale * c, shift * c
+            elif n.op == 'Sub' and not dataFirst:
+                scale, shift = -scale, c - shift
+            else:
+                shift = shift + (-c if n.op == 'Sub' else c)
+        elif n.op in ('Relu', 'Tanh', 'Sigmoid'):
+            if activated:
+                raise RuntimeError('Activation %s does not follow a dense layer' % n.name)
+            layers[-1]['activation'] = n.op
+            activated = True
+        else:
+            raise RuntimeError('Unsupported operation %s in %s' % (n.op, n.name))
+
+    if not layers:
+        raise RuntimeError('No dense layer between %s and %s' % (inputLayer, outputLayer))
+    if np.any(scale != 1.) or np.any(shift != 0.):
+        raise RuntimeError('Elementwise operations after the last activation are not supported')
+    return layers
+
+
+def fnv1a(data):
+    h = 0xcbf29ce484222325
+    for byte in data:
+        h = ((h ^ byte) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+
+def pad(buffer, start):
+    buffer.extend(b'\0' * ((ALIGNMENT - (start + len(buffer)) % ALIGNMENT) % ALIGNMENT))
+
+
+def encode_region(start, inputs, inputLayer, outputLayer, decoder, layers):
+    """Bytes of the region and size of its metadata"""
+    def string(s):
+        b = s.encode()
+        return struct.pack('<I', len(b)) + b
+
+    nOut = np.asarray(layers[-1]['weights']).shape[1]
+    if nOut != len(decoder):
+        raise RuntimeError('%d outputs for %d classes of the decoder' % (nOut, len(decoder)))
+    buffer = bytearray(struct.pack('<I', len(inputs)))
+    for name in inputs:
+        buffer += string(name)
+    buffer += string(inputLayer) + string(outputLayer)
+    buffer += struct.pack('<I', len(decoder))
+    for decision in decoder:
+        buffer += struct.pack('<3i', *decision)
+    metadataSize = len(buffer)
+    buffer += struct.pack('<I', len(layers))
+    for layer in layers:
+        weights = np.asarray(layer['weights'], np.float32)
+        nIn, nOut = weights.shape
+        nOutPad = (nOut + PADDING - 1) // PADDING * PADDING
+        pad(buffer, start)
+        buffer += struct.pack('<4I', nIn, nOut, nOutPad, ACTIVATIONS[layer['activation']])
+        pad(buffer, start)
+        padded = np.zeros((nIn, nOutPad), '<f4')
+        padded[:, :nOut] = weights
+        bias = np.zeros(nOutPad, '<f4')
+        bias[:nOut] = layer['bias']
+        buffer += padded.tobytes() + bias.tobytes()
+    return bytes(buffer), metadataSize
+
+
+def write_bundle(path, regions):
+    """regions: list of (name, inputs, inputLayer, outputLayer, decoder, layers)"""
+    headerSize = len(MAGIC) + 8 + len(regions) * (16 + 40)
+    offset = (headerSize + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+    table, sections = bytearray(), bytearray()
+    for name, inputs, inputLayer, outputLayer, decoder, layers in regions:
+        if len(name.encode()) > 16:
+            raise RuntimeError('Region name %s longer than 16 characters' % name)
+        section, metadataSize = encode_region(offset, inputs, inputLayer, outputLayer, decoder, layers)
+        table += struct.pack('<16sQQQQQ', name.encode(), offset, len(section), metadataSize,
+                             fnv1a(section[:metadataSize]), fnv1a(section[metadataSize:]))
+        sections += section
+        sections += b'\0' * ((ALIGNMENT - len(section) % ALIGNMENT) % ALIGNMENT)
+        offset = (offset + len(section) + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+    header = MAGIC + struct.pack('<II', len(regions), 0) + table
+    header += b'\0' * ((ALIGNMENT - len(header) % ALIGNMENT) % ALIGNMENT)
+    with open(path, 'wb') as f:
+        f.write(header + sections)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Build the OI seeding strategy bundle')
+    parser.add_argument('output', help='bundle to write')
+    parser.add_argument('regions', nargs='+', help='region:graph.pb:metadata.root, regions barrel and endcap')
+    args = parser.parse_args()
+
+    regions = []
+    for spec in args.regions:
+        name, graph, metadata = spec.split(':')
+        inputs, inputLayer, outputLayer, decoder = read_metadata(metadata)
+        layers = extract_layers(graph, inputLayer, outputLayer)
+        regions.append((name, inputs, inputLayer, outputLayer, decoder, layers))
+        print('%s: %d inputs, %d classes, layers %s' % (name, len(inputs), len(decoder),
+                                                         [l['weights'].shape for l in layers]))
+    write_bundle(args.output, regions)
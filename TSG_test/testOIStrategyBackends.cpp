@@ -0,0 +1,118 @@
+/**
+  Native (float, fp16, int8) strategy DNN backends of TSGForOIFromL2 against the TensorFlow session,
+  on a few hand-picked feature rows, with the models of RecoMuon/TrackerSeedGenerator/data
+ */
+
+#include "RecoMuon/TrackerSeedGenerator/plugins/OIStrategyModel.h"
+#include "RecoMuon/TrackerSeedGenerator/plugins/TSGForOIDnnFeatures.h"
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+  // Hand-picked feature rows, in the slots of TSGForOIDnnFeatures, not taken from reconstructed L2's: values
+  // like those of the barrel, the overlap and the endcaps, of low and high pT, one without a muon-system state.
+  // They were chosen away from near ties: their best class is ahead of the next one by more than the fp16 and
+  // int8 rounding changes the outputs, so that the decisions of all precisions are those of TensorFlow.
+  const std::vector<std::array<float, TSGForOIDnnFeatures::kNFeatures> > kRows = {
+      {{3.11, -0.598, -1.869, 16, -0.574, -1.867, 3.19, -0.574, -1.867, 0.006, 0.0013, 0.0027, 0.44, 2.9, 1,
+        -0.541, -1.911, 3.11, -0.541, -1.911, 0.0046, 0.0011, 0.0018, 2.3, 2.9, 1}},
+      {{6.74, 1.104, -2.524, 11, 1.114, -2.506, 6.58, 1.114, -2.506, 0.0048, 0.0011, 0.0084, 0.46, 1.7, 1,
+        1.115, -2.548, 6.78, 1.115, -2.548, 0.0053, 0.0029, 0.0067, 0.2, 0.32, 1}},
+      {{9.14, 1.7, -3.125, 15, 1.683, -3.136, 9.25, 1.683, -3.136, 0.00044, 0.0098, 0.018, 2.3, 0.31, 1,
+        1.711, -3.097, 8.47, 1.711, -3.097, 0.014, 0.0018, 0.007, 1, 1.4, 1}},
+      {{4.05, -1.469, -2.032, 14, -1.477, -2.06, 3.76, -1.477, -2.06, 0.017, 0.0013, 0.021, 0.38, 1.9, 1,
+        -1.458, -2.021, 4.27, -1.458, -2.021, 0.001, 0.0023, 0.0092, 0.13, 3.3, 1}},
+      {{84.6, -2.069, 2.192, 21, -2.098, 2.225, 90.2, -2.098, 2.225, 0.0084, 0.011, 0.018, 0.13, 0.49, 1,
+        -999, -999, -999, -999, -999, -999, -999, -999, -999, -999, 0}},
+      {{111, -1.924, -0.214, 9, -1.928, -0.278, 106, -1.928, -0.278, 0.00038, 0.0043, 0.013, 2.2, 0.71, 1,
+        -1.923, -0.13, 107, -1.923, -0.13, 0.0035, 0.0074, 0.022, 0.12, 1.9, 1}}};
+
+  // Largest output difference to TensorFlow, per precision of the native backend
+  float tolerance(const std::string& precision) {
+    if (precision == "fp16")
+      return 5e-3;
+    if (precision == "int8")
+      return 2e-2;
+    return 1e-4;
+  }
+}  // namespace
+
+class testOIStrategyBackends : public CppUnit::TestFixture {
+  CPPUNIT_TEST_SUITE(testOIStrategyBackends);
+  CPPUNIT_TEST(checkFloat);
+  CPPUNIT_TEST(checkHalf);
+  CPPUNIT_TEST(checkInt8);
+  CPPUNIT_TEST_SUITE_END();
+
+public:
+  void setUp() override {}
+  void tearDown() override {}
+
+  void checkFloat() { check("float"); }
+  void checkHalf() { check("fp16"); }
+  void checkInt8() { check("int8"); }
+
+private:
+  void check(const std::string& precision);
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(testOIStrategyBackends);
+
+//
+// Outputs within the tolerance of the precision, and the same decoded decision, for both models
+//
+void testOIStrategyBackends::check(const std::string& precision) {
+  for (const std::string seeds : {"5", "7"}) {
+    const auto model = OIStrategyModel::get("RecoMuon/TrackerSeedGenerator/data/dnn_" + seeds + "_seeds_0.pb",
+                                            "RecoMuon/TrackerSeedGenerator/data/metadata_" + seeds + "_seeds.root",
+                                            "",
+                                            OIStrategyBackend::Type::Native,
+                                            precision,
+                                            true);
+    CPPUNIT_ASSERT(model->reference() != nullptr);
+
+    // Rows in the input order of the model
+    const unsigned int nInputs = model->inputNames().size();
+    const unsigned int nRows = kRows.size();
+    std::vector<float> input;
+    for (const auto& row : kRows) {
+      for (const std::string& name : model->inputNames()) {
+        const auto it = std::find(TSGForOIDnnFeatures::names.begin(), TSGForOIDnnFeatures::names.end(), name);
+        CPPUNIT_ASSERT_MESSAGE("unknown DNN input " + name, it != TSGForOIDnnFeatures::names.end());
+        input.push_back(row[it - TSGForOIDnnFeatures::names.begin()]);
+      }
+    }
+
+    std::vector<float> native, reference;
+    model->backend().evaluate(input, nRows, nInputs, native);
+    model->reference()->evaluate(input, nRows, nInputs, reference);
+    CPPUNIT_ASSERT_EQUAL(reference.size(), native.size());
+    const unsigned int nClasses = reference.size() / nRows;
+    for (unsigned int row = 0; row != nRows; ++row) {
+      const auto first = row * nClasses;
+      for (unsigned int i = first; i != first + nClasses; ++i) {
+        std::ostringstream message;
+        message << "dnn_" << seeds << "_seeds " << precision << " row " << row << " class " << i - first << ": "
+                << native[i] << " vs tensorflow " << reference[i];
+        CPPUNIT_ASSERT_MESSAGE(message.str(), std::abs(native[i] - reference[i]) <= tolerance(precision));
+      }
+      const int nativeClass = std::max_element(native.begin() + first, native.begin() + first + nClasses) -
+                              (native.begin() + first);
+      const int referenceClass = std::max_element(reference.begin() + first, reference.begin() + first + nClasses) -
+                                 (reference.begin() + first);
+      std::ostringstream message;
+      message << "dnn_" << seeds << "_seeds " << precision << " row " << row << ": class " << nativeClass
+              << " vs tensorflow " << referenceClass;
+      CPPUNIT_ASSERT_MESSAGE(message.str(), model->decode(nativeClass) == model->decode(referenceClass));
+    }
+  }
+}
+
+#include "Utilities/Testing/interface/CppUnit_testdriver.icpp"
@@ -53,10 +53,80 @@ def customizeOIseeding(process, newProcessName = "MYHLT"):
         tsosDiff2 = cms.double(0.02),
         getStrategyFromDNN = cms.bool(True), # will override max nSeeds of all types and Run2-behavior flags
         etaSplitForDnn = cms.double(1.0),
+        dnnBackend = cms.string('tensorflow'), # 'tensorflow', 'native' or 'onnx'
+        dnnPrecision = cms.string('float'), # 'float', or quantized 'fp16' or 'int8' with the native backend
+        validateDnnBackend = cms.bool(False), # compare decisions and latency of the backend to TensorFlow
+        dnnBatchSize = cms.uint32(0), # DNN rows per batch across events and streams, 0: evaluate in each event
+        dnnBatchMaxWait = cms.uint32(200), # longest wait [us] of an event for its batch to fill
+        parallelizeL2s = cms.bool(False), # seed the L2s of an event as parallel tasks
+        shareCompatibleDetSearch = cms.bool(False), # search the compatible dets once per layer with the widest error rescaling
+        validateSharedDetSearch = cms.bool(False), # search the filtered rescalings exactly too and count the L2's that differ
+        approximateMuSFeatures = cms.bool(False), # DNN MuS features from the IP state instead of the stepping helix propagation
+        trackerBoundMap = cms.string(''), # parametrized MuS propagation, see TSGForOITrackerBoundMapMaker
+        trackerBoundMapMinEntries = cms.uint32(20), # L2's of a map bin to use it, else the stepping helix
+        hitMultipletDepth = cms.uint32(1), # hits added to the first one in hit-based doublet seeds, 2: triplets
+        hitMultipletBeamWidth = cms.uint32(1), # multiplet candidates kept per added hit
+        hitMultipletBranching = cms.uint32(1), # hits tried per candidate on each next layer
+        helixPrescreen = cms.bool(False), # skip hitless seeds on layers a uniform-field helix misses
+        helixPrescreenTolerance = cms.double(10.), # beyond the layer bounds [cm]
+        validateHelixPrescreen = cms.bool(False), # search the rejected layers anyway and count wrong rejections
+        hitIndexLayers = cms.uint32(0), # outer TOB/TEC layers indexed per event, 0: none; each unpacked fully when first searched with hits
+        hitIndexNSigma = cms.double(10.), # hit window [std. dev.], at least sqrt(MaxChi2) of the estimator
+        maxSeedsPerEvent = cms.uint32(0), # event-wide seed budget, 0: none
+        minSeedsPerL2 = cms.uint32(1), # seeds of each L2 kept within the budget
+        seedRanking = cms.string('chi2'), # 'chi2', 'l2Pt' or 'dnnConfidence': order filling the budget
+        seedDuplicateChi2 = cms.double(0.), # drop seeds duplicating an earlier one within this chi2, 0: keep all
+        seedDuplicateCellSize = cms.double(0.5), # cell size [cm] of the duplicate search
+        mergeL2Chi2 = cms.double(0.), # seed compatible L2s once, 0: seed every L2
+        ioL3Tracks = cms.InputTag(''), # IO L3 tracks, e.g. 'hltIter3IterL3MuonMerged', with IO run before OI
+        ioL3MuonTrackLinks = cms.InputTag(''), # or their links, e.g. 'hltL3MuonsIterL3IO'
+        ioMatchDeltaR = cms.double(0.1), # L2-L3 matching window in dR
+        ioMatchRelDeltaPt = cms.double(0.5), # and in |pT(L2)-pT(L3)|/pT(L3)
+        ioMatchedL2Seeding = cms.string('none'), # seeds of matched L2s: 'none' or 'hitless'
+        produceTiming = cms.bool(False), # per-event stage times, needs TSGFOROI_TIMING at compile time
         dnnModelPath_barrel = cms.string('RecoMuon/TrackerSeedGenerator/data/dnn_5_seeds_0.pb'),
         dnnMetadataPath_barrel = cms.string('RecoMuon/TrackerSeedGenerator/data/metadata_5_seeds.root'),
         dnnModelPath_endcap = cms.string('RecoMuon/TrackerSeedGenerator/data/dnn_7_seeds_0.pb'),
         dnnMetadataPath_endcap = cms.string('RecoMuon/TrackerSeedGenerator/data/metadata_7_seeds.root'),
+        dnnOnnxModelPath_barrel = cms.string('RecoMuon/TrackerSeedGenerator/data/dnn_5_seeds_0.onnx'), # see convertStrategyDnnToOnnx.py
+        dnnOnnxModelPath_endcap = cms.string('RecoMuon/TrackerSeedGenerator/data/dnn_7_seeds_0.onnx'),
+        dnnBundlePath = cms.string(''), # e.g. 'RecoMuon/TrackerSeedGenerator/data/oi_strategy.bundle', see makeStrategyBundle.py
     )
 
+    # Strip modules the hit-based OI seeds search, for an on-demand strip unpacker to consume
+    seeds = process.hltIterL3OISeedsFromL2Muons
+    process.hltIterL3OIStripDetIdsFromL2Muons = cms.EDProducer( "TSGForOIDetIdsFromL2",
+        src = cms.InputTag(seeds.src.value()),
+        estimator = cms.string(seeds.estimator.value()),
+        propagatorName = cms.string(seeds.propagatorName.value()),
+        maxEtaForTOB = cms.double(seeds.maxEtaForTOB.value()),
+        minEtaForTEC = cms.double(seeds.minEtaForTEC.value()),
+        errorRescaleFactor = cms.double(seeds.fixedErrorRescaleFactorForHits.value()), # widest rescaling of the hit-based seeds
+        adjustErrorsDynamically = cms.bool(seeds.adjustErrorsDynamicallyForHits.value()), # or the SF of each L2, as the seeds
+        maxLayers = cms.uint32(0), # outermost layers covered, 0: all
+    )
+    for name in ('pT1', 'pT2', 'pT3', 'eta1', 'eta2', 'eta3', 'eta4', 'eta5', 'eta6',
+                 'SF1', 'SF2', 'SF3', 'SF4', 'SF5', 'SF6'):
+        setattr(process.hltIterL3OIStripDetIdsFromL2Muons, name, cms.double(getattr(seeds, name).value()))
+
+    return process
+
+
+def customizeOIseedingTrackerBoundMap(process, fileName = "trackerBoundMap.root"):
+    # Fill the parametrized MuS propagation (trackerBoundMap) from the L2s of the sample
+    seeds = process.hltIterL3OISeedsFromL2Muons
+    process.hltIterL3OITrackerBoundMapMaker = cms.EDAnalyzer( "TSGForOITrackerBoundMapMaker",
+        src = cms.InputTag(seeds.src.value()),
+        propagatorName = cms.string('hltESPSteppingHelixPropagatorOpposite'), # as for the MuS states of the seeds
+        fileName = cms.string(fileName),
+        nEta = cms.uint32(48), # bins in eta of the muon-system position
+        maxEta = cms.double(2.4),
+        nPhi = cms.uint32(12), # bins in phi of the muon-system position
+        nQoverPt = cms.uint32(20), # bins in q/pT [1/GeV]
+        maxQoverPt = cms.double(0.5),
+    )
+    process.hltIterL3OITrackerBoundMapPath = cms.EndPath(process.hltIterL3OITrackerBoundMapMaker)
+    if process.schedule_() is not None:
+        process.schedule_().append(process.hltIterL3OITrackerBoundMapPath)
+
     return process